@@ -0,0 +1,362 @@
+// Load generator for KVDataStore. Preloads a key space, then runs a mix of
+// read, create, remove and batchCreate calls from several threads for a
+// fixed time and reports throughput and latency percentiles per operation.
+//
+//   g++ -std=c++17 -O2 -pthread kvbench.cpp -o kvbench -lz
+//   ./kvbench --threads 8 --keys 100000 --read-ratio 0.9 --zipf 0.99
+//
+// Run with --help for every option. --json prints one line of results
+// instead of the table, for comparing runs against a baseline.
+#include "kvstoe.hpp"
+#include <cmath>
+#include <iomanip>
+#include <random>
+
+struct BenchConfig {
+    size_t threads = 4;
+    double seconds = 5;
+    size_t keys = 100000;
+    size_t keyMin = 16;
+    size_t keyMax = 16;
+    size_t valueMin = 100;
+    size_t valueMax = 100;
+    double readRatio = 0.9;
+    // Share of writes that are a batchCreate of batchSize new keys.
+    double batchRatio = 0.0;
+    size_t batchSize = 100;
+    // 0 picks keys uniformly; 0.99 is the usual YCSB skew.
+    double zipf = 0.0;
+    string dataPath = "kvbench.json";
+    bool json = false;
+    bool lockReport = false;
+    KVOptions options;
+};
+
+// Zipfian ranks in [0, n) after Gray et al., "Quickly Generating
+// Billion-Record Synthetic Databases", as used by YCSB. Setup is O(n), each
+// draw O(1). Rank 0 is the hottest; callers scramble ranks into keys so the
+// hot keys are not neighbours.
+class ZipfGenerator {
+private:
+    size_t n;
+    double theta;
+    double alpha = 0;
+    double zetan = 0;
+    double eta = 0;
+
+    static double zeta(size_t n, double theta) {
+        double sum = 0;
+        for (size_t i = 1; i <= n; ++i) sum += 1.0 / pow(static_cast<double>(i), theta);
+        return sum;
+    }
+
+public:
+    ZipfGenerator(size_t count, double skew) : n(count), theta(skew) {
+        if (theta <= 0) return;
+        double zeta2 = zeta(2, theta);
+        zetan = zeta(n, theta);
+        alpha = 1.0 / (1.0 - theta);
+        eta = (1.0 - pow(2.0 / static_cast<double>(n), 1.0 - theta)) / (1.0 - zeta2 / zetan);
+    }
+
+    template <typename Rng>
+    size_t operator()(Rng& rng) const {
+        double u = uniform_real_distribution<double>(0.0, 1.0)(rng);
+        if (theta <= 0) return min(n - 1, static_cast<size_t>(u * static_cast<double>(n)));
+        double uz = u * zetan;
+        if (uz < 1.0) return 0;
+        if (uz < 1.0 + pow(0.5, theta)) return min<size_t>(1, n - 1);
+        return min(n - 1, static_cast<size_t>(static_cast<double>(n) * pow(eta * u - eta + 1.0, alpha)));
+    }
+};
+
+enum BenchOp { OP_READ, OP_CREATE, OP_REMOVE, OP_BATCH, OP_COUNT };
+
+static const char* const OP_NAMES[OP_COUNT] = {"read", "create", "remove", "batchCreate"};
+
+struct ThreadResult {
+    array<vector<uint32_t>, OP_COUNT> latencies;
+    array<uint64_t, OP_COUNT> errors{};
+};
+
+static uint64_t mix(uint64_t x) {
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdull;
+    x ^= x >> 33;
+    x *= 0xc4ceb9fe1a85ec53ull;
+    x ^= x >> 33;
+    return x;
+}
+
+// Key i always has the same text, so every thread and the preload agree.
+static string keyFor(const BenchConfig& config, size_t i) {
+    uint64_t h = mix(i + 1);
+    size_t width = config.keyMin + h % (config.keyMax - config.keyMin + 1);
+    string key = "k" + to_string(i);
+    if (key.size() < width) key.append(width - key.size(), '.');
+    return key;
+}
+
+// A json string whose dump() is a value size from the configured range.
+static json valueFor(const BenchConfig& config, mt19937_64& rng) {
+    size_t size = uniform_int_distribution<size_t>(config.valueMin, config.valueMax)(rng);
+    return json(string(size > 2 ? size - 2 : 0, 'v'));
+}
+
+static void preload(KVDataStore& store, const BenchConfig& config) {
+    mt19937_64 rng(1);
+    vector<pair<string, json>> batch;
+    for (size_t i = 0; i < config.keys; ++i) {
+        batch.emplace_back(keyFor(config, i), valueFor(config, rng));
+        if (batch.size() == 1000 || i + 1 == config.keys) {
+            store.batchCreate(batch);
+            batch.clear();
+        }
+    }
+}
+
+static bool isError(const string& result) {
+    return result.compare(0, 6, "Error:") == 0;
+}
+
+static void worker(KVDataStore& store, const BenchConfig& config, const ZipfGenerator& zipf, size_t id,
+                   const atomic<bool>& stop, ThreadResult& result) {
+    mt19937_64 rng(1000 + id);
+    uniform_real_distribution<double> coin(0.0, 1.0);
+    auto pick = [&]() { return mix(zipf(rng)) % config.keys; };
+    // Batches insert keys past the preloaded range, since a batch that
+    // hits one existing key is rejected as a whole.
+    size_t fresh = config.keys + id * (size_t(1) << 40);
+
+    while (!stop.load(memory_order_relaxed)) {
+        BenchOp op;
+        double roll = coin(rng);
+        if (roll < config.readRatio) {
+            op = OP_READ;
+        } else if (coin(rng) < config.batchRatio) {
+            op = OP_BATCH;
+        } else {
+            // Creates and removes balance out, so the key space stays
+            // about as full as the preload left it.
+            op = coin(rng) < 0.5 ? OP_CREATE : OP_REMOVE;
+        }
+
+        vector<pair<string, json>> batch;
+        string key;
+        json value;
+        if (op == OP_BATCH) {
+            for (size_t i = 0; i < config.batchSize; ++i) {
+                batch.emplace_back(keyFor(config, fresh++), valueFor(config, rng));
+            }
+        } else {
+            key = keyFor(config, pick());
+            if (op == OP_CREATE) value = valueFor(config, rng);
+        }
+
+        auto start = chrono::steady_clock::now();
+        string outcome;
+        switch (op) {
+        case OP_READ: outcome = store.read(key); break;
+        case OP_CREATE: outcome = store.create(key, value); break;
+        case OP_REMOVE: outcome = store.remove(key); break;
+        case OP_BATCH: outcome = store.batchCreate(batch); break;
+        default: break;
+        }
+        auto nanos = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count();
+        result.latencies[op].push_back(static_cast<uint32_t>(min<int64_t>(nanos, UINT32_MAX)));
+        if (isError(outcome)) ++result.errors[op];
+    }
+}
+
+static double percentile(const vector<uint32_t>& sorted, double p) {
+    if (sorted.empty()) return 0;
+    size_t rank = min(sorted.size() - 1, static_cast<size_t>(p * static_cast<double>(sorted.size())));
+    return sorted[rank] / 1000.0;
+}
+
+static void usage(const char* program) {
+    cerr << "Usage: " << program << " [options]\n"
+         << "  --threads N          worker threads (4)\n"
+         << "  --seconds S          measured run time (5)\n"
+         << "  --keys N             key space, all preloaded (100000)\n"
+         << "  --key-size MIN[-MAX] key length in bytes, at most 32 (16)\n"
+         << "  --value-size MIN[-MAX] serialized value size, at most 16384 (100)\n"
+         << "  --read-ratio R       share of operations that are reads (0.9)\n"
+         << "  --batch-ratio R      share of writes that batchCreate new keys (0)\n"
+         << "  --batch-size N       keys per batchCreate (100)\n"
+         << "  --zipf THETA         key skew, 0 for uniform (0)\n"
+         << "  --data PATH          datastore file, removed before and after (kvbench.json)\n"
+         << "  --shards N --bytes --lock-free --flat --pooled --ordered --no-metrics\n"
+         << "  --lock-profile       print shard lock wait and hold times per call site\n"
+         << "  --compress BYTES     deflate values of at least BYTES\n"
+         << "  --durability none|periodic|group --budget BYTES\n"
+         << "  --json               print results as one JSON line" << endl;
+}
+
+static void parseRange(const string& text, size_t& low, size_t& high) {
+    size_t dash = text.find('-');
+    low = stoul(text.substr(0, dash));
+    high = dash == string::npos ? low : stoul(text.substr(dash + 1));
+}
+
+static bool parseArgs(int argc, char** argv, BenchConfig& config) {
+    for (int i = 1; i < argc; ++i) {
+        string arg = argv[i];
+        bool hasValue = i + 1 < argc;
+        if (arg == "--threads" && hasValue) {
+            config.threads = stoul(argv[++i]);
+        } else if (arg == "--seconds" && hasValue) {
+            config.seconds = stod(argv[++i]);
+        } else if (arg == "--keys" && hasValue) {
+            config.keys = stoul(argv[++i]);
+        } else if (arg == "--key-size" && hasValue) {
+            parseRange(argv[++i], config.keyMin, config.keyMax);
+        } else if (arg == "--value-size" && hasValue) {
+            parseRange(argv[++i], config.valueMin, config.valueMax);
+        } else if (arg == "--read-ratio" && hasValue) {
+            config.readRatio = stod(argv[++i]);
+        } else if (arg == "--batch-ratio" && hasValue) {
+            config.batchRatio = stod(argv[++i]);
+        } else if (arg == "--batch-size" && hasValue) {
+            config.batchSize = stoul(argv[++i]);
+        } else if (arg == "--zipf" && hasValue) {
+            config.zipf = stod(argv[++i]);
+        } else if (arg == "--data" && hasValue) {
+            config.dataPath = argv[++i];
+        } else if (arg == "--shards" && hasValue) {
+            config.options.shardCount = stoul(argv[++i]);
+        } else if (arg == "--bytes") {
+            config.options.valueMode = ValueMode::Bytes;
+        } else if (arg == "--lock-free") {
+            config.options.lockFreeReads = true;
+        } else if (arg == "--flat") {
+            config.options.indexBackend = IndexBackend::Flat;
+        } else if (arg == "--pooled") {
+            config.options.allocation = AllocationMode::Pooled;
+        } else if (arg == "--ordered") {
+            config.options.orderedIndex = true;
+        } else if (arg == "--no-metrics") {
+            config.options.metrics = false;
+        } else if (arg == "--lock-profile") {
+            config.options.lockProfiling = true;
+            config.lockReport = true;
+        } else if (arg == "--compress" && hasValue) {
+            config.options.compression = Compression::Deflate;
+            config.options.compressionThreshold = stoul(argv[++i]);
+        } else if (arg == "--budget" && hasValue) {
+            config.options.memoryBudget = stoul(argv[++i]);
+        } else if (arg == "--durability" && hasValue) {
+            string mode = argv[++i];
+            if (mode == "none") {
+                config.options.durability = Durability::None;
+            } else if (mode == "periodic") {
+                config.options.durability = Durability::Periodic;
+            } else if (mode == "group") {
+                config.options.durability = Durability::GroupCommit;
+            } else {
+                return false;
+            }
+        } else if (arg == "--json") {
+            config.json = true;
+        } else {
+            return false;
+        }
+    }
+    return config.threads > 0 && config.keys > 0 && config.keyMin >= 1 && config.keyMin <= config.keyMax &&
+           config.keyMax <= 32 && config.valueMin <= config.valueMax && config.valueMax <= 16 * 1024;
+}
+
+static void removeFiles(const string& path) {
+    for (const char* suffix : {"", ".log", ".log.1", ".tmp"}) {
+        filesystem::remove(path + suffix);
+    }
+}
+
+int main(int argc, char** argv) {
+    BenchConfig config;
+    if (!parseArgs(argc, argv, config)) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    removeFiles(config.dataPath);
+    vector<ThreadResult> results(config.threads);
+    double elapsed = 0;
+    vector<LockSiteStats> locks;
+    {
+        KVDataStore store(config.dataPath, config.options);
+        preload(store, config);
+        ZipfGenerator zipf(config.keys, config.zipf);
+
+        atomic<bool> stop{false};
+        vector<thread> workers;
+        auto start = chrono::steady_clock::now();
+        for (size_t i = 0; i < config.threads; ++i) {
+            workers.emplace_back(worker, ref(store), cref(config), cref(zipf), i, cref(stop), ref(results[i]));
+        }
+        this_thread::sleep_for(chrono::duration<double>(config.seconds));
+        stop = true;
+        for (auto& t : workers) t.join();
+        elapsed = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        locks = store.lockProfile();
+    }
+    removeFiles(config.dataPath);
+
+    json report = {{"threads", config.threads}, {"seconds", elapsed}, {"keys", config.keys},
+                   {"readRatio", config.readRatio}, {"zipf", config.zipf}};
+    uint64_t total = 0;
+    if (!config.json) {
+        cout << left << setw(12) << "op" << right << setw(12) << "ops" << setw(14) << "ops/s" << setw(10)
+             << "errors" << setw(10) << "p50 us" << setw(10) << "p99 us" << setw(10) << "p999 us" << setw(10)
+             << "max us" << '\n';
+    }
+    for (size_t op = 0; op < OP_COUNT; ++op) {
+        vector<uint32_t> all;
+        uint64_t errors = 0;
+        for (auto& r : results) {
+            all.insert(all.end(), r.latencies[op].begin(), r.latencies[op].end());
+            errors += r.errors[op];
+        }
+        if (all.empty()) continue;
+        sort(all.begin(), all.end());
+        total += all.size();
+        double rate = static_cast<double>(all.size()) / elapsed;
+        double p50 = percentile(all, 0.5), p99 = percentile(all, 0.99), p999 = percentile(all, 0.999);
+        double worst = all.back() / 1000.0;
+        if (config.json) {
+            report[OP_NAMES[op]] = {{"ops", all.size()}, {"opsPerSec", rate}, {"errors", errors},
+                                    {"p50us", p50}, {"p99us", p99}, {"p999us", p999}, {"maxUs", worst}};
+        } else {
+            cout << left << setw(12) << OP_NAMES[op] << right << setw(12) << all.size() << setw(14) << fixed
+                 << setprecision(0) << rate << setw(10) << errors << setprecision(1) << setw(10) << p50
+                 << setw(10) << p99 << setw(10) << p999 << setw(10) << worst << '\n';
+        }
+    }
+    if (config.lockReport && !config.json) {
+        cout << '\n' << left << setw(12) << "lock site" << right << setw(12) << "acquired" << setw(12)
+             << "contended" << setw(12) << "wait ms" << setw(12) << "wait p999" << setw(12) << "hold ms"
+             << setw(12) << "hold p999" << '\n';
+        for (const auto& l : locks) {
+            cout << left << setw(12) << l.site << right << setw(12) << l.acquisitions << setw(12) << l.contended
+                 << fixed << setprecision(1) << setw(12) << l.totalWaitUs / 1000 << setw(12) << l.wait.p999Us
+                 << setw(12) << l.totalHoldUs / 1000 << setw(12) << l.hold.p999Us << '\n';
+        }
+        cout << '\n';
+    }
+    if (config.lockReport && config.json) {
+        for (const auto& l : locks) {
+            report["locks"][l.site] = {{"acquisitions", l.acquisitions}, {"contended", l.contended},
+                                       {"waitUs", l.totalWaitUs}, {"waitP999Us", l.wait.p999Us},
+                                       {"holdUs", l.totalHoldUs}, {"holdP999Us", l.hold.p999Us}};
+        }
+    }
+    double overall = static_cast<double>(total) / elapsed;
+    if (config.json) {
+        report["opsPerSec"] = overall;
+        cout << report.dump() << endl;
+    } else {
+        cout << "total " << total << " ops in " << setprecision(2) << elapsed << " s, " << setprecision(0)
+             << overall << " ops/s" << endl;
+    }
+    return 0;
+}
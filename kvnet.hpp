@@ -0,0 +1,1479 @@
+#pragma once
+
+#include "kvstoe.hpp"
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <cerrno>
+#include <unordered_set>
+
+// Wire protocol: newline-delimited JSON. Each request is one object on one
+// line, {"id": any, "op": name, ...arguments}, and gets exactly one response
+// line, in request order, so a client may pipeline as many requests as it
+// likes before reading the answers:
+//
+//   {"id": 1, "ok": true, "result": ...}
+//   {"id": 1, "ok": false, "error": "Error: Key not found."}
+//
+// The id is echoed back unchanged (null if absent). Operations:
+//   create, update, upsert      key, value, ttl (optional; update and upsert
+//                               keep an existing key's expiry without one)
+//   read, remove                key
+//   patch, merge_patch          key, patch
+//   batch_create                entries: [{key, value}], ttl (optional)
+//   batch_read, batch_remove    keys: [key]
+//   batch                       items: [{op: "create" | "remove", key, value, ttl}]
+//   scan                        prefix, or first and last; limit, cursor, expiries
+//   stats, metrics, position, ping
+// scan returns entries as [key, value], or [key, value, expiry] with
+// "expiries": true, where expiry is the absolute expiry time or 0 for none.
+// read returns the stored value as result; batch_read returns an array
+// with null for keys that are missing or expired; writes return the
+// store's message; stats returns counters and latency summaries as an
+// object and metrics the Prometheus text of KVDataStore::metricsText().
+// position returns {epoch, lsn} of the store's log; send it as "after" on a
+// read from a follower to read what was written before it.
+//
+// A server in front of a follower refuses writes, and a read carrying
+// "after" waits as the follower's consistency mode says. A waiting read
+// holds up the requests after it on its connection only; the event loop
+// goes on serving the others.
+
+// What KVServer needs from a follower whose store it serves.
+class ReadReplica {
+public:
+    enum class PositionCheck {
+        Reached,     // the store reflects everything up to the position
+        Pending,     // not yet, but it may once more is applied
+        Unreachable  // never will, e.g. a position from an earlier leader
+    };
+
+    virtual ~ReadReplica() = default;
+    // Answers at once, without waiting for the position.
+    virtual PositionCheck checkPosition(const LogPosition& position) = 0;
+    // How long a read may wait for a pending position.
+    virtual chrono::milliseconds positionTimeout() const = 0;
+    // Calls notify each time the replica applies something, on the thread
+    // that applied it, until unsubscribe() is given the returned id. notify
+    // must not block.
+    virtual uint64_t subscribe(function<void()> notify) = 0;
+    virtual void unsubscribe(uint64_t id) = 0;
+};
+
+struct KVProtocol {
+    static bool isError(const string& message) {
+        return message.compare(0, 6, "Error:") == 0;
+    }
+
+    static void reply(string& out, const string& id, bool ok, const string& payload) {
+        out += "{\"id\":";
+        out += id;
+        out += ok ? ",\"ok\":true,\"result\":" : ",\"ok\":false,\"error\":";
+        out += payload;
+        out += "}\n";
+    }
+
+    static void replyMessage(string& out, const string& id, const string& message) {
+        reply(out, id, !isError(message), json(message).dump());
+    }
+
+    static const string& keyOf(const json& request) {
+        return request.at("key").get_ref<const string&>();
+    }
+
+    static json statsJson(const KVStats& stats) {
+        json result = {{"keys", stats.keys}, {"log_bytes", stats.logBytes},
+                       {"evictions", stats.eviction.evictions}};
+        for (size_t i = 0; i < KVMetrics::COUNTER_COUNT; ++i) {
+            result[KVMetrics::counterName(static_cast<KVMetrics::Counter>(i))] = stats.counters[i];
+        }
+        for (size_t t = 0; t < KVMetrics::TIMER_COUNT; ++t) {
+            const LatencySummary& l = stats.latencies[t];
+            result["latency"][KVMetrics::timerName(static_cast<KVMetrics::Timer>(t))] = {
+                {"count", l.count}, {"mean_us", l.meanUs}, {"p50_us", l.p50Us},
+                {"p99_us", l.p99Us}, {"p999_us", l.p999Us}, {"max_us", l.maxUs}};
+        }
+        return result;
+    }
+
+    static time_t ttlOf(const json& request) {
+        auto it = request.find("ttl");
+        return it == request.end() ? 0 : it->get<time_t>();
+    }
+
+    // For update and upsert, where no ttl keeps the key's expiry.
+    static optional<time_t> ttlChangeOf(const json& request) {
+        auto it = request.find("ttl");
+        return it == request.end() ? nullopt : optional<time_t>(it->get<time_t>());
+    }
+
+    static bool isWrite(const string& op) {
+        return op == "create" || op == "update" || op == "upsert" || op == "remove" || op == "patch" ||
+               op == "merge_patch" || op == "batch_create" || op == "batch_remove" || op == "batch";
+    }
+
+    // Handles one request line and appends its response line to out.
+    // Returns false, appending nothing, for a read whose "after" position
+    // the replica has yet to reach; the caller retries it later, or with
+    // timedOut set to have it refused.
+    static bool handle(KVDataStore& store, string_view line, string& out, ReadReplica* replica = nullptr,
+                       bool timedOut = false) {
+        json request = json::parse(line.begin(), line.end(), nullptr, false);
+        if (request.is_discarded() || !request.is_object()) {
+            reply(out, "null", false, json("Error: Malformed request.").dump());
+            return true;
+        }
+        auto idIt = request.find("id");
+        string id = idIt == request.end() ? "null" : idIt->dump();
+
+        try {
+            const string& op = request.at("op").get_ref<const string&>();
+            if (replica && isWrite(op)) {
+                reply(out, id, false, json("Error: Replica is read-only.").dump());
+                return true;
+            }
+            auto after = request.find("after");
+            if (replica && after != request.end()) {
+                auto check = replica->checkPosition(
+                    {after->at("epoch").get<uint64_t>(), after->at("lsn").get<uint64_t>()});
+                if (check == ReadReplica::PositionCheck::Pending && !timedOut) return false;
+                if (check != ReadReplica::PositionCheck::Reached) {
+                    reply(out, id, false, json("Error: Replica is behind the leader.").dump());
+                    return true;
+                }
+            }
+            if (op == "read") {
+                ReadResult result = store.readView(keyOf(request));
+                if (result.ok()) {
+                    out += "{\"id\":";
+                    out += id;
+                    out += ",\"ok\":true,\"result\":";
+                    out.append(result.value.data(), result.value.size());
+                    out += "}\n";
+                } else {
+                    reply(out, id, false, json(statusMessage(result.status)).dump());
+                }
+            } else if (op == "create") {
+                replyMessage(out, id, store.create(keyOf(request), request.at("value"), ttlOf(request)));
+            } else if (op == "update") {
+                replyMessage(out, id, store.update(keyOf(request), request.at("value"), ttlChangeOf(request)));
+            } else if (op == "upsert") {
+                replyMessage(out, id, store.upsert(keyOf(request), request.at("value"), ttlChangeOf(request)));
+            } else if (op == "remove") {
+                replyMessage(out, id, store.remove(keyOf(request)));
+            } else if (op == "patch") {
+                replyMessage(out, id, store.patch(keyOf(request), request.at("patch")));
+            } else if (op == "merge_patch") {
+                replyMessage(out, id, store.mergePatch(keyOf(request), request.at("patch")));
+            } else if (op == "batch_create") {
+                vector<pair<string, json>> entries;
+                for (const auto& entry : request.at("entries")) {
+                    entries.emplace_back(keyOf(entry), entry.at("value"));
+                }
+                replyMessage(out, id, store.batchCreate(entries, ttlOf(request)));
+            } else if (op == "batch_read") {
+                vector<string> results = store.batchRead(request.at("keys").get<vector<string>>());
+                string array = "[";
+                for (size_t i = 0; i < results.size(); ++i) {
+                    if (i > 0) array += ',';
+                    array += isError(results[i]) ? "null" : results[i];
+                }
+                array += ']';
+                reply(out, id, true, array);
+            } else if (op == "batch_remove") {
+                replyMessage(out, id, store.batchRemove(request.at("keys").get<vector<string>>()));
+            } else if (op == "batch") {
+                vector<BatchItem> items;
+                for (const auto& item : request.at("items")) {
+                    BatchItem batchItem;
+                    batchItem.op = item.at("op") == "remove" ? BatchOp::Remove : BatchOp::Create;
+                    batchItem.key = keyOf(item);
+                    if (batchItem.op == BatchOp::Create) {
+                        batchItem.value = item.at("value");
+                        batchItem.ttl = ttlOf(item);
+                    }
+                    items.push_back(move(batchItem));
+                }
+                replyMessage(out, id, store.batchWrite(items));
+            } else if (op == "scan") {
+                size_t limit = request.value("limit", size_t(100));
+                string cursor = request.value("cursor", string());
+                ScanResult page = request.contains("prefix")
+                    ? store.scan(request.at("prefix").get<string>(), limit, cursor)
+                    : store.scanRange(request.at("first").get<string>(), request.at("last").get<string>(),
+                                      limit, cursor);
+                bool expiries = request.value("expiries", false);
+                string result = "{\"entries\":[";
+                for (size_t i = 0; i < page.entries.size(); ++i) {
+                    if (i > 0) result += ',';
+                    result += '[' + json(page.entries[i].first).dump() + ',' + page.entries[i].second;
+                    if (expiries) result += ',' + to_string(page.expiries[i]);
+                    result += ']';
+                }
+                result += "],\"cursor\":" + json(page.cursor).dump() + ",\"more\":" + (page.more ? "true" : "false") + '}';
+                reply(out, id, true, result);
+            } else if (op == "stats") {
+                reply(out, id, true, statsJson(store.stats()).dump());
+            } else if (op == "metrics") {
+                reply(out, id, true, json(store.metricsText()).dump());
+            } else if (op == "position") {
+                LogPosition position = store.logPosition();
+                reply(out, id, true, json({{"epoch", position.epoch}, {"lsn", position.lsn}}).dump());
+            } else if (op == "ping") {
+                reply(out, id, true, "\"pong\"");
+            } else {
+                reply(out, id, false, json("Error: Unknown operation.").dump());
+            }
+        } catch (const exception& e) {
+            reply(out, id, false, json(string("Error: Bad request: ") + e.what()).dump());
+        }
+        return true;
+    }
+};
+
+// TCP front end for a KVDataStore. Each of threadCount event loops owns
+// its own epoll instance and its own SO_REUSEPORT listening socket, so the
+// kernel spreads connections across loops and a connection never moves
+// between threads. Requests on a connection are handled in order and their
+// responses are written back together, one write per batch of pipelined
+// requests read. In front of a replica, a read waiting for an "after"
+// position parks its connection: nothing more is read or handled on it
+// until the replica reaches the position, which wakes the loops, or the
+// wait times out.
+class KVServer {
+private:
+    static constexpr size_t READ_CHUNK = 64 * 1024;
+    // A request line this long without a newline is dropped with its connection.
+    static constexpr size_t MAX_REQUEST_BYTES = 64 * 1024 * 1024;
+    // Stop reading from a client that is not collecting its responses.
+    static constexpr size_t MAX_PENDING_OUTPUT = 8 * 1024 * 1024;
+
+    struct Connection {
+        int fd = -1;
+        string in;
+        size_t scanned = 0;
+        string out;
+        size_t sent = 0;
+        bool reading = true;
+        // The first line in `in` is a read waiting for the replica, until
+        // parkedUntil at the latest.
+        bool parked = false;
+        chrono::steady_clock::time_point parkedUntil;
+    };
+
+    struct Loop {
+        int epollFd = -1;
+        int listenFd = -1;
+        // Written to stop the loop, and by the replica to resume parked
+        // connections.
+        int wakeFd = -1;
+        thread worker;
+        unordered_map<int, unique_ptr<Connection>> connections;
+        unordered_set<int> parked;
+    };
+
+    KVDataStore& store;
+    ReadReplica* replica;
+    uint64_t replicaSubscription = 0;
+    string host;
+    uint16_t boundPort;
+    size_t threadCount;
+    vector<unique_ptr<Loop>> loops;
+    atomic<bool> running{false};
+
+    int listenSocket() {
+        int fd = ::socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (fd < 0) {
+            throw runtime_error("Failed to create socket.");
+        }
+        int on = 1;
+        ::setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+        ::setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on));
+
+        sockaddr_in addr = {};
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(boundPort);
+        if (::inet_pton(AF_INET, host.c_str(), &addr.sin_addr) != 1) {
+            ::close(fd);
+            throw runtime_error("Invalid listen address " + host + ".");
+        }
+        if (::bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0 || ::listen(fd, 1024) != 0) {
+            ::close(fd);
+            throw runtime_error("Failed to listen on " + host + ":" + to_string(boundPort) + ".");
+        }
+        if (boundPort == 0) {
+            // Later loops join the port the kernel picked for the first.
+            socklen_t len = sizeof(addr);
+            ::getsockname(fd, reinterpret_cast<sockaddr*>(&addr), &len);
+            boundPort = ntohs(addr.sin_port);
+        }
+        return fd;
+    }
+
+    static void watch(Loop& loop, int fd, uint32_t events, int op) {
+        epoll_event ev = {};
+        ev.events = events;
+        ev.data.fd = fd;
+        ::epoll_ctl(loop.epollFd, op, fd, &ev);
+    }
+
+    static void closeConnection(Loop& loop, int fd) {
+        ::epoll_ctl(loop.epollFd, EPOLL_CTL_DEL, fd, nullptr);
+        ::close(fd);
+        loop.connections.erase(fd);
+        loop.parked.erase(fd);
+    }
+
+    static void wake(Loop& loop) {
+        uint64_t one = 1;
+        ssize_t ignored = ::write(loop.wakeFd, &one, sizeof(one));
+        (void)ignored;
+    }
+
+    static void acceptAll(Loop& loop) {
+        while (true) {
+            int fd = ::accept4(loop.listenFd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (fd < 0) return;
+            int on = 1;
+            ::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+            auto conn = make_unique<Connection>();
+            conn->fd = fd;
+            loop.connections.emplace(fd, move(conn));
+            watch(loop, fd, EPOLLIN | EPOLLRDHUP, EPOLL_CTL_ADD);
+        }
+    }
+
+    // Handles every complete line received so far, stopping at a read that
+    // has to wait for the replica, which parks the connection. The writes
+    // among them share one log commit, made before any response is
+    // flushed, so a pipelined burst under group commit waits for one sync
+    // rather than one per write. Returns false if that commit failed, or if
+    // the client sent more than MAX_REQUEST_BYTES without a newline.
+    bool process(Connection& conn) {
+        size_t start = 0;
+        size_t newline;
+        auto deferral = store.deferCommits();
+        while ((newline = conn.in.find('\n', max(start, conn.scanned))) != string::npos) {
+            string_view line(conn.in.data() + start, newline - start);
+            if (!line.empty() && line.back() == '\r') line.remove_suffix(1);
+            if (!line.empty()) {
+                auto now = chrono::steady_clock::now();
+                if (!KVProtocol::handle(store, line, conn.out, replica, conn.parked && now >= conn.parkedUntil)) {
+                    if (!conn.parked) {
+                        conn.parked = true;
+                        conn.parkedUntil = now + replica->positionTimeout();
+                    }
+                    break;
+                }
+                conn.parked = false;
+            }
+            start = newline + 1;
+        }
+        conn.in.erase(0, start);
+        // Lines after a parked read are complete and have to be found again.
+        conn.scanned = conn.parked ? 0 : conn.in.size();
+        try {
+            deferral.finish();
+        } catch (const exception& e) {
+            // The writes may not be durable, so their replies must not go out.
+            cerr << "Log commit failed: " << e.what() << endl;
+            return false;
+        }
+        return conn.in.size() <= MAX_REQUEST_BYTES;
+    }
+
+    // Writes as much pending output as the socket takes. Returns false if
+    // the connection failed.
+    static bool flush(Connection& conn) {
+        while (conn.sent < conn.out.size()) {
+            ssize_t n = ::send(conn.fd, conn.out.data() + conn.sent, conn.out.size() - conn.sent, MSG_NOSIGNAL);
+            if (n < 0) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+                if (errno == EINTR) continue;
+                return false;
+            }
+            conn.sent += static_cast<size_t>(n);
+        }
+        if (conn.sent == conn.out.size()) {
+            conn.out.clear();
+            conn.sent = 0;
+        }
+        return true;
+    }
+
+    void onReadable(Loop& loop, Connection& conn) {
+        char buffer[READ_CHUNK];
+        bool closed = false;
+        while (true) {
+            ssize_t n = ::recv(conn.fd, buffer, sizeof(buffer), 0);
+            if (n > 0) {
+                conn.in.append(buffer, static_cast<size_t>(n));
+                if (conn.in.size() > MAX_REQUEST_BYTES) break;
+                continue;
+            }
+            if (n == 0) {
+                closed = true;
+            } else if (errno == EINTR) {
+                continue;
+            } else if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                closed = true;
+            }
+            break;
+        }
+        if (!process(conn) || !flush(conn)) {
+            closeConnection(loop, conn.fd);
+            return;
+        }
+        if (closed && conn.out.empty() && !conn.parked) {
+            closeConnection(loop, conn.fd);
+            return;
+        }
+        if (conn.parked) loop.parked.insert(conn.fd);
+        updateInterest(loop, conn, closed);
+    }
+
+    // Retries the waiting read of every parked connection, answering it
+    // once the replica has reached its position or its time is up, then
+    // goes on with the requests behind it.
+    void resumeParked(Loop& loop) {
+        vector<int> fds(loop.parked.begin(), loop.parked.end());
+        for (int fd : fds) {
+            Connection& conn = *loop.connections.at(fd);
+            if (!process(conn) || !flush(conn)) {
+                closeConnection(loop, fd);
+                continue;
+            }
+            if (conn.parked) continue;
+            loop.parked.erase(fd);
+            // Reading resumes; a peer that hung up meanwhile is seen again.
+            updateInterest(loop, conn, false);
+        }
+    }
+
+    // Milliseconds until the first parked read times out, or -1 for none.
+    static int parkedTimeout(const Loop& loop) {
+        if (loop.parked.empty()) return -1;
+        auto first = chrono::steady_clock::time_point::max();
+        for (int fd : loop.parked) first = min(first, loop.connections.at(fd)->parkedUntil);
+        auto wait = chrono::ceil<chrono::milliseconds>(first - chrono::steady_clock::now());
+        return static_cast<int>(max<int64_t>(wait.count(), 0));
+    }
+
+    static void updateInterest(Loop& loop, Connection& conn, bool peerClosed) {
+        conn.reading = !peerClosed && !conn.parked && conn.out.size() < MAX_PENDING_OUTPUT;
+        // Hang-ups stay reported while watched, so stop watching for them
+        // once seen or the loop would spin until the output drains.
+        uint32_t events = 0;
+        if (conn.reading) events |= EPOLLIN | EPOLLRDHUP;
+        if (!conn.out.empty()) events |= EPOLLOUT;
+        watch(loop, conn.fd, events, EPOLL_CTL_MOD);
+    }
+
+    void run(Loop& loop) {
+        epoll_event events[64];
+        while (true) {
+            int count = ::epoll_wait(loop.epollFd, events, 64, parkedTimeout(loop));
+            if (count < 0) {
+                if (errno == EINTR) continue;
+                return;
+            }
+            for (int i = 0; i < count; ++i) {
+                int fd = events[i].data.fd;
+                if (fd == loop.wakeFd) {
+                    if (!running) return;
+                    uint64_t wakes;
+                    ssize_t ignored = ::read(loop.wakeFd, &wakes, sizeof(wakes));
+                    (void)ignored;
+                    continue;
+                }
+                if (fd == loop.listenFd) {
+                    acceptAll(loop);
+                    continue;
+                }
+                auto it = loop.connections.find(fd);
+                if (it == loop.connections.end()) continue;
+                Connection& conn = *it->second;
+                uint32_t ev = events[i].events;
+                if (ev & EPOLLERR) {
+                    closeConnection(loop, fd);
+                    continue;
+                }
+                if (ev & EPOLLOUT) {
+                    if (!flush(conn)) {
+                        closeConnection(loop, fd);
+                        continue;
+                    }
+                    bool hungUp = (ev & (EPOLLRDHUP | EPOLLHUP)) != 0;
+                    if (hungUp && conn.out.empty() && !conn.parked) {
+                        closeConnection(loop, fd);
+                        continue;
+                    }
+                    updateInterest(loop, conn, hungUp);
+                }
+                if (ev & (EPOLLIN | EPOLLRDHUP | EPOLLHUP)) {
+                    if (conn.reading) {
+                        onReadable(loop, conn);
+                    } else if ((ev & (EPOLLRDHUP | EPOLLHUP)) && conn.out.empty()) {
+                        closeConnection(loop, fd);
+                    }
+                }
+            }
+            if (!loop.parked.empty()) resumeParked(loop);
+        }
+    }
+
+public:
+    // Listens on host:port; port 0 picks a free one, see port(). threads 0
+    // means one event loop per hardware thread. Pass replica to serve a
+    // follower's store read-only.
+    KVServer(KVDataStore& kvStore, uint16_t port, size_t threads = 0, const string& listenHost = "0.0.0.0",
+             ReadReplica* readReplica = nullptr)
+        : store(kvStore), replica(readReplica), host(listenHost), boundPort(port),
+          threadCount(threads != 0 ? threads : max(1u, thread::hardware_concurrency())) {}
+
+    ~KVServer() {
+        stop();
+    }
+
+    KVServer(const KVServer&) = delete;
+    KVServer& operator=(const KVServer&) = delete;
+
+    void start() {
+        if (running) return;
+        for (size_t i = 0; i < threadCount; ++i) {
+            auto loop = make_unique<Loop>();
+            loop->listenFd = listenSocket();
+            loop->epollFd = ::epoll_create1(EPOLL_CLOEXEC);
+            loop->wakeFd = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+            if (loop->epollFd < 0 || loop->wakeFd < 0) {
+                throw runtime_error("Failed to set up event loop.");
+            }
+            watch(*loop, loop->listenFd, EPOLLIN, EPOLL_CTL_ADD);
+            watch(*loop, loop->wakeFd, EPOLLIN, EPOLL_CTL_ADD);
+            loops.push_back(move(loop));
+        }
+        running = true;
+        for (auto& loop : loops) {
+            Loop* l = loop.get();
+            l->worker = thread([this, l]() { run(*l); });
+        }
+        if (replica) {
+            replicaSubscription = replica->subscribe([this]() {
+                for (auto& loop : loops) wake(*loop);
+            });
+        }
+    }
+
+    // Stops every loop and closes all connections. Requests already read
+    // have been applied; responses not yet written are dropped.
+    void stop() {
+        if (!running) return;
+        // Returns once no notification is still running, so none touches
+        // the loops after they are gone.
+        if (replica) replica->unsubscribe(replicaSubscription);
+        running = false;
+        for (auto& loop : loops) wake(*loop);
+        for (auto& loop : loops) {
+            if (loop->worker.joinable()) loop->worker.join();
+            for (auto& [fd, conn] : loop->connections) ::close(fd);
+            ::close(loop->listenFd);
+            ::close(loop->wakeFd);
+            ::close(loop->epollFd);
+        }
+        loops.clear();
+    }
+
+    uint16_t port() const {
+        return boundPort;
+    }
+};
+
+// Blocking client for KVServer's protocol. One request at a time with
+// call(), or many in flight with pipeline(). Not thread-safe.
+class KVClient {
+private:
+    int fd = -1;
+    string buffer;
+    uint64_t nextId = 1;
+
+    void sendAll(const string& data) {
+        size_t sent = 0;
+        while (sent < data.size()) {
+            ssize_t n = ::send(fd, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                throw runtime_error("Failed to send to server.");
+            }
+            sent += static_cast<size_t>(n);
+        }
+    }
+
+    string readLine() {
+        size_t newline;
+        while ((newline = buffer.find('\n')) == string::npos) {
+            char chunk[64 * 1024];
+            ssize_t n = ::recv(fd, chunk, sizeof(chunk), 0);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) {
+                throw runtime_error("Connection to server closed.");
+            }
+            buffer.append(chunk, static_cast<size_t>(n));
+        }
+        string line = buffer.substr(0, newline);
+        buffer.erase(0, newline + 1);
+        return line;
+    }
+
+public:
+    KVClient(const string& host, uint16_t port) {
+        fd = ::socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd < 0) {
+            throw runtime_error("Failed to create socket.");
+        }
+        sockaddr_in addr = {};
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(port);
+        if (::inet_pton(AF_INET, host.c_str(), &addr.sin_addr) != 1 ||
+            ::connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0) {
+            ::close(fd);
+            throw runtime_error("Failed to connect to " + host + ":" + to_string(port) + ".");
+        }
+        int on = 1;
+        ::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    }
+
+    ~KVClient() {
+        if (fd >= 0) ::close(fd);
+    }
+
+    KVClient(const KVClient&) = delete;
+    KVClient& operator=(const KVClient&) = delete;
+
+    json call(json request) {
+        return pipeline({move(request)}).front();
+    }
+
+    // The halves of call(), for streams that answer one request with many
+    // lines, such as replication.
+    void send(const json& request) {
+        sendAll(request.dump() + '\n');
+    }
+
+    json receive() {
+        return json::parse(readLine());
+    }
+
+    // receive() throws if nothing arrives for this long.
+    void setReceiveTimeout(chrono::milliseconds timeout) {
+        timeval tv = {};
+        tv.tv_sec = static_cast<time_t>(timeout.count() / 1000);
+        tv.tv_usec = static_cast<suseconds_t>(timeout.count() % 1000 * 1000);
+        ::setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    }
+
+    // Wakes a receive() blocked in another thread by failing it.
+    void shutdown() {
+        ::shutdown(fd, SHUT_RDWR);
+    }
+
+    // Sends every request before reading any response. Requests without an
+    // id are numbered; responses come back in request order.
+    vector<json> pipeline(vector<json> requests) {
+        string out;
+        for (auto& request : requests) {
+            if (!request.contains("id")) request["id"] = nextId++;
+            out += request.dump();
+            out += '\n';
+        }
+        sendAll(out);
+        vector<json> responses;
+        responses.reserve(requests.size());
+        for (size_t i = 0; i < requests.size(); ++i) {
+            responses.push_back(json::parse(readLine()));
+        }
+        return responses;
+    }
+};
+
+// Replication stream, one connection per follower. The follower opens with
+//
+//   {"op": "replicate", "epoch": E, "lsn": L}
+//
+// naming the last position it applied (0, 0 for none). The leader answers
+// {"ok": true, "epoch": E', "lsn": L', "resync": bool}. If E is not its
+// epoch or L is older than its backlog, resync is true and a full copy
+// follows: one {"record": create record} line per entry, then
+// {"snapshot_end": true}; the follower empties its store first. The copy
+// is streamed a shard at a time while writes go on, and may be
+// interleaved with heartbeats; it is made consistent by the records after
+// L', which was read before it started. After that
+// come {"lsn": N, "records": [record...]} lines holding consecutive log
+// records up to N, and {"heartbeat": N} with the leader's last LSN when
+// nothing was logged for a while. A follower that falls out of the backlog
+// is disconnected, and resyncs when it reconnects.
+//
+// Streams a store's mutation log to followers; the store needs
+// options.replicationBacklog set. Each follower gets its own sender thread.
+class KVLeader {
+private:
+    static constexpr size_t MAX_BATCH_RECORDS = 1024;
+    static constexpr chrono::milliseconds POLL_INTERVAL{100};
+    static constexpr chrono::milliseconds HEARTBEAT_INTERVAL{500};
+
+    struct Session {
+        int fd = -1;
+        thread sender;
+        atomic<bool> finished{false};
+    };
+
+    KVDataStore& store;
+    string host;
+    uint16_t boundPort;
+    int listenFd = -1;
+    atomic<bool> running{false};
+    thread acceptor;
+    mutex sessionsMtx;
+    vector<unique_ptr<Session>> sessions;
+
+    static void sendAll(int fd, const string& data) {
+        size_t sent = 0;
+        while (sent < data.size()) {
+            ssize_t n = ::send(fd, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                throw runtime_error("Failed to send to follower.");
+            }
+            sent += static_cast<size_t>(n);
+        }
+    }
+
+    static string readRequest(int fd) {
+        string line;
+        char c;
+        while (true) {
+            ssize_t n = ::recv(fd, &c, 1, 0);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) throw runtime_error("Follower closed the connection.");
+            if (c == '\n') return line;
+            line += c;
+            if (line.size() > 64 * 1024) throw runtime_error("Replication request too long.");
+        }
+    }
+
+    void serve(int fd) {
+        ReplicationBacklog* backlog = store.replicationBacklog();
+        json request = json::parse(readRequest(fd));
+        if (!backlog) {
+            sendAll(fd, "{\"ok\":false,\"error\":\"Error: Replication is not enabled.\"}\n");
+            return;
+        }
+        uint64_t position = request.value("lsn", uint64_t(0));
+        bool resync = request.value("epoch", uint64_t(0)) != backlog->epoch() || !backlog->holdsAfter(position);
+        // Taken before the copy, so replaying from it covers every write
+        // the copy may have missed.
+        if (resync) position = store.logPosition().lsn;
+        sendAll(fd, json({{"ok", true}, {"epoch", backlog->epoch()}, {"lsn", position}, {"resync", resync}}).dump() + '\n');
+
+        auto lastSent = chrono::steady_clock::now();
+        string out;
+        if (resync) {
+            store.snapshotRecords([&](const vector<string>& records) {
+                for (const auto& record : records) {
+                    out += "{\"record\":" + record + "}\n";
+                    if (out.size() >= 64 * 1024) {
+                        sendAll(fd, out);
+                        out.clear();
+                    }
+                }
+                // Sent before the next shard is gathered, with a heartbeat if
+                // there is nothing to send, so the follower's leader timeout
+                // only has to cover gathering one shard.
+                if (out.empty() && chrono::steady_clock::now() - lastSent >= HEARTBEAT_INTERVAL) {
+                    out = "{\"heartbeat\":" + to_string(backlog->last()) + "}\n";
+                }
+                if (!out.empty()) {
+                    sendAll(fd, out);
+                    out.clear();
+                    lastSent = chrono::steady_clock::now();
+                }
+            });
+            sendAll(fd, "{\"snapshot_end\":true}\n");
+            lastSent = chrono::steady_clock::now();
+        }
+
+        vector<pair<uint64_t, string>> batch;
+        while (running) {
+            if (!backlog->readAfter(position, batch, MAX_BATCH_RECORDS, POLL_INTERVAL)) return;
+            auto now = chrono::steady_clock::now();
+            if (batch.empty()) {
+                if (now - lastSent >= HEARTBEAT_INTERVAL) {
+                    sendAll(fd, "{\"heartbeat\":" + to_string(backlog->last()) + "}\n");
+                    lastSent = now;
+                }
+                continue;
+            }
+            position = batch.back().first;
+            out = "{\"lsn\":" + to_string(position) + ",\"records\":[";
+            for (size_t i = 0; i < batch.size(); ++i) {
+                if (i > 0) out += ',';
+                out += batch[i].second;
+            }
+            out += "]}\n";
+            sendAll(fd, out);
+            lastSent = now;
+        }
+    }
+
+    // Joins senders whose follower went away. Caller holds sessionsMtx.
+    void reapSessions() {
+        for (size_t i = 0; i < sessions.size();) {
+            if (!sessions[i]->finished) {
+                ++i;
+                continue;
+            }
+            sessions[i]->sender.join();
+            ::close(sessions[i]->fd);
+            sessions[i] = move(sessions.back());
+            sessions.pop_back();
+        }
+    }
+
+    void acceptLoop() {
+        while (running) {
+            int fd = ::accept4(listenFd, nullptr, nullptr, SOCK_CLOEXEC);
+            if (fd < 0) {
+                if (errno == EINTR || errno == ECONNABORTED) continue;
+                return;
+            }
+            int on = 1;
+            ::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+            lock_guard<mutex> lock(sessionsMtx);
+            reapSessions();
+            auto session = make_unique<Session>();
+            Session* s = session.get();
+            s->fd = fd;
+            s->sender = thread([this, s]() {
+                try {
+                    serve(s->fd);
+                } catch (const exception&) {
+                    // The follower reconnects and picks up from where it got.
+                }
+                // Ended here, the follower hears of it at once rather than
+                // at its leader timeout; the fd is closed when reaped.
+                ::shutdown(s->fd, SHUT_RDWR);
+                s->finished = true;
+            });
+            sessions.push_back(move(session));
+        }
+    }
+
+public:
+    KVLeader(KVDataStore& kvStore, uint16_t port, const string& listenHost = "0.0.0.0")
+        : store(kvStore), host(listenHost), boundPort(port) {}
+
+    ~KVLeader() {
+        stop();
+    }
+
+    KVLeader(const KVLeader&) = delete;
+    KVLeader& operator=(const KVLeader&) = delete;
+
+    void start() {
+        if (running) return;
+        if (!store.replicationBacklog()) {
+            throw runtime_error("Replication needs options.replicationBacklog set.");
+        }
+        listenFd = ::socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (listenFd < 0) {
+            throw runtime_error("Failed to create socket.");
+        }
+        int on = 1;
+        ::setsockopt(listenFd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+        sockaddr_in addr = {};
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(boundPort);
+        if (::inet_pton(AF_INET, host.c_str(), &addr.sin_addr) != 1 ||
+            ::bind(listenFd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0 || ::listen(listenFd, 64) != 0) {
+            ::close(listenFd);
+            listenFd = -1;
+            throw runtime_error("Failed to listen on " + host + ":" + to_string(boundPort) + ".");
+        }
+        socklen_t len = sizeof(addr);
+        ::getsockname(listenFd, reinterpret_cast<sockaddr*>(&addr), &len);
+        boundPort = ntohs(addr.sin_port);
+        running = true;
+        acceptor = thread([this]() { acceptLoop(); });
+    }
+
+    // Disconnects every follower; they keep retrying until a leader is back.
+    void stop() {
+        if (!running) return;
+        running = false;
+        ::shutdown(listenFd, SHUT_RDWR);
+        acceptor.join();
+        ::close(listenFd);
+        listenFd = -1;
+        lock_guard<mutex> lock(sessionsMtx);
+        for (auto& session : sessions) ::shutdown(session->fd, SHUT_RDWR);
+        for (auto& session : sessions) {
+            session->sender.join();
+            ::close(session->fd);
+        }
+        sessions.clear();
+    }
+
+    uint16_t port() const {
+        return boundPort;
+    }
+
+    size_t followerCount() {
+        lock_guard<mutex> lock(sessionsMtx);
+        reapSessions();
+        return sessions.size();
+    }
+};
+
+enum class ReadConsistency {
+    // Reads see whatever the follower has applied so far.
+    Eventual,
+    // A read given a leader position waits, up to the follower's wait
+    // timeout, until the follower has applied it.
+    ReadYourWrites
+};
+
+struct ReplicaStatus {
+    bool connected = false;
+    LogPosition applied;
+    // Newest LSN the leader has reported.
+    uint64_t leaderLsn = 0;
+    uint64_t resyncs = 0;
+};
+
+// Keeps local, a store of its own, a copy of a KVLeader's store: records
+// are applied to it and logged there as they arrive. Serve reads from it
+// directly, through read(), or with a KVServer given this as its replica;
+// writes belong on the leader. Reconnects by itself when the leader goes
+// away. Applied positions are not persisted, so a restarted follower
+// starts with a full copy.
+class KVFollower : public ReadReplica {
+private:
+    static constexpr size_t APPLY_CHUNK = 1024;
+    static constexpr chrono::milliseconds RETRY_INTERVAL{100};
+    // Three missed heartbeats and the leader is taken for gone.
+    static constexpr chrono::milliseconds LEADER_TIMEOUT{1500};
+
+    KVDataStore& local;
+    string host;
+    uint16_t leaderPort;
+    ReadConsistency consistency;
+    chrono::milliseconds waitTimeout;
+
+    mutable mutex mtx;
+    condition_variable cv;
+    ReplicaStatus state;
+    bool running = false;
+    // The live connection, so stop() can break it. Guarded by mtx.
+    KVClient* client = nullptr;
+    thread worker;
+
+    mutex subscribersMtx;
+    unordered_map<uint64_t, function<void()>> subscribers;
+    uint64_t nextSubscription = 1;
+
+    void changed() {
+        cv.notify_all();
+        lock_guard<mutex> lock(subscribersMtx);
+        for (auto& [id, notify] : subscribers) notify();
+    }
+
+    // connecting marks the session connected in the same step, so no one
+    // sees it connected with the epoch it had before.
+    void applied(uint64_t epoch, uint64_t lsn, bool connecting = false) {
+        {
+            lock_guard<mutex> lock(mtx);
+            state.applied = {epoch, lsn};
+            state.leaderLsn = max(state.leaderLsn, lsn);
+            if (connecting) state.connected = true;
+        }
+        changed();
+    }
+
+    // Once connected, the follower holds the leader's current epoch, so a
+    // position from any other is never reached. Caller holds mtx.
+    bool reached(const LogPosition& position) const {
+        return state.applied.epoch == position.epoch && state.applied.lsn >= position.lsn;
+    }
+
+    bool unreachable(const LogPosition& position) const {
+        return state.connected && state.applied.epoch != position.epoch;
+    }
+
+    void session() {
+        KVClient connection(host, leaderPort);
+        connection.setReceiveTimeout(LEADER_TIMEOUT);
+        LogPosition from;
+        {
+            lock_guard<mutex> lock(mtx);
+            if (!running) return;
+            client = &connection;
+            from = state.applied;
+        }
+        struct Detach {
+            KVFollower& f;
+            ~Detach() {
+                lock_guard<mutex> lock(f.mtx);
+                f.client = nullptr;
+                f.state.connected = false;
+            }
+        } detach{*this};
+
+        connection.send({{"op", "replicate"}, {"epoch", from.epoch}, {"lsn", from.lsn}});
+        json hello = connection.receive();
+        if (!hello.value("ok", false)) {
+            throw runtime_error(hello.value("error", string("Error: Replication refused.")));
+        }
+        uint64_t epoch = hello.at("epoch").get<uint64_t>();
+        if (hello.at("resync").get<bool>()) {
+            // Nothing applied counts until the copy is complete.
+            applied(0, 0);
+            vector<json> records;
+            records.push_back({{"op", "reset"}});
+            while (true) {
+                json line = connection.receive();
+                if (line.contains("snapshot_end")) break;
+                if (line.contains("heartbeat")) continue;
+                records.push_back(move(line.at("record")));
+                if (records.size() >= APPLY_CHUNK) {
+                    local.applyReplicated(records);
+                    records.clear();
+                }
+            }
+            local.applyReplicated(records);
+            lock_guard<mutex> lock(mtx);
+            ++state.resyncs;
+        }
+        applied(epoch, hello.at("lsn").get<uint64_t>(), true);
+
+        while (true) {
+            json line = connection.receive();
+            auto heartbeat = line.find("heartbeat");
+            if (heartbeat != line.end()) {
+                lock_guard<mutex> lock(mtx);
+                state.leaderLsn = max(state.leaderLsn, heartbeat->get<uint64_t>());
+                continue;
+            }
+            local.applyReplicated(line.at("records").get<vector<json>>());
+            applied(epoch, line.at("lsn").get<uint64_t>());
+        }
+    }
+
+    void run() {
+        unique_lock<mutex> lock(mtx);
+        while (running) {
+            lock.unlock();
+            try {
+                session();
+            } catch (const exception&) {
+                // Leader unreachable or gone; try again shortly.
+            }
+            lock.lock();
+            cv.wait_for(lock, RETRY_INTERVAL, [this]() { return !running; });
+        }
+    }
+
+public:
+    KVFollower(KVDataStore& localStore, const string& leaderHost, uint16_t port,
+               ReadConsistency mode = ReadConsistency::Eventual,
+               chrono::milliseconds readWaitTimeout = chrono::milliseconds(1000))
+        : local(localStore), host(leaderHost), leaderPort(port), consistency(mode), waitTimeout(readWaitTimeout) {}
+
+    ~KVFollower() {
+        stop();
+    }
+
+    KVFollower(const KVFollower&) = delete;
+    KVFollower& operator=(const KVFollower&) = delete;
+
+    void start() {
+        lock_guard<mutex> lock(mtx);
+        if (running) return;
+        running = true;
+        worker = thread([this]() { run(); });
+    }
+
+    void stop() {
+        {
+            lock_guard<mutex> lock(mtx);
+            if (!running) return;
+            running = false;
+            if (client) client->shutdown();
+        }
+        cv.notify_all();
+        worker.join();
+    }
+
+    ReplicaStatus status() const {
+        lock_guard<mutex> lock(mtx);
+        return state;
+    }
+
+    // Waits until everything up to position, taken from the leader's
+    // logPosition(), has been applied here. A position from before the
+    // leader restarted is never reached; while connected to the new one,
+    // that fails at once rather than at the timeout.
+    bool waitFor(const LogPosition& position, chrono::milliseconds timeout) {
+        unique_lock<mutex> lock(mtx);
+        cv.wait_for(lock, timeout, [&]() { return reached(position) || unreachable(position); });
+        return reached(position);
+    }
+
+    // Waits for position as the consistency mode says.
+    bool awaitPosition(const LogPosition& position) {
+        if (consistency == ReadConsistency::Eventual || position.lsn == 0) return true;
+        return waitFor(position, waitTimeout);
+    }
+
+    PositionCheck checkPosition(const LogPosition& position) override {
+        if (consistency == ReadConsistency::Eventual || position.lsn == 0) return PositionCheck::Reached;
+        lock_guard<mutex> lock(mtx);
+        if (reached(position)) return PositionCheck::Reached;
+        return unreachable(position) ? PositionCheck::Unreachable : PositionCheck::Pending;
+    }
+
+    chrono::milliseconds positionTimeout() const override {
+        return waitTimeout;
+    }
+
+    uint64_t subscribe(function<void()> notify) override {
+        lock_guard<mutex> lock(subscribersMtx);
+        subscribers.emplace(nextSubscription, move(notify));
+        return nextSubscription++;
+    }
+
+    void unsubscribe(uint64_t id) override {
+        lock_guard<mutex> lock(subscribersMtx);
+        subscribers.erase(id);
+    }
+
+    // Reads from the local copy. after is where the leader's log stood
+    // when the caller's last write returned.
+    string read(const string& key, const LogPosition& after = LogPosition()) {
+        if (!awaitPosition(after)) return "Error: Replica is behind the leader.";
+        return local.read(key);
+    }
+
+    KVDataStore& store() {
+        return local;
+    }
+};
+
+// Consistent-hash ring over a set of nodes. Each node is hashed onto the
+// ring at virtualNodes points and a key belongs to the first point at or
+// after its own hash, so a node that joins takes over about 1/n of the
+// keys, all of them from the others, and nothing else moves. Hashes are
+// computed the same in every process, so every client agrees on owners.
+class HashRing {
+private:
+    size_t virtualNodes;
+    vector<pair<uint64_t, size_t>> points;
+
+public:
+    explicit HashRing(size_t virtualNodesPerNode = 160) : virtualNodes(virtualNodesPerNode) {}
+
+    // FNV-1a spread with the splitmix64 finalizer; FNV alone clusters keys
+    // that differ only in their last bytes.
+    static uint64_t hashOf(string_view key) {
+        uint64_t h = SharedImage::hashOf(key);
+        h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ull;
+        h = (h ^ (h >> 27)) * 0x94d049bb133111ebull;
+        return h ^ (h >> 31);
+    }
+
+    void add(size_t node, const string& name) {
+        for (size_t v = 0; v < virtualNodes; ++v) {
+            points.emplace_back(hashOf(name + '#' + to_string(v)), node);
+        }
+        sort(points.begin(), points.end());
+    }
+
+    size_t nodeFor(string_view key) const {
+        auto it = lower_bound(points.begin(), points.end(), make_pair(hashOf(key), size_t(0)));
+        return it == points.end() ? points.front().second : it->second;
+    }
+};
+
+// Client that partitions keys over several KVServer nodes with a HashRing,
+// so a dataset can outgrow what one node holds. Batches are split per node
+// and every sub-batch is sent before any answer is read, so the nodes work
+// on them in parallel. Each sub-batch is atomic on its node, and when one
+// fails batchCreate() removes what the others created, so the batch is
+// all-or-nothing to this client; other clients may see a failed batch's
+// keys until then. Results and errors read like KVDataStore's own.
+//
+// addNode() puts a node on the ring straight away and rebalanceStep()
+// moves keys onto it a page at a time. Until that is done, reads that miss
+// on a key's new owner fall back to its previous one, and creates and
+// removes check both, so the cluster stays usable throughout. Moved
+// entries keep what is left of their TTL. Not thread-safe.
+class KVCluster {
+private:
+    struct Node {
+        string name;
+        unique_ptr<KVClient> client;
+    };
+
+    vector<Node> nodes;
+    HashRing ring;
+    // The ring before the last addNode(), while keys are still moving.
+    unique_ptr<HashRing> previous;
+    size_t migrating = 0;
+    string cursor;
+
+    static string keyNotFound() {
+        return statusMessage(KVStatus::NotFound);
+    }
+
+    // Whether a read result means no live value, so the key can be created.
+    static bool absent(const string& result) {
+        return result == keyNotFound() || result == statusMessage(KVStatus::Expired);
+    }
+
+    static string messageOf(const json& response) {
+        return response.value("ok", false) ? response.at("result").get<string>()
+                                           : response.at("error").get<string>();
+    }
+
+    // Owner of key under the previous ring, if it was a different node.
+    bool movedFrom(const string& key, size_t& node) const {
+        if (!previous) return false;
+        node = previous->nodeFor(key);
+        return node != ring.nodeFor(key);
+    }
+
+    // Sends requests[i] to node i for each one present, then collects the
+    // answers, so every node works at once.
+    vector<json> scatter(const vector<json>& requests) {
+        vector<json> responses(requests.size());
+        for (size_t i = 0; i < requests.size(); ++i) {
+            if (!requests[i].is_null()) nodes[i].client->send(requests[i]);
+        }
+        for (size_t i = 0; i < requests.size(); ++i) {
+            if (!requests[i].is_null()) responses[i] = nodes[i].client->receive();
+        }
+        return responses;
+    }
+
+    // Reads keys[i] from node owners[i] for every i in wanted.
+    void readFrom(const vector<string>& keys, const vector<size_t>& owners, const vector<size_t>& wanted,
+                  vector<string>& results) {
+        vector<vector<size_t>> parts(nodes.size());
+        for (size_t i : wanted) parts[owners[i]].push_back(i);
+        vector<json> requests(nodes.size());
+        for (size_t n = 0; n < nodes.size(); ++n) {
+            if (parts[n].empty()) continue;
+            json list = json::array();
+            for (size_t i : parts[n]) list.push_back(keys[i]);
+            requests[n] = {{"op", "batch_read"}, {"keys", move(list)}};
+        }
+        vector<json> responses = scatter(requests);
+        for (size_t n = 0; n < nodes.size(); ++n) {
+            if (parts[n].empty()) continue;
+            if (!responses[n].value("ok", false)) {
+                for (size_t i : parts[n]) results[i] = messageOf(responses[n]);
+                continue;
+            }
+            const json& values = responses[n].at("result");
+            for (size_t j = 0; j < parts[n].size(); ++j) {
+                results[parts[n][j]] = values[j].is_null() ? keyNotFound() : values[j].dump();
+            }
+        }
+    }
+
+    void connect(const string& host, uint16_t port) {
+        Node node;
+        node.name = host + ':' + to_string(port);
+        node.client = make_unique<KVClient>(host, port);
+        ring.add(nodes.size(), node.name);
+        nodes.push_back(move(node));
+    }
+
+public:
+    explicit KVCluster(const vector<pair<string, uint16_t>>& endpoints, size_t virtualNodes = 160)
+        : ring(virtualNodes) {
+        for (const auto& [host, port] : endpoints) connect(host, port);
+        if (nodes.empty()) {
+            throw runtime_error("A cluster needs at least one node.");
+        }
+    }
+
+    size_t nodeCount() const {
+        return nodes.size();
+    }
+
+    size_t nodeFor(const string& key) const {
+        return ring.nodeFor(key);
+    }
+
+    string create(const string& key, const json& value, time_t ttl = 0) {
+        size_t old;
+        if (movedFrom(key, old) && !absent(read(key))) {
+            return "Error: Key already exists.";
+        }
+        json request = {{"op", "create"}, {"key", key}, {"value", value}};
+        if (ttl != 0) request["ttl"] = ttl;
+        return messageOf(nodes[ring.nodeFor(key)].client->call(move(request)));
+    }
+
+    string read(const string& key) {
+        json response = nodes[ring.nodeFor(key)].client->call({{"op", "read"}, {"key", key}});
+        size_t old;
+        if (!response.value("ok", false) && response.at("error") == keyNotFound() && movedFrom(key, old)) {
+            response = nodes[old].client->call({{"op", "read"}, {"key", key}});
+        }
+        return response.value("ok", false) ? response.at("result").dump() : response.at("error").get<string>();
+    }
+
+    string remove(const string& key) {
+        string result = messageOf(nodes[ring.nodeFor(key)].client->call({{"op", "remove"}, {"key", key}}));
+        size_t old;
+        if (movedFrom(key, old)) {
+            string moved = messageOf(nodes[old].client->call({{"op", "remove"}, {"key", key}}));
+            if (result == keyNotFound()) result = moved;
+        }
+        return result;
+    }
+
+    // Results in the order of keys; missing keys read "Error: Key not found.".
+    vector<string> batchRead(const vector<string>& keys) {
+        vector<string> results(keys.size());
+        vector<size_t> owners(keys.size());
+        vector<size_t> all(keys.size());
+        for (size_t i = 0; i < keys.size(); ++i) {
+            owners[i] = ring.nodeFor(keys[i]);
+            all[i] = i;
+        }
+        readFrom(keys, owners, all, results);
+        if (previous) {
+            vector<size_t> retry;
+            for (size_t i = 0; i < keys.size(); ++i) {
+                if (results[i] == keyNotFound() && movedFrom(keys[i], owners[i])) retry.push_back(i);
+            }
+            if (!retry.empty()) readFrom(keys, owners, retry, results);
+        }
+        return results;
+    }
+
+    string batchCreate(const vector<pair<string, json>>& entries, time_t ttl = 0) {
+        if (previous) {
+            vector<string> keys;
+            for (const auto& entry : entries) keys.push_back(entry.first);
+            for (const auto& result : batchRead(keys)) {
+                if (!absent(result)) return "Error: Duplicate key found in batch.";
+            }
+        }
+        vector<json> requests(nodes.size());
+        vector<json> undo(nodes.size());
+        for (const auto& [key, value] : entries) {
+            size_t node = ring.nodeFor(key);
+            json& request = requests[node];
+            if (request.is_null()) {
+                request = {{"op", "batch_create"}, {"entries", json::array()}};
+                if (ttl != 0) request["ttl"] = ttl;
+                undo[node] = {{"op", "batch_remove"}, {"keys", json::array()}};
+            }
+            request["entries"].push_back({{"key", key}, {"value", value}});
+            undo[node]["keys"].push_back(key);
+        }
+        vector<json> responses = scatter(requests);
+        string result = "Batch create operation successful.";
+        string failure;
+        for (size_t n = 0; n < nodes.size(); ++n) {
+            if (responses[n].is_null()) continue;
+            if (!responses[n].value("ok", false)) {
+                if (failure.empty()) failure = messageOf(responses[n]);
+                undo[n] = nullptr;
+            } else {
+                result = messageOf(responses[n]);
+            }
+        }
+        if (failure.empty()) return result;
+        // Sub-batches that went through created every one of their keys,
+        // so removing them all puts those nodes back as they were.
+        scatter(undo);
+        return failure;
+    }
+
+    // Adds a node to the ring. It owns its share of keys at once; call
+    // rebalanceStep() until it returns false to move them over.
+    void addNode(const string& host, uint16_t port) {
+        if (previous) rebalance();
+        previous = make_unique<HashRing>(ring);
+        connect(host, port);
+        migrating = 0;
+        cursor.clear();
+    }
+
+    bool rebalancing() const {
+        return previous != nullptr;
+    }
+
+    // Moves the keys in one page of up to pageSize entries of the old nodes
+    // to the new one: each is created there with the rest of its TTL, where
+    // a newer write wins, and then removed from its old node. Keys already
+    // due are only removed. If any create fails the old node is left as it
+    // was and this throws; calling it again retries the page. Returns true
+    // while pages remain.
+    bool rebalanceStep(size_t pageSize = 1000) {
+        if (!previous) return false;
+        size_t target = nodes.size() - 1;
+        KVClient& source = *nodes[migrating].client;
+        json page = source.call(
+            {{"op", "scan"}, {"prefix", ""}, {"limit", pageSize}, {"cursor", cursor}, {"expiries", true}});
+        if (!page.value("ok", false)) {
+            throw runtime_error("Rebalancing failed: " + messageOf(page));
+        }
+        const json& result = page.at("result");
+        vector<json> creates;
+        vector<json> removes;
+        time_t now = time(nullptr);
+        for (const auto& entry : result.at("entries")) {
+            const string& key = entry[0].get_ref<const string&>();
+            if (ring.nodeFor(key) != target) continue;
+            time_t expiry = entry[2].get<time_t>();
+            if (expiry != 0 && expiry <= now) {
+                removes.push_back({{"op", "remove"}, {"key", key}});
+                continue;
+            }
+            json create = {{"op", "create"}, {"key", key}, {"value", entry[1]}};
+            if (expiry != 0) create["ttl"] = expiry - now;
+            creates.push_back(move(create));
+        }
+        if (!creates.empty()) {
+            vector<json> responses = nodes[target].client->pipeline(creates);
+            for (size_t i = 0; i < responses.size(); ++i) {
+                // An existing key is a newer write, which wins.
+                if (!responses[i].value("ok", false) && messageOf(responses[i]) != "Error: Key already exists.") {
+                    throw runtime_error("Rebalancing failed: " + messageOf(responses[i]));
+                }
+                removes.push_back({{"op", "remove"}, {"key", creates[i].at("key")}});
+            }
+        }
+        if (!removes.empty()) source.pipeline(move(removes));
+        if (result.at("more").get<bool>()) {
+            cursor = result.at("cursor").get<string>();
+            return true;
+        }
+        cursor.clear();
+        if (++migrating < target) return true;
+        previous.reset();
+        return false;
+    }
+
+    void rebalance() {
+        while (rebalanceStep()) {
+        }
+    }
+};
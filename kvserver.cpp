@@ -0,0 +1,124 @@
+// Serves a store over TCP with KVServer's pipelined NDJSON protocol; see
+// kvnet.hpp for the operations. It can also ship its log to followers, or
+// run as a read-only follower of another kvserver. Stops cleanly on SIGINT
+// or SIGTERM, writing a final snapshot.
+//
+//   g++ -std=c++17 -O2 -pthread kvserver.cpp -o kvserver -lz
+//   ./kvserver --port 7070 --data leader.json --replication-port 7071
+//   ./kvserver --port 7080 --data follower.json --follow 127.0.0.1:7071 --read-your-writes
+#include "kvnet.hpp"
+#include <csignal>
+
+static void usage(const char* program) {
+    cerr << "Usage: " << program << " [--port N] [--host ADDR] [--threads N] [--data PATH]\n"
+         << "       [--durability none|periodic|group] [--shards N] [--bytes] [--lock-free] [--shared-readers]\n"
+         << "       [--replication-port N] [--follow HOST:PORT [--read-your-writes]] [--compress BYTES]" << endl;
+}
+
+int main(int argc, char** argv) {
+    uint16_t port = 7070;
+    string host = "0.0.0.0";
+    size_t threads = 0;
+    string dataPath = "datastore.json";
+    KVOptions options;
+    int replicationPort = -1;
+    string leader;
+    ReadConsistency consistency = ReadConsistency::Eventual;
+
+    for (int i = 1; i < argc; ++i) {
+        string arg = argv[i];
+        bool hasValue = i + 1 < argc;
+        if (arg == "--port" && hasValue) {
+            port = static_cast<uint16_t>(stoul(argv[++i]));
+        } else if (arg == "--host" && hasValue) {
+            host = argv[++i];
+        } else if (arg == "--threads" && hasValue) {
+            threads = stoul(argv[++i]);
+        } else if (arg == "--data" && hasValue) {
+            dataPath = argv[++i];
+        } else if (arg == "--durability" && hasValue) {
+            string mode = argv[++i];
+            if (mode == "none") {
+                options.durability = Durability::None;
+            } else if (mode == "periodic") {
+                options.durability = Durability::Periodic;
+            } else if (mode == "group") {
+                options.durability = Durability::GroupCommit;
+            } else {
+                usage(argv[0]);
+                return 1;
+            }
+        } else if (arg == "--shards" && hasValue) {
+            options.shardCount = stoul(argv[++i]);
+        } else if (arg == "--bytes") {
+            options.valueMode = ValueMode::Bytes;
+        } else if (arg == "--lock-free") {
+            options.lockFreeReads = true;
+        } else if (arg == "--shared-readers") {
+            options.sharedReaders = true;
+        } else if (arg == "--replication-port" && hasValue) {
+            replicationPort = stoi(argv[++i]);
+        } else if (arg == "--follow" && hasValue) {
+            leader = argv[++i];
+        } else if (arg == "--read-your-writes") {
+            consistency = ReadConsistency::ReadYourWrites;
+        } else if (arg == "--compress" && hasValue) {
+            options.compression = Compression::Deflate;
+            options.compressionThreshold = stoul(argv[++i]);
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    // Block the shutdown signals before any thread starts so only sigwait
+    // below sees them.
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+
+    size_t colon = leader.rfind(':');
+    if (!leader.empty() && colon == string::npos) {
+        usage(argv[0]);
+        return 1;
+    }
+    if (replicationPort >= 0 && options.replicationBacklog == 0) {
+        options.replicationBacklog = 64 * 1024 * 1024;
+    }
+
+    unique_ptr<KVDataStore> kvStore;
+    unique_ptr<KVLeader> shipper;
+    unique_ptr<KVFollower> follower;
+    unique_ptr<KVServer> server;
+    try {
+        kvStore = make_unique<KVDataStore>(dataPath, options);
+        if (!leader.empty()) {
+            follower = make_unique<KVFollower>(*kvStore, leader.substr(0, colon),
+                                               static_cast<uint16_t>(stoul(leader.substr(colon + 1))), consistency);
+            follower->start();
+        }
+        if (replicationPort >= 0) {
+            shipper = make_unique<KVLeader>(*kvStore, static_cast<uint16_t>(replicationPort), host);
+            shipper->start();
+        }
+        server = make_unique<KVServer>(*kvStore, port, threads, host, follower.get());
+        server->start();
+    } catch (const exception& e) {
+        cerr << e.what() << endl;
+        return 1;
+    }
+    cout << "Listening on " << host << ":" << server->port() << endl;
+    if (shipper) {
+        cout << "Replicating on " << host << ":" << shipper->port() << endl;
+    }
+
+    int received = 0;
+    sigwait(&signals, &received);
+    cout << "Shutting down..." << endl;
+    server->stop();
+    if (follower) follower->stop();
+    if (shipper) shipper->stop();
+    return 0;
+}
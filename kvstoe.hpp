@@ -1,196 +1,5344 @@
+#pragma once
+
 #include <iostream>
 #include <fstream>
 #include <unordered_map>
 #include <mutex>
+#include <shared_mutex>
+#include <algorithm>
+#include <vector>
+#include <deque>
+#include <queue>
+#include <set>
 #include <thread>
 #include <chrono>
+#include <condition_variable>
+#include <atomic>
+#include <memory>
+#include <new>
+#include <functional>
+#include <future>
+#include <random>
+#include <array>
+#include <limits>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <string_view>
+#include <optional>
+#include <filesystem>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 #include "json.hpp"
 
 using json = nlohmann::json;
 using namespace std;
 
-struct ValueEntry {
-    json value;
-    time_t ttl;
+enum class Durability {
+    None,         // write() each record, leave flushing to the OS
+    Periodic,     // a flusher thread fsyncs the log every fsyncInterval
+    GroupCommit   // writers wait for an fsync that covers their record and
+                  // share it with everyone who appended in the meantime
+};
+
+enum class ValueMode {
+    Json,     // values are json trees, serialized again on every read
+    Bytes     // values are kept as the compact JSON text made at write time
+};
+
+enum class IndexBackend {
+    Chained,  // unordered_map: a heap node per key, reached through a bucket pointer
+    Flat      // FlatTable: open addressing with keys and hashes stored in the slots
+};
+
+enum class OverflowPolicy {
+    Evict,    // drop the entry, as a cache would
+    Spill     // page the value out to a spill file, keeping the key in memory
+};
+
+enum class AllocationMode {
+    Heap,     // index nodes and values come straight from operator new
+    Pooled    // index nodes from per-shard slabs, Bytes-mode values from ValueArena
+};
+
+enum class SnapshotFormat {
+    Json,     // one JSON object, human readable
+    Binary    // BinarySnapshot: length-prefixed entries, CBOR values, checksummed blocks
+};
+
+enum class Compression {
+    None,
+    Deflate   // zlib, optionally with a preset dictionary
+};
+
+struct KVOptions {
+    // The checkpoint worker folds the log into a fresh snapshot once the log
+    // holds this many bytes or records. A threshold of 0 disables that
+    // trigger; with both at 0 the log is only compacted on shutdown.
+    uintmax_t checkpointLogBytes = 64 * 1024 * 1024;
+    size_t checkpointLogRecords = 0;
+    chrono::milliseconds checkpointInterval{1000};
+
+    Durability durability = Durability::None;
+    chrono::milliseconds fsyncInterval{100};
+
+    // Format used when writing snapshots. Loading detects either one, so an
+    // existing JSON datastore is converted by the next checkpoint.
+    SnapshotFormat snapshotFormat = SnapshotFormat::Json;
+
+    // Map a binary snapshot instead of reading it, indexing keys up front and
+    // decoding each value on its first read. JSON snapshots always load eagerly.
+    bool lazyLoad = false;
+
+    // Threads that decode a binary snapshot at startup, and that encode
+    // shards when one is written; 0 means one per hardware thread. JSON
+    // snapshots are always read and written by one thread.
+    size_t snapshotThreads = 0;
+
+    // Number of independently locked shards the key space is split into,
+    // rounded up to a power of two.
+    size_t shardCount = 16;
+
+    // Serve read() without taking shard locks. Each shard index becomes an
+    // RcuTable whose entries are replaced rather than modified, with old
+    // versions freed through epoch-based reclamation. Reads of an expired
+    // key report it as expired and leave the removal to the cleanup thread.
+    bool lockFreeReads = false;
+
+    // The cleanup thread drains due TTLs every expiryInterval, holding each
+    // shard lock for at most expirySlice at a time. A key is only swept once
+    // it has been expired for expiryGrace; until then read() still tells
+    // callers it has expired rather than that it never existed.
+    chrono::milliseconds expiryInterval{1000};
+    chrono::microseconds expirySlice{500};
+    chrono::seconds expiryGrace{2};
+
+    // How values are held in memory. Bytes mode serializes each value once,
+    // in create(), and read() hands back that text without touching json.
+    ValueMode valueMode = ValueMode::Json;
+
+    // Where index nodes and value buffers are allocated. Pooled mode reuses
+    // fixed-size blocks instead of going back to malloc for every create(),
+    // so churn does not fragment the heap and memory stays at its high-water
+    // mark. Json-mode values are json trees and always use the heap.
+    AllocationMode allocation = AllocationMode::Heap;
+
+    // Hash table behind each shard. lockFreeReads takes precedence and
+    // always uses an RcuTable.
+    IndexBackend indexBackend = IndexBackend::Chained;
+
+    // Approximate memory budget in bytes, split evenly across shards; 0 means
+    // unbounded. When a shard goes over its share, a CLOCK hand evicts
+    // entries that have not been read since it last passed them. Evictions
+    // are logged, so a restart does not bring evicted keys back.
+    size_t memoryBudget = 0;
+
+    // What happens to the entries the CLOCK hand picks. Spilled values are
+    // written to a per-shard spill file and read back, becoming hot again,
+    // on their next read, so the data set can outgrow memory.
+    OverflowPolicy overflow = OverflowPolicy::Evict;
+
+    // Keep every shard's keys in a sorted set as well, so scan() seeks to its
+    // start key and stops after limit entries instead of visiting every key.
+    bool orderedIndex = false;
+
+    // Publish a read-only image of the store to shared memory for
+    // KVSharedReader instances in other processes on this machine. It is
+    // rebuilt every sharedPublishInterval if anything changed, so readers
+    // lag the store by up to that long. Writes still go through this
+    // process, for example over KVServer. A rebuild encodes again only the
+    // shards written since the last one, each under its own shared lock,
+    // which costs a serialization per value in them (and an inflate per
+    // compressed one); the whole image file is then rewritten outside any
+    // lock. Under steady writes to every shard that is an O(N) pass per
+    // interval, so raise the interval for large stores.
+    bool sharedReaders = false;
+    chrono::milliseconds sharedPublishInterval{100};
+
+    // Count calls and time them into per-thread histograms, read back by
+    // stats() and metricsText(). Each call costs two clock reads and a few
+    // stores to memory only the calling thread writes.
+    bool metrics = true;
+
+    // Time every shard lock acquisition, recording wait and hold times per
+    // call site for lockProfile(). Adds two clock reads per acquisition.
+    bool lockProfiling = false;
+
+    // Keep up to this many bytes of the newest log records in memory for
+    // followers to stream from, through KVLeader. 0 turns replication off.
+    // A follower that falls further behind than this is sent a full copy.
+    size_t replicationBacklog = 0;
+
+    // Keep values whose JSON text is at least compressionThreshold bytes
+    // deflated: in memory, in the log and in binary snapshots. Reads
+    // inflate them again. Values that would not shrink are kept as is.
+    Compression compression = Compression::None;
+    size_t compressionThreshold = 512;
+    // zlib level, from 1 (fastest) to 9 (smallest).
+    int compressionLevel = 1;
+    // Text common to many values, for example from
+    // ValueCompression::trainDictionary(). It is what lets small documents
+    // compress. Values written with it can only be read back by a store
+    // opened with the same dictionary.
+    string compressionDictionary;
 };
 
-class KVDataStore {
+// Size-classed allocator for value buffers, shared by every store in the
+// process because a ValueHandle may outlive the store it came from. There
+// are four classes per power of two from 32 bytes to 32 KB, so rounding
+// wastes at most a fifth of a block. Blocks are carved from 64 KB slabs and
+// go back on a free list when released; slabs are never returned to the OS.
+// Each class is split into stripes picked per thread to keep writers on
+// different threads off each other's locks.
+class ValueArena {
+public:
+    static constexpr uint16_t HEAP = 0xffff;
+
 private:
-    unordered_map<string, ValueEntry> store;
-    string filePath;
-    mutable mutex mtx;
-    const size_t MAX_KEY_LENGTH = 32;
-    const size_t MAX_VALUE_SIZE = 16 * 1024;
-    const size_t MAX_FILE_SIZE = 1 * 1024 * 1024 * 1024;
+    static constexpr size_t MIN_BLOCK = 32;
+    static constexpr size_t MAX_BLOCK = 32 * 1024;
+    static constexpr size_t CLASS_COUNT = 41;
+    static constexpr size_t STRIPES = 8;
+    static constexpr size_t SLAB_BYTES = 64 * 1024;
+
+    struct FreeBlock {
+        FreeBlock* next;
+    };
+
+    struct SizeClass {
+        mutex mtx;
+        size_t blockSize = 0;
+        FreeBlock* free = nullptr;
+        char* cursor = nullptr;
+        char* end = nullptr;
+    };
 
-   void saveToFile() {
-    lock_guard<mutex> lock(mtx);
-    ofstream file(filePath, ios::trunc);
-    if (file.is_open()) {
+    array<array<SizeClass, CLASS_COUNT>, STRIPES> stripes;
+    mutex slabMtx;
+    vector<void*> slabs;
+    atomic<size_t> reserved{0};
 
-        json j;
-        for (const auto& [key, entry] : store) {
-            j[key] = {{"value", entry.value}, {"ttl", entry.ttl}};
+    ValueArena() {
+        for (auto& classes : stripes) {
+            size_t n = 0;
+            for (size_t base = MIN_BLOCK; n < CLASS_COUNT; base *= 2) {
+                for (size_t step = 0; step < 4 && n < CLASS_COUNT; ++step) {
+                    classes[n++].blockSize = base + step * (base / 4);
+                }
+            }
         }
-        file << j.dump();
-        file.close();
+    }
 
-    } else {
-        throw runtime_error("Failed to open file for writing.");
+    static size_t classFor(size_t bytes) {
+        if (bytes <= MIN_BLOCK) return 0;
+        size_t shift = 5;
+        while ((size_t(2) << shift) < bytes) ++shift;
+        size_t base = size_t(1) << shift;
+        size_t step = (bytes - base + base / 4 - 1) / (base / 4);
+        return (shift - 5) * 4 + step;
     }
-}
 
-    void loadFromFile() {
-        lock_guard<mutex> lock(mtx);
-        ifstream file(filePath);
-        if (file.is_open()) {
-            json data;
-            file >> data;
-            for (auto& [key, entry] : data.items()) {
-                ValueEntry ve;
-                ve.value = entry["value"];
-                ve.ttl = entry["ttl"];
-                store[key] = ve;
-            }
-            file.close();
+    static size_t stripeForThread() {
+        static atomic<size_t> next{0};
+        thread_local size_t stripe = next.fetch_add(1, memory_order_relaxed) % STRIPES;
+        return stripe;
+    }
+
+    void* newSlab(size_t bytes) {
+        void* slab = ::operator new(bytes);
+        lock_guard<mutex> lock(slabMtx);
+        slabs.push_back(slab);
+        reserved += bytes;
+        return slab;
+    }
+
+public:
+    static ValueArena& instance() {
+        static ValueArena arena;
+        return arena;
+    }
+
+    ValueArena(const ValueArena&) = delete;
+    ValueArena& operator=(const ValueArena&) = delete;
+
+    // Returns a block of at least bytes and sets tag to what deallocate()
+    // needs to put it back.
+    void* allocate(size_t bytes, uint16_t& tag) {
+        if (bytes > MAX_BLOCK) {
+            tag = HEAP;
+            return ::operator new(bytes);
         }
+        size_t stripe = stripeForThread();
+        size_t index = classFor(bytes);
+        SizeClass& sc = stripes[stripe][index];
+        tag = static_cast<uint16_t>(stripe * CLASS_COUNT + index);
+
+        lock_guard<mutex> lock(sc.mtx);
+        if (sc.free) {
+            FreeBlock* block = sc.free;
+            sc.free = block->next;
+            return block;
+        }
+        if (static_cast<size_t>(sc.end - sc.cursor) < sc.blockSize) {
+            size_t slabBytes = max(SLAB_BYTES, sc.blockSize);
+            sc.cursor = static_cast<char*>(newSlab(slabBytes));
+            sc.end = sc.cursor + slabBytes;
+        }
+        void* block = sc.cursor;
+        sc.cursor += sc.blockSize;
+        return block;
     }
 
-    bool isExpired(const string& key) const {
-        if (store.count(key) == 0) return false;
-        time_t now = time(nullptr);
-        return store.at(key).ttl != 0 && now > store.at(key).ttl;
+    void deallocate(void* block, uint16_t tag) {
+        if (tag == HEAP) {
+            ::operator delete(block);
+            return;
+        }
+        SizeClass& sc = stripes[tag / CLASS_COUNT][tag % CLASS_COUNT];
+        lock_guard<mutex> lock(sc.mtx);
+        auto* freed = static_cast<FreeBlock*>(block);
+        freed->next = sc.free;
+        sc.free = freed;
     }
 
-    void cleanupExpiredKeys() {
-        lock_guard<mutex> lock(mtx);
-        for (auto it = store.begin(); it != store.end();) {
-            if (isExpired(it->first)) {
-                it = store.erase(it);
+    // Bytes of slab memory taken from the OS so far.
+    size_t reservedBytes() const {
+        return reserved.load(memory_order_relaxed);
+    }
+};
+
+// Immutable, reference-counted byte buffer whose count, length and bytes
+// share one allocation, taken from ValueArena when pooled. Copies share
+// the buffer.
+class SharedBytes {
+private:
+    struct Header {
+        atomic<uint32_t> refs;
+        uint32_t size;
+        uint16_t tag;
+
+        Header(uint32_t length, uint16_t allocTag) : refs(1), size(length), tag(allocTag) {}
+    };
+
+    Header* header = nullptr;
+
+    void release() {
+        if (header && header->refs.fetch_sub(1, memory_order_acq_rel) == 1) {
+            uint16_t tag = header->tag;
+            header->~Header();
+            if (tag == ValueArena::HEAP) {
+                ::operator delete(header);
             } else {
-                ++it;
+                ValueArena::instance().deallocate(header, tag);
             }
         }
+        header = nullptr;
     }
 
-    void periodicCleanup() {
-        while (true) {
-            this_thread::sleep_for(chrono::minutes(10));
-            cleanupExpiredKeys();
-        }
+public:
+    SharedBytes() = default;
+
+    static SharedBytes copyOf(string_view text, bool pooled) {
+        size_t bytes = sizeof(Header) + text.size();
+        uint16_t tag = ValueArena::HEAP;
+        void* memory = pooled ? ValueArena::instance().allocate(bytes, tag) : ::operator new(bytes);
+        SharedBytes out;
+        out.header = new (memory) Header(static_cast<uint32_t>(text.size()), tag);
+        memcpy(reinterpret_cast<char*>(out.header + 1), text.data(), text.size());
+        return out;
     }
 
-public:
-    KVDataStore(const string& path = "datastore.json") : filePath(path) {
-        if (ifstream(path)) {
-            loadFromFile();
-        }
+    SharedBytes(const SharedBytes& other) : header(other.header) {
+        if (header) header->refs.fetch_add(1, memory_order_relaxed);
+    }
 
-        thread([this]() { periodicCleanup(); }).detach();
+    SharedBytes(SharedBytes&& other) noexcept : header(other.header) {
+        other.header = nullptr;
     }
 
-    ~KVDataStore() {
-        saveToFile();
+    SharedBytes& operator=(SharedBytes other) noexcept {
+        swap(header, other.header);
+        return *this;
     }
 
-    string create(const string& key, const json& value, time_t ttl = 0) {
+    ~SharedBytes() {
+        release();
+    }
 
+    explicit operator bool() const {
+        return header != nullptr;
+    }
 
-        if (key.length() > MAX_KEY_LENGTH) return "Error: Key length exceeds 32 characters.";
-        if (value.dump().length() > MAX_VALUE_SIZE) return "Error: Value size exceeds 16KB.";
-        if (store.count(key)) return "Error: Key already exists.";
+    const char* data() const {
+        return header ? reinterpret_cast<const char*>(header + 1) : nullptr;
+    }
 
-        ValueEntry entry;
-        entry.value = value;
-        entry.ttl = ttl == 0 ? 0 : time(nullptr) + ttl;
-        store[key] = entry;
-        saveToFile();
-        return "Key-value pair created successfully.";
+    size_t size() const {
+        return header ? header->size : 0;
     }
 
-    string read(const string& key) {
-        lock_guard<mutex> lock(mtx);
+    string_view view() const {
+        return string_view(data(), size());
+    }
+};
 
-        if (!store.count(key)) return "Error: Key not found.";
-        if (isExpired(key)) {
-            store.erase(key);
-            saveToFile();
-            return "Error: Key has expired.";
-        }
+enum class KVStatus {
+    Ok,
+    NotFound,
+    Expired
+};
 
-        return store[key].value.dump();
+inline const char* statusMessage(KVStatus status) {
+    switch (status) {
+    case KVStatus::Ok: return "OK.";
+    case KVStatus::NotFound: return "Error: Key not found.";
+    case KVStatus::Expired: return "Error: Key has expired.";
     }
+    return "Error: Unknown status.";
+}
 
-    string remove(const string& key) {
+// Read-only view of a stored value. It holds a reference on the buffer, so
+// the bytes can be written straight to a socket without copying them and
+// stay valid however long the caller keeps the handle.
+class ValueHandle {
+private:
+    SharedBytes buffer;
 
+public:
+    ValueHandle() = default;
+    explicit ValueHandle(SharedBytes bytes) : buffer(move(bytes)) {}
 
-        if (!store.count(key)) return "Error: Key not found.";
-        store.erase(key);
-        saveToFile();
-        return "Key-value pair deleted successfully.";
+    explicit operator bool() const {
+        return static_cast<bool>(buffer);
     }
 
-    string batchCreate(const vector<pair<string, json>>& entries, time_t ttl = 0) {
-        lock_guard<mutex> lock(mtx);
+    string_view view() const {
+        return buffer.view();
+    }
+
+    const char* data() const {
+        return buffer.data();
+    }
+
+    size_t size() const {
+        return buffer.size();
+    }
+};
+
+struct ReadResult {
+    KVStatus status = KVStatus::NotFound;
+    ValueHandle value;
+
+    bool ok() const {
+        return status == KVStatus::Ok;
+    }
+};
+
+enum class BatchOp {
+    Create,
+    Remove
+};
+
+// One step of a mixed batch. value and ttl only apply to Create.
+struct BatchItem {
+    BatchOp op = BatchOp::Create;
+    string key;
+    json value;
+    time_t ttl = 0;
+};
+
+// One page of a scan, in key order. When more is set, pass cursor to the
+// next call to continue after the last entry returned.
+struct ScanResult {
+    vector<pair<string, string>> entries;
+    // Absolute expiry time of each entry, 0 for none, in the same order.
+    vector<time_t> expiries;
+    string cursor;
+    bool more = false;
+};
+
+// Memory accounting for a store run with a memoryBudget. usedBytes is the
+// estimate that eviction works against: key and value sizes plus a fixed
+// per-entry overhead.
+struct EvictionStats {
+    size_t budgetBytes = 0;
+    size_t usedBytes = 0;
+    uint64_t evictions = 0;
+    uint64_t evictedBytes = 0;
+    uint64_t spills = 0;
+    uint64_t spilledBytes = 0;
+};
+
+// Slab memory held by the pooled allocators. The value arena is shared by
+// every store in the process, so valueArenaBytes is a process-wide figure.
+struct MemoryUsage {
+    size_t indexSlabBytes = 0;
+    size_t valueArenaBytes = 0;
+};
 
-        const size_t BATCH_LIMIT = 100;
-        if (entries.size() > BATCH_LIMIT) {
-            return "Error: Batch size exceeds limit of 100 entries.";
+// One Slot per thread that asks for one, so each thread records into
+// memory no other thread writes and readers add the slots up. A slot is
+// created on a thread's first local() call and outlives the thread,
+// keeping what it counted.
+template <typename Slot>
+class ThreadSlots {
+private:
+    uint64_t id;
+    mutable mutex slotsMtx;
+    vector<unique_ptr<Slot>> slots;
+
+public:
+    ThreadSlots() {
+        static atomic<uint64_t> nextId{1};
+        id = nextId.fetch_add(1);
+    }
+
+    ThreadSlots(const ThreadSlots&) = delete;
+    ThreadSlots& operator=(const ThreadSlots&) = delete;
+
+    Slot& local() {
+        // Ids are never reused, so a slot cached for a destroyed owner is
+        // never looked up again.
+        thread_local uint64_t cachedId = 0;
+        thread_local Slot* cached = nullptr;
+        if (cachedId == id) return *cached;
+        thread_local unordered_map<uint64_t, Slot*> owned;
+        Slot*& slot = owned[id];
+        if (!slot) {
+            lock_guard<mutex> lock(slotsMtx);
+            slots.push_back(make_unique<Slot>());
+            slot = slots.back().get();
         }
+        cachedId = id;
+        cached = slot;
+        return *slot;
+    }
 
-        for (const auto& [key, value] : entries) {
-            if (key.length() > MAX_KEY_LENGTH || value.dump().length() > MAX_VALUE_SIZE) {
-                return "Error: One or more keys/values exceed size limits.";
-            }
-            if (store.count(key)) {
-                return "Error: Duplicate key found in batch.";
+    template <typename Fn>
+    void forEach(Fn&& fn) const {
+        lock_guard<mutex> lock(slotsMtx);
+        for (const auto& slot : slots) fn(*slot);
+    }
+};
+
+// Adds to a counter only its own thread writes.
+inline void bumpCounter(atomic<uint64_t>& counter, uint64_t n = 1) {
+    counter.store(counter.load(memory_order_relaxed) + n, memory_order_relaxed);
+}
+
+// Runs fn(0) to fn(count - 1) at once, the last one on the calling thread,
+// and rethrows the first exception any of them threw once all are done.
+template <typename Fn>
+void runParallel(size_t count, Fn&& fn) {
+    vector<exception_ptr> errors(count);
+    vector<thread> threads;
+    threads.reserve(count);
+    for (size_t i = 0; i + 1 < count; ++i) {
+        threads.emplace_back([&fn, &errors, i]() {
+            try {
+                fn(i);
+            } catch (...) {
+                errors[i] = current_exception();
             }
+        });
+    }
+    if (count > 0) {
+        try {
+            fn(count - 1);
+        } catch (...) {
+            errors[count - 1] = current_exception();
         }
+    }
+    for (auto& t : threads) t.join();
+    for (auto& error : errors) {
+        if (error) rethrow_exception(error);
+    }
+}
 
-        for (const auto& [key, value] : entries) {
-            ValueEntry entry;
-            entry.value = value;
-            entry.ttl = ttl == 0 ? 0 : time(nullptr) + ttl;
-            store[key] = entry;
-        }
+struct LatencySummary {
+    uint64_t count = 0;
+    double meanUs = 0;
+    double p50Us = 0;
+    double p99Us = 0;
+    double p999Us = 0;
+    double maxUs = 0;
+};
 
-        saveToFile();
-        return "Batch create operation successful.";
+// Log-linear histogram of nanosecond latencies in the style of
+// HdrHistogram: 16 buckets per power of two, so a value is reported within
+// 1/16 of itself, from 1 ns up to about 4 hours. Only one thread records
+// into a histogram, with plain loads and stores; any thread may read it.
+class LatencyHistogram {
+public:
+    static constexpr size_t SUB_BITS = 4;
+    static constexpr size_t SUB = size_t(1) << SUB_BITS;
+    static constexpr size_t OCTAVES = 40;
+    static constexpr size_t BUCKETS = (OCTAVES + 1) * SUB;
+
+private:
+    array<atomic<uint64_t>, BUCKETS> buckets{};
+    atomic<uint64_t> sum{0};
+    atomic<uint64_t> peak{0};
+
+    static size_t bucketFor(uint64_t nanos) {
+        nanos = min<uint64_t>(nanos, (uint64_t(1) << (OCTAVES + SUB_BITS)) - 1);
+        if (nanos < SUB) return static_cast<size_t>(nanos);
+        size_t shift = 63 - static_cast<size_t>(__builtin_clzll(nanos)) - SUB_BITS;
+        return (shift + 1) * SUB + static_cast<size_t>((nanos >> shift) - SUB);
+    }
+
+public:
+    // Middle of the range of values counted in the bucket.
+    static double bucketValue(size_t bucket) {
+        if (bucket < SUB) return static_cast<double>(bucket);
+        size_t shift = bucket / SUB - 1;
+        uint64_t low = (SUB + bucket % SUB) << shift;
+        return static_cast<double>(low) + static_cast<double>(uint64_t(1) << shift) / 2;
+    }
+
+    void record(uint64_t nanos) {
+        bumpCounter(buckets[bucketFor(nanos)]);
+        bumpCounter(sum, nanos);
+        if (nanos > peak.load(memory_order_relaxed)) peak.store(nanos, memory_order_relaxed);
+    }
+
+    // Adds this histogram into a merged copy.
+    void addTo(vector<uint64_t>& merged, uint64_t& mergedSum, uint64_t& mergedMax) const {
+        for (size_t i = 0; i < BUCKETS; ++i) merged[i] += buckets[i].load(memory_order_relaxed);
+        mergedSum += sum.load(memory_order_relaxed);
+        mergedMax = max(mergedMax, peak.load(memory_order_relaxed));
+    }
+
+    static LatencySummary summarize(const vector<uint64_t>& merged, uint64_t total, uint64_t maxNanos) {
+        LatencySummary summary;
+        for (uint64_t n : merged) summary.count += n;
+        if (summary.count == 0) return summary;
+        auto quantile = [&](double q) {
+            uint64_t rank = max<uint64_t>(1, static_cast<uint64_t>(ceil(q * static_cast<double>(summary.count))));
+            uint64_t seen = 0;
+            for (size_t i = 0; i < BUCKETS; ++i) {
+                seen += merged[i];
+                if (seen >= rank) return min(bucketValue(i), static_cast<double>(maxNanos)) / 1000.0;
+            }
+            return static_cast<double>(maxNanos) / 1000.0;
+        };
+        summary.meanUs = static_cast<double>(total) / static_cast<double>(summary.count) / 1000.0;
+        summary.p50Us = quantile(0.5);
+        summary.p99Us = quantile(0.99);
+        summary.p999Us = quantile(0.999);
+        summary.maxUs = static_cast<double>(maxNanos) / 1000.0;
+        return summary;
     }
 };
 
-int main() {
-    cout << "Program started..." << endl;
-    KVDataStore kvStore;
+// Counters and latency histograms for one store, kept in ThreadSlots so
+// the hot path never writes to memory another thread writes.
+class KVMetrics {
+public:
+    enum Counter : size_t {
+        READ_HITS, READ_MISSES, READ_EXPIRED,
+        CREATES, CREATE_ERRORS,
+        REMOVES, REMOVE_MISSES,
+        BATCH_CREATES, BATCH_ERRORS, BATCH_KEYS,
+        EXPIRATIONS, SNAPSHOTS, SNAPSHOT_BYTES, CLEANUP_RUNS,
+        // Values stored compressed, with their sizes before and after.
+        COMPRESSED_VALUES, COMPRESSION_INPUT_BYTES, COMPRESSION_OUTPUT_BYTES,
+        COUNTER_COUNT
+    };
+
+    enum Timer : size_t { READ, CREATE, REMOVE, BATCH_CREATE, SNAPSHOT, CLEANUP, TIMER_COUNT };
 
+    static const char* counterName(Counter counter) {
+        static const char* const names[COUNTER_COUNT] = {
+            "read_hits", "read_misses", "read_expired", "creates", "create_errors", "removes", "remove_misses",
+            "batch_creates", "batch_errors", "batch_keys", "expirations", "snapshots", "snapshot_bytes",
+            "cleanup_runs", "compressed_values", "compression_input_bytes", "compression_output_bytes"};
+        return names[counter];
+    }
+
+    static const char* timerName(Timer timer) {
+        static const char* const names[TIMER_COUNT] = {"read", "create", "remove", "batch_create", "snapshot",
+                                                       "cleanup"};
+        return names[timer];
+    }
+
+    using Clock = chrono::steady_clock;
 
-    cout << "Creating key1..." << endl;
-    cout << kvStore.create("key1", {{"name", "Alice"}}, 10) << endl;
+private:
+    struct alignas(64) Slot {
+        array<atomic<uint64_t>, COUNTER_COUNT> counters{};
+        array<LatencyHistogram, TIMER_COUNT> timers;
+    };
 
+    bool enabled;
+    ThreadSlots<Slot> slots;
+
+public:
+    explicit KVMetrics(bool on) : enabled(on) {}
 
-    cout << "Reading key1..." << endl;
-    cout << kvStore.read("key1") << endl;
+    Clock::time_point start() const {
+        return enabled ? Clock::now() : Clock::time_point();
+    }
 
+    void count(Counter counter, uint64_t n = 1) {
+        if (!enabled) return;
+        bumpCounter(slots.local().counters[counter], n);
+    }
 
-    cout << "Sleeping for 11 seconds to allow TTL expiration..." << endl;
-    this_thread::sleep_for(chrono::seconds(9));
+    // Records the time since started and bumps counter in one slot lookup.
+    void finish(Timer timer, Clock::time_point started, Counter counter, uint64_t n = 1) {
+        if (!enabled) return;
+        uint64_t nanos = static_cast<uint64_t>(
+            chrono::duration_cast<chrono::nanoseconds>(Clock::now() - started).count());
+        Slot& slot = slots.local();
+        slot.timers[timer].record(nanos);
+        bumpCounter(slot.counters[counter], n);
+    }
 
+    void collect(array<uint64_t, COUNTER_COUNT>& counters, array<LatencySummary, TIMER_COUNT>& latencies) const {
+        vector<vector<uint64_t>> merged(TIMER_COUNT, vector<uint64_t>(LatencyHistogram::BUCKETS));
+        array<uint64_t, TIMER_COUNT> sums{};
+        array<uint64_t, TIMER_COUNT> maxima{};
+        slots.forEach([&](const Slot& slot) {
+            for (size_t i = 0; i < COUNTER_COUNT; ++i) counters[i] += slot.counters[i].load(memory_order_relaxed);
+            for (size_t t = 0; t < TIMER_COUNT; ++t) slot.timers[t].addTo(merged[t], sums[t], maxima[t]);
+        });
+        for (size_t t = 0; t < TIMER_COUNT; ++t) {
+            latencies[t] = LatencyHistogram::summarize(merged[t], sums[t], maxima[t]);
+        }
+    }
+};
 
-    cout << "Reading expired key1..." << endl;
-    cout << kvStore.read("key1") << endl;
+struct KVStats {
+    array<uint64_t, KVMetrics::COUNTER_COUNT> counters{};
+    array<LatencySummary, KVMetrics::TIMER_COUNT> latencies;
+    size_t keys = 0;
+    uintmax_t logBytes = 0;
+    // fsyncs of the log since the store opened.
+    uint64_t logSyncs = 0;
+    EvictionStats eviction;
 
+    uint64_t operator[](KVMetrics::Counter counter) const {
+        return counters[counter];
+    }
 
-    cout << "Removing key1..." << endl;
-    cout << kvStore.remove("key1") << endl;
+    const LatencySummary& latency(KVMetrics::Timer timer) const {
+        return latencies[timer];
+    }
 
+    // Original over compressed size of the values stored compressed; 0
+    // before any was.
+    double compressionRatio() const {
+        uint64_t out = counters[KVMetrics::COMPRESSION_OUTPUT_BYTES];
+        return out == 0 ? 0 : static_cast<double>(counters[KVMetrics::COMPRESSION_INPUT_BYTES]) / out;
+    }
+};
 
+struct LockSiteStats {
+    const char* site = "";
+    uint64_t acquisitions = 0;
+    // Acquisitions that found the lock taken and had to wait.
+    uint64_t contended = 0;
+    LatencySummary wait;
+    LatencySummary hold;
+    double totalWaitUs = 0;
+    double totalHoldUs = 0;
+};
 
-    cout << "Batch creating keys..." << endl;
-    vector<pair<string, json>> batch = {
-        {"key2", {{"name", "Bob"}}},
-        {"key3", {{"name", "Charlie"}}}
+// Wait and hold times of the shard locks, per call site, when
+// options.lockProfiling is set.
+class LockProfiler {
+public:
+    enum Site : size_t {
+        READ, READ_SLOW, CREATE, UPDATE, PATCH, REMOVE, BATCH, BATCH_READ, SCAN,
+        CLEANUP, CHECKPOINT, SAVE, PUBLISH, STATS, REPLICATE, IMPORT, EXPORT,
+        SITE_COUNT
     };
-    cout << kvStore.batchCreate(batch) << endl;
 
-    return 0;
-}
+    static const char* siteName(Site site) {
+        static const char* const names[SITE_COUNT] = {
+            "read", "read_slow", "create", "update", "patch", "remove", "batch", "batch_read", "scan",
+            "cleanup", "checkpoint", "save", "publish", "stats", "replicate", "import",
+            "export"};
+        return names[site];
+    }
+
+private:
+    struct SiteSlot {
+        atomic<uint64_t> acquisitions{0};
+        atomic<uint64_t> contended{0};
+        LatencyHistogram wait;
+        LatencyHistogram hold;
+    };
+
+    struct alignas(64) Slot {
+        array<SiteSlot, SITE_COUNT> sites;
+    };
+
+    ThreadSlots<Slot> slots;
+
+public:
+    void record(Site site, bool contended, uint64_t waitNanos, uint64_t holdNanos) {
+        SiteSlot& slot = slots.local().sites[site];
+        bumpCounter(slot.acquisitions);
+        if (contended) bumpCounter(slot.contended);
+        slot.wait.record(waitNanos);
+        slot.hold.record(holdNanos);
+    }
+
+    // Sites that were used, most total wait first.
+    vector<LockSiteStats> report() const {
+        vector<LockSiteStats> result;
+        for (size_t i = 0; i < SITE_COUNT; ++i) {
+            LockSiteStats stats;
+            stats.site = siteName(static_cast<Site>(i));
+            vector<uint64_t> wait(LatencyHistogram::BUCKETS), hold(LatencyHistogram::BUCKETS);
+            uint64_t waitSum = 0, waitMax = 0, holdSum = 0, holdMax = 0;
+            slots.forEach([&](const Slot& slot) {
+                stats.acquisitions += slot.sites[i].acquisitions.load(memory_order_relaxed);
+                stats.contended += slot.sites[i].contended.load(memory_order_relaxed);
+                slot.sites[i].wait.addTo(wait, waitSum, waitMax);
+                slot.sites[i].hold.addTo(hold, holdSum, holdMax);
+            });
+            if (stats.acquisitions == 0) continue;
+            stats.wait = LatencyHistogram::summarize(wait, waitSum, waitMax);
+            stats.hold = LatencyHistogram::summarize(hold, holdSum, holdMax);
+            stats.totalWaitUs = static_cast<double>(waitSum) / 1000.0;
+            stats.totalHoldUs = static_cast<double>(holdSum) / 1000.0;
+            result.push_back(stats);
+        }
+        sort(result.begin(), result.end(),
+             [](const LockSiteStats& a, const LockSiteStats& b) { return a.totalWaitUs > b.totalWaitUs; });
+        return result;
+    }
+};
+
+// A shard lock that, given a profiler, reports how long it waited for the
+// mutex and how long it held it against the site that took it. Without one
+// it is the plain Lock plus a null check. Lock is unique_lock or
+// shared_lock over the store's shard mutex.
+template <typename Lock>
+class ProfiledLock {
+private:
+    using Clock = chrono::steady_clock;
+
+    Lock inner;
+    LockProfiler* profiler;
+    LockProfiler::Site site;
+    bool contended = false;
+    uint64_t waitNanos = 0;
+    Clock::time_point acquired;
+
+    static uint64_t nanosSince(Clock::time_point from, Clock::time_point to) {
+        return static_cast<uint64_t>(chrono::duration_cast<chrono::nanoseconds>(to - from).count());
+    }
+
+public:
+    ProfiledLock(typename Lock::mutex_type& mtx, LockProfiler* lockProfiler, LockProfiler::Site lockSite)
+        : inner(mtx, defer_lock), profiler(lockProfiler), site(lockSite) {
+        lock();
+    }
+
+    ProfiledLock(ProfiledLock&&) noexcept = default;
+
+    ~ProfiledLock() {
+        if (inner.owns_lock()) unlock();
+    }
+
+    void lock() {
+        if (!profiler) {
+            inner.lock();
+            return;
+        }
+        // Uncontended acquisitions cost one clock read, taken up front so
+        // it also starts the hold time.
+        Clock::time_point start = Clock::now();
+        contended = !inner.try_lock();
+        if (contended) {
+            inner.lock();
+            acquired = Clock::now();
+            waitNanos = nanosSince(start, acquired);
+        } else {
+            acquired = start;
+            waitNanos = 0;
+        }
+    }
+
+    void unlock() {
+        if (!profiler) {
+            inner.unlock();
+            return;
+        }
+        uint64_t held = nanosSince(acquired, Clock::now());
+        inner.unlock();
+        profiler->record(site, contended, waitNanos, held);
+    }
+};
+
+// Exclusive lock on <datastore>.lock, held for as long as a store is open.
+// A second store on the same path, in this process or another, fails to
+// open instead of overwriting the first one's snapshot and log.
+class FileLock {
+private:
+    int fd = -1;
+
+public:
+    explicit FileLock(const string& path) {
+        fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+        if (fd < 0) {
+            throw runtime_error("Failed to open lock file " + path + ".");
+        }
+        if (::flock(fd, LOCK_EX | LOCK_NB) != 0) {
+            bool held = errno == EWOULDBLOCK;
+            ::close(fd);
+            throw runtime_error(held ? "Datastore is already open by another writer: " + path + "."
+                                     : "Failed to lock " + path + ".");
+        }
+    }
+
+    ~FileLock() {
+        ::close(fd);
+    }
+
+    FileLock(const FileLock&) = delete;
+    FileLock& operator=(const FileLock&) = delete;
+};
+
+// Append-only file of mutation records, one JSON document per line. Every
+// record gets a log sequence number (LSN); commit(lsn) returns once that
+// record is as durable as the configured Durability promises.
+class MutationLog {
+private:
+    string path;
+    Durability durability;
+    chrono::milliseconds fsyncInterval;
+    int fd = -1;
+
+    // Lock order: ioMtx, then bufMtx, then syncMtx. ioMtx keeps fd stable
+    // while it is being written or synced outside bufMtx.
+    mutex ioMtx;
+    mutable mutex bufMtx;
+    string buffer;
+    uint64_t lastLsn = 0;
+    uintmax_t bytes = 0;
+    size_t records = 0;
+    // Sees every record with its LSN, under bufMtx so calls come in LSN
+    // order. Set before other threads start appending.
+    function<void(uint64_t, const string&)> listener;
+
+    mutex syncMtx;
+    condition_variable syncCv;
+    uint64_t durableLsn = 0;
+    bool leaderActive = false;
+    bool stopping = false;
+    thread flusher;
+    atomic<uint64_t> syncs{0};
+
+    static void writeAll(int fd, const char* data, size_t len) {
+        while (len > 0) {
+            ssize_t n = ::write(fd, data, len);
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                throw runtime_error("Failed to append to log file.");
+            }
+            data += n;
+            len -= static_cast<size_t>(n);
+        }
+    }
+
+    void syncFd(int fd) {
+        syncs.fetch_add(1, memory_order_relaxed);
+#ifdef __linux__
+        if (::fdatasync(fd) != 0) {
+#else
+        if (::fsync(fd) != 0) {
+#endif
+            throw runtime_error("Failed to sync log file.");
+        }
+    }
+
+    void openFd(int flags) {
+        fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | flags, 0644);
+        if (fd < 0) {
+            throw runtime_error("Failed to open log file for writing.");
+        }
+    }
+
+    // Writes out whatever group commit has buffered and syncs it. Caller
+    // must hold ioMtx. Returns the highest LSN now on disk.
+    uint64_t flushBuffered() {
+        string pending;
+        uint64_t upTo;
+        {
+            lock_guard<mutex> lock(bufMtx);
+            pending.swap(buffer);
+            upTo = lastLsn;
+        }
+        writeAll(fd, pending.data(), pending.size());
+        if (durability != Durability::None) {
+            syncFd(fd);
+        }
+        return upTo;
+    }
+
+    void markDurable(uint64_t lsn) {
+        lock_guard<mutex> lock(syncMtx);
+        if (lsn > durableLsn) durableLsn = lsn;
+        syncCv.notify_all();
+    }
+
+    void flushLoop() {
+        unique_lock<mutex> lock(syncMtx);
+        while (!stopping) {
+            syncCv.wait_for(lock, fsyncInterval);
+            if (stopping) break;
+            lock.unlock();
+            try {
+                sync();
+            } catch (const exception& e) {
+                cerr << "Log flush failed: " << e.what() << endl;
+            }
+            lock.lock();
+        }
+    }
+
+public:
+    // While one is alive on a thread, commit() calls made there on its log
+    // only note their LSN, and finish() waits once for the highest. A run
+    // of writes then shares one group commit sync instead of taking one
+    // each. Nothing it covers should be acknowledged before finish().
+    class DeferredCommit {
+    private:
+        MutationLog* log;
+        DeferredCommit* outer;
+        uint64_t lsn = 0;
+        bool finished = false;
+
+        friend class MutationLog;
+
+        static DeferredCommit*& current() {
+            static thread_local DeferredCommit* deferred = nullptr;
+            return deferred;
+        }
+
+    public:
+        explicit DeferredCommit(MutationLog& deferredLog) : log(&deferredLog), outer(current()) {
+            current() = this;
+        }
+
+        DeferredCommit(const DeferredCommit&) = delete;
+        DeferredCommit& operator=(const DeferredCommit&) = delete;
+
+        ~DeferredCommit() {
+            try {
+                finish();
+            } catch (const exception& e) {
+                cerr << "Deferred log commit failed: " << e.what() << endl;
+            }
+        }
+
+        void finish() {
+            if (finished) return;
+            finished = true;
+            current() = outer;
+            if (lsn != 0) log->commit(lsn);
+        }
+    };
+
+    MutationLog(const string& logPath, Durability mode, chrono::milliseconds interval)
+        : path(logPath), durability(mode), fsyncInterval(interval) {}
+
+    ~MutationLog() {
+        close();
+    }
+
+    // Opens the log for appending. The counters start from what replay found
+    // already in the file(s) so checkpoint thresholds see the backlog.
+    void open(uintmax_t existingBytes, size_t existingRecords) {
+        openFd(0);
+        bytes = existingBytes;
+        records = existingRecords;
+        if (durability == Durability::Periodic) {
+            flusher = thread([this]() { flushLoop(); });
+        }
+    }
+
+    void close() {
+        {
+            lock_guard<mutex> lock(syncMtx);
+            stopping = true;
+        }
+        syncCv.notify_all();
+        if (flusher.joinable()) {
+            flusher.join();
+        }
+        lock_guard<mutex> lock(ioMtx);
+        if (fd >= 0) {
+            markDurable(flushBuffered());
+            ::close(fd);
+            fd = -1;
+        }
+    }
+
+    // Adds one record and returns its LSN. Without group commit the record
+    // goes straight to the file; with it, the record waits in memory for
+    // the next commit() leader.
+    uint64_t append(const string& record) {
+        lock_guard<mutex> lock(bufMtx);
+        if (durability == Durability::GroupCommit) {
+            buffer += record;
+            buffer += '\n';
+        } else {
+            string line = record + '\n';
+            writeAll(fd, line.data(), line.size());
+        }
+        bytes += record.size() + 1;
+        ++records;
+        ++lastLsn;
+        if (listener) listener(lastLsn, record);
+        return lastLsn;
+    }
+
+    void setListener(function<void(uint64_t, const string&)> callback) {
+        lock_guard<mutex> lock(bufMtx);
+        listener = move(callback);
+    }
+
+    // LSN of the last record appended. It keeps counting across rotations
+    // and truncations, so an unchanged value means nothing was logged.
+    uint64_t currentLsn() {
+        lock_guard<mutex> lock(bufMtx);
+        return lastLsn;
+    }
+
+    // Blocks until the record with the given LSN is durable. Only group
+    // commit waits: the first writer to arrive becomes leader, writes and
+    // syncs everything buffered so far, and wakes every writer it covered.
+    void commit(uint64_t lsn) {
+        if (durability != Durability::GroupCommit) return;
+        DeferredCommit* deferred = DeferredCommit::current();
+        if (deferred && deferred->log == this) {
+            deferred->lsn = max(deferred->lsn, lsn);
+            return;
+        }
+
+        unique_lock<mutex> lock(syncMtx);
+        while (durableLsn < lsn) {
+            if (leaderActive) {
+                syncCv.wait(lock);
+                continue;
+            }
+            leaderActive = true;
+            lock.unlock();
+            uint64_t upTo = 0;
+            try {
+                lock_guard<mutex> io(ioMtx);
+                upTo = flushBuffered();
+            } catch (...) {
+                lock.lock();
+                leaderActive = false;
+                syncCv.notify_all();
+                throw;
+            }
+            lock.lock();
+            leaderActive = false;
+            if (upTo > durableLsn) durableLsn = upTo;
+            syncCv.notify_all();
+        }
+    }
+
+    // Makes everything appended so far durable.
+    void sync() {
+        lock_guard<mutex> io(ioMtx);
+        uint64_t upTo = flushBuffered();
+        if (durability == Durability::None) {
+            syncFd(fd);
+        }
+        markDurable(upTo);
+    }
+
+    // Moves the current contents aside to oldPath and starts an empty log.
+    // If oldPath is still around from a checkpoint that never finished, the
+    // current contents are appended to it rather than replacing it.
+    void rotate(const string& oldPath) {
+        lock_guard<mutex> io(ioMtx);
+        markDurable(flushBuffered());
+        ::close(fd);
+        fd = -1;
+        if (filesystem::exists(oldPath)) {
+            ifstream live(path, ios::binary);
+            ofstream old(oldPath, ios::binary | ios::app);
+            old << live.rdbuf();
+            old.close();
+            if (!old) {
+                throw runtime_error("Failed to rotate log file.");
+            }
+            openFd(O_TRUNC);
+        } else {
+            filesystem::rename(path, oldPath);
+            openFd(0);
+        }
+        lock_guard<mutex> lock(bufMtx);
+        bytes = 0;
+        records = 0;
+    }
+
+    // Drops every record; used once a snapshot covers the whole log.
+    void truncate() {
+        lock_guard<mutex> io(ioMtx);
+        markDurable(flushBuffered());
+        if (::ftruncate(fd, 0) != 0) {
+            throw runtime_error("Failed to truncate log file.");
+        }
+        lock_guard<mutex> lock(bufMtx);
+        bytes = 0;
+        records = 0;
+    }
+
+    uintmax_t sizeBytes() const {
+        lock_guard<mutex> lock(bufMtx);
+        return bytes;
+    }
+
+    uint64_t syncCount() const {
+        return syncs.load(memory_order_relaxed);
+    }
+
+    size_t recordCount() const {
+        lock_guard<mutex> lock(bufMtx);
+        return records;
+    }
+};
+
+// Where a store's log stood, as a read-your-writes token for followers. An
+// epoch of 0 means the store has replication turned off.
+struct LogPosition {
+    uint64_t epoch = 0;
+    uint64_t lsn = 0;
+};
+
+// The newest records of a store's log, kept in memory in LSN order for
+// followers to stream. LSNs restart from 1 each time a store is opened, so
+// a follower also keeps the epoch, drawn at random when the backlog is
+// created, and only resumes from an LSN it got under the same epoch.
+class ReplicationBacklog {
+private:
+    mutable mutex mtx;
+    condition_variable cv;
+    deque<pair<uint64_t, string>> records;
+    size_t bytes = 0;
+    size_t capacity;
+    uint64_t epochId;
+    // Last LSN no longer held: records up to it were dropped, or were
+    // logged before the backlog existed.
+    uint64_t dropped;
+    uint64_t lastLsn;
+
+public:
+    ReplicationBacklog(size_t capacityBytes, uint64_t currentLsn)
+        : capacity(capacityBytes), dropped(currentLsn), lastLsn(currentLsn) {
+        random_device random;
+        do {
+            epochId = (static_cast<uint64_t>(random()) << 32) ^ random();
+        } while (epochId == 0);
+    }
+
+    uint64_t epoch() const {
+        return epochId;
+    }
+
+    uint64_t last() const {
+        lock_guard<mutex> lock(mtx);
+        return lastLsn;
+    }
+
+    void append(uint64_t lsn, const string& record) {
+        {
+            lock_guard<mutex> lock(mtx);
+            records.emplace_back(lsn, record);
+            bytes += record.size();
+            lastLsn = lsn;
+            while (bytes > capacity && records.size() > 1) {
+                bytes -= records.front().second.size();
+                dropped = records.front().first;
+                records.pop_front();
+            }
+        }
+        cv.notify_all();
+    }
+
+    // Copies up to limit records with an LSN above after, waiting up to
+    // timeout for the first one. Returns false if some of them were
+    // already dropped, in which case the follower needs a full copy.
+    bool readAfter(uint64_t after, vector<pair<uint64_t, string>>& out, size_t limit,
+                   chrono::milliseconds timeout) {
+        out.clear();
+        unique_lock<mutex> lock(mtx);
+        if (after < dropped) return false;
+        cv.wait_for(lock, timeout, [&]() { return lastLsn > after || after < dropped; });
+        if (after < dropped) return false;
+        // LSNs in the deque are consecutive, so the start is found by offset.
+        size_t start = records.empty() ? 0 : static_cast<size_t>(after + 1 - records.front().first);
+        for (size_t i = start; i < records.size() && out.size() < limit; ++i) {
+            out.push_back(records[i]);
+        }
+        return true;
+    }
+
+    // Forgets every record up to lsn, so followers behind it take a full
+    // copy. For changes that bypassed the log.
+    void dropThrough(uint64_t lsn) {
+        {
+            lock_guard<mutex> lock(mtx);
+            while (!records.empty() && records.front().first <= lsn) {
+                bytes -= records.front().second.size();
+                records.pop_front();
+            }
+            dropped = max(dropped, lsn);
+        }
+        cv.notify_all();
+    }
+
+    bool holdsAfter(uint64_t after) const {
+        lock_guard<mutex> lock(mtx);
+        return after >= dropped && after <= lastLsn;
+    }
+};
+
+// Deflate compression of values through zlib. A packed value is the length
+// of its text as a u32, little-endian, then a zlib stream. A stream made
+// with a preset dictionary names it by its Adler-32, so unpack() finds it
+// in a process-wide registry and packed bytes need no other context.
+struct ValueCompression {
+private:
+    struct Registry {
+        shared_mutex mtx;
+        unordered_map<uint32_t, string> dictionaries;
+    };
+
+    static Registry& registry() {
+        static Registry instance;
+        return instance;
+    }
+
+    // zlib streams are expensive to set up, so each thread keeps one of
+    // each and resets it per value.
+    struct Deflater {
+        z_stream zs{};
+        int level = -1;
+        ~Deflater() {
+            if (level >= 0) deflateEnd(&zs);
+        }
+    };
+
+    struct Inflater {
+        z_stream zs{};
+        bool ready = false;
+        ~Inflater() {
+            if (ready) inflateEnd(&zs);
+        }
+    };
+
+    static Bytef* bytesOf(const char* data) {
+        return reinterpret_cast<Bytef*>(const_cast<char*>(data));
+    }
+
+    // Deflate never expands more than this many times, so a length prefix
+    // beyond it is corrupt whatever the caller's limit.
+    static constexpr size_t MAX_RATIO = 1032;
+
+public:
+    // Makes dictionary available to unpack() and returns its id.
+    static uint32_t addDictionary(const string& dictionary) {
+        uint32_t id = static_cast<uint32_t>(
+            adler32(adler32(0, nullptr, 0), bytesOf(dictionary.data()), static_cast<uInt>(dictionary.size())));
+        Registry& r = registry();
+        unique_lock<shared_mutex> lock(r.mtx);
+        r.dictionaries.emplace(id, dictionary);
+        return id;
+    }
+
+    // The packed form of text, or an empty string if it would not be smaller.
+    static string pack(string_view text, int level, const string& dictionary) {
+        thread_local Deflater deflater;
+        z_stream& zs = deflater.zs;
+        if (deflater.level != level) {
+            if (deflater.level >= 0) deflateEnd(&zs);
+            deflater.level = -1;
+            zs = z_stream{};
+            if (deflateInit(&zs, level) != Z_OK) {
+                throw runtime_error("Failed to set up compression.");
+            }
+            deflater.level = level;
+        } else {
+            deflateReset(&zs);
+        }
+        if (!dictionary.empty()) {
+            deflateSetDictionary(&zs, bytesOf(dictionary.data()), static_cast<uInt>(dictionary.size()));
+        }
+
+        string out(4 + deflateBound(&zs, static_cast<uLong>(text.size())), '\0');
+        uint32_t length = static_cast<uint32_t>(text.size());
+        for (size_t i = 0; i < 4; ++i) out[i] = static_cast<char>((length >> (8 * i)) & 0xFF);
+        zs.next_in = bytesOf(text.data());
+        zs.avail_in = static_cast<uInt>(text.size());
+        zs.next_out = bytesOf(out.data() + 4);
+        zs.avail_out = static_cast<uInt>(out.size() - 4);
+        if (deflate(&zs, Z_FINISH) != Z_STREAM_END) {
+            throw runtime_error("Failed to compress value.");
+        }
+        out.resize(4 + zs.total_out);
+        if (out.size() >= text.size()) return string();
+        return out;
+    }
+
+    // The length of the text packed holds, from its prefix. Throws if that
+    // is more than maxLength or than the stream could inflate to.
+    static size_t unpackedLength(string_view packed, size_t maxLength = numeric_limits<uint32_t>::max()) {
+        if (packed.size() < 4) {
+            throw runtime_error("Compressed value is corrupt.");
+        }
+        size_t length = 0;
+        for (size_t i = 0; i < 4; ++i) length |= static_cast<size_t>(static_cast<uint8_t>(packed[i])) << (8 * i);
+        if (length > maxLength || length > (packed.size() - 4) * MAX_RATIO) {
+            throw runtime_error("Compressed value is corrupt.");
+        }
+        return length;
+    }
+
+    static string unpack(string_view packed, size_t maxLength = numeric_limits<uint32_t>::max()) {
+        size_t length = unpackedLength(packed, maxLength);
+        string out(length, '\0');
+
+        thread_local Inflater inflater;
+        z_stream& zs = inflater.zs;
+        if (!inflater.ready) {
+            if (inflateInit(&zs) != Z_OK) {
+                throw runtime_error("Failed to set up decompression.");
+            }
+            inflater.ready = true;
+        } else {
+            inflateReset(&zs);
+        }
+        zs.next_in = bytesOf(packed.data() + 4);
+        zs.avail_in = static_cast<uInt>(packed.size() - 4);
+        zs.next_out = bytesOf(out.data());
+        zs.avail_out = static_cast<uInt>(length);
+        int rc = inflate(&zs, Z_FINISH);
+        if (rc == Z_NEED_DICT) {
+            Registry& r = registry();
+            shared_lock<shared_mutex> lock(r.mtx);
+            auto it = r.dictionaries.find(static_cast<uint32_t>(zs.adler));
+            if (it == r.dictionaries.end()) {
+                throw runtime_error("Compressed value needs a dictionary that is not loaded.");
+            }
+            inflateSetDictionary(&zs, bytesOf(it->second.data()), static_cast<uInt>(it->second.size()));
+            lock.unlock();
+            rc = inflate(&zs, Z_FINISH);
+        }
+        if (rc != Z_STREAM_END || zs.total_out != length) {
+            throw runtime_error("Compressed value is corrupt.");
+        }
+        return out;
+    }
+
+    // Builds a preset dictionary from sample values. Each sample is cut
+    // after every ',', ':', '{' and '[' and the pieces that recur are kept,
+    // most bytes saved first, up to maxBytes. zlib reaches the end of a
+    // dictionary most cheaply, so the best pieces go last.
+    static string trainDictionary(const vector<string>& samples, size_t maxBytes = 16 * 1024) {
+        unordered_map<string_view, size_t> counts;
+        for (const auto& sample : samples) {
+            size_t start = 0;
+            for (size_t i = 0; i < sample.size(); ++i) {
+                char c = sample[i];
+                if (c == ',' || c == ':' || c == '{' || c == '[' || i + 1 == sample.size()) {
+                    if (i + 1 - start >= 3) ++counts[string_view(sample).substr(start, i + 1 - start)];
+                    start = i + 1;
+                }
+            }
+        }
+        vector<pair<size_t, string_view>> ranked;
+        for (const auto& [piece, count] : counts) {
+            if (count > 1) ranked.emplace_back(count * piece.size(), piece);
+        }
+        sort(ranked.begin(), ranked.end(), greater<>());
+        vector<string_view> chosen;
+        size_t total = 0;
+        for (const auto& [score, piece] : ranked) {
+            if (total + piece.size() > maxBytes) continue;
+            chosen.push_back(piece);
+            total += piece.size();
+        }
+        string dictionary;
+        dictionary.reserve(total);
+        for (auto it = chosen.rbegin(); it != chosen.rend(); ++it) dictionary.append(it->data(), it->size());
+        return dictionary;
+    }
+
+    // Packed values travel through the JSON log as base64.
+    static string toBase64(string_view data) {
+        static const char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+        string out;
+        out.reserve((data.size() + 2) / 3 * 4);
+        for (size_t i = 0; i < data.size(); i += 3) {
+            uint32_t n = static_cast<uint8_t>(data[i]) << 16;
+            if (i + 1 < data.size()) n |= static_cast<uint8_t>(data[i + 1]) << 8;
+            if (i + 2 < data.size()) n |= static_cast<uint8_t>(data[i + 2]);
+            out += alphabet[(n >> 18) & 63];
+            out += alphabet[(n >> 12) & 63];
+            out += i + 1 < data.size() ? alphabet[(n >> 6) & 63] : '=';
+            out += i + 2 < data.size() ? alphabet[n & 63] : '=';
+        }
+        return out;
+    }
+
+    static string fromBase64(string_view text) {
+        static const auto table = []() {
+            array<int8_t, 256> t;
+            t.fill(-1);
+            const char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+            for (int8_t i = 0; i < 64; ++i) t[static_cast<uint8_t>(alphabet[i])] = i;
+            return t;
+        }();
+        string out;
+        out.reserve(text.size() / 4 * 3);
+        uint32_t n = 0;
+        int bits = 0;
+        for (char c : text) {
+            int8_t v = table[static_cast<uint8_t>(c)];
+            if (v < 0) continue;
+            n = (n << 6) | static_cast<uint32_t>(v);
+            bits += 6;
+            if (bits >= 8) {
+                bits -= 8;
+                out += static_cast<char>((n >> bits) & 0xFF);
+            }
+        }
+        return out;
+    }
+};
+
+// Versioned binary snapshot layout, all integers little-endian:
+//
+//   header  "KVSB" | u32 version | u32 value codec (0 = CBOR)
+//   block   u32 entry count | u32 payload bytes | u32 CRC-32 of payload | payload
+//   entry   u16 key length | key | i64 ttl | u32 value length | value
+//
+// Values are CBOR, or compact JSON text when the header codec says so
+// (written by stores in ValueMode::Bytes, which keep values as text). With
+// the packed codec, written by stores that compress, each value is a tag
+// byte, 0 for JSON text or 1 for a ValueCompression packed value, then
+// the value.
+//   trailer a block with zero entries and zero payload
+//
+// A file that ends before the trailer is truncated and is rejected.
+struct BinarySnapshot {
+    static constexpr char MAGIC[4] = {'K', 'V', 'S', 'B'};
+    static constexpr uint32_t VERSION = 1;
+    static constexpr uint32_t CODEC_CBOR = 0;
+    static constexpr uint32_t CODEC_JSON_TEXT = 1;
+    static constexpr uint32_t CODEC_PACKED_TEXT = 2;
+    static constexpr size_t HEADER_BYTES = 12;
+    static constexpr size_t BLOCK_HEADER_BYTES = 12;
+    static constexpr size_t BLOCK_TARGET_BYTES = 64 * 1024;
+
+    static uint32_t crc32(const char* data, size_t len) {
+        static const auto table = []() {
+            array<uint32_t, 256> t{};
+            for (uint32_t i = 0; i < 256; ++i) {
+                uint32_t c = i;
+                for (int k = 0; k < 8; ++k) {
+                    c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+                }
+                t[i] = c;
+            }
+            return t;
+        }();
+        uint32_t crc = 0xFFFFFFFFu;
+        for (size_t i = 0; i < len; ++i) {
+            crc = table[(crc ^ static_cast<uint8_t>(data[i])) & 0xFF] ^ (crc >> 8);
+        }
+        return crc ^ 0xFFFFFFFFu;
+    }
+
+    template <typename T>
+    static void put(string& out, T v) {
+        for (size_t i = 0; i < sizeof(T); ++i) {
+            out.push_back(static_cast<char>((static_cast<uint64_t>(v) >> (8 * i)) & 0xFF));
+        }
+    }
+
+    template <typename T>
+    static T get(const char* p) {
+        uint64_t v = 0;
+        for (size_t i = 0; i < sizeof(T); ++i) {
+            v |= static_cast<uint64_t>(static_cast<uint8_t>(p[i])) << (8 * i);
+        }
+        return static_cast<T>(v);
+    }
+
+    static bool matches(const char* data, size_t size) {
+        return size >= sizeof(MAGIC) && memcmp(data, MAGIC, sizeof(MAGIC)) == 0;
+    }
+
+    static void appendBlock(string& out, string& payload, uint32_t count) {
+        put<uint32_t>(out, count);
+        put<uint32_t>(out, static_cast<uint32_t>(payload.size()));
+        put<uint32_t>(out, crc32(payload.data(), payload.size()));
+        out += payload;
+        payload.clear();
+    }
+
+    template <typename Entry>
+    static void appendEntry(string& payload, const string& key, const Entry& entry, uint32_t codec) {
+        put<uint16_t>(payload, static_cast<uint16_t>(key.size()));
+        payload += key;
+        put<int64_t>(payload, static_cast<int64_t>(entry.ttl));
+        size_t lengthAt = payload.size();
+        put<uint32_t>(payload, 0);
+        entry.appendEncoded(payload, codec);
+        uint32_t valueLen = static_cast<uint32_t>(payload.size() - lengthAt - 4);
+        for (size_t i = 0; i < 4; ++i) {
+            payload[lengthAt + i] = static_cast<char>((valueLen >> (8 * i)) & 0xFF);
+        }
+    }
+
+    // Encodes one part as whole blocks, so parts can be encoded apart and
+    // written one after another.
+    template <typename Map>
+    static string encodePart(const Map& part, uint32_t codec) {
+        string out;
+        string payload;
+        payload.reserve(BLOCK_TARGET_BYTES + 64);
+        uint32_t count = 0;
+        for (const auto& [key, entry] : part) {
+            appendEntry(payload, key, entry, codec);
+            ++count;
+            if (payload.size() >= BLOCK_TARGET_BYTES) {
+                appendBlock(out, payload, count);
+                count = 0;
+            }
+        }
+        if (count > 0) {
+            appendBlock(out, payload, count);
+        }
+        return out;
+    }
+
+    // Encodes up to threads parts at a time, each on its own thread, and
+    // writes each round out in order before starting the next, so at most
+    // that many encoded parts are held in memory.
+    template <typename Map>
+    static void write(ostream& out, const vector<Map>& parts, uint32_t codec, size_t threads = 1) {
+        string header(MAGIC, sizeof(MAGIC));
+        put<uint32_t>(header, VERSION);
+        put<uint32_t>(header, codec);
+        out.write(header.data(), header.size());
+
+        threads = max<size_t>(threads, 1);
+        vector<string> encoded;
+        for (size_t first = 0; first < parts.size(); first += threads) {
+            size_t round = min(threads, parts.size() - first);
+            encoded.assign(round, string());
+            runParallel(round, [&](size_t i) { encoded[i] = encodePart(parts[first + i], codec); });
+            for (auto& part : encoded) {
+                out.write(part.data(), part.size());
+                string().swap(part);
+            }
+        }
+        string trailer;
+        string empty;
+        appendBlock(trailer, empty, 0);
+        out.write(trailer.data(), trailer.size());
+    }
+
+    // Reads the value codec out of a snapshot header checked by matches().
+    static uint32_t codec(const char* data) {
+        return get<uint32_t>(data + 8);
+    }
+
+    struct BlockRef {
+        // Offset of the payload in the image.
+        size_t offset;
+        uint32_t count;
+        uint32_t bytes;
+        uint32_t crc;
+    };
+
+    // Finds every block of a snapshot image from the block headers alone,
+    // checking that each lies within the image, so blocks can then be
+    // decoded in any order or at once.
+    static vector<BlockRef> blocks(const char* data, size_t size) {
+        if (size < HEADER_BYTES || !matches(data, size)) {
+            throw runtime_error("Snapshot is not in binary format.");
+        }
+        if (get<uint32_t>(data + 4) != VERSION || codec(data) > CODEC_PACKED_TEXT) {
+            throw runtime_error("Unsupported binary snapshot version.");
+        }
+
+        vector<BlockRef> found;
+        size_t pos = HEADER_BYTES;
+        while (true) {
+            if (size - pos < BLOCK_HEADER_BYTES) {
+                throw runtime_error("Binary snapshot is truncated.");
+            }
+            BlockRef block;
+            block.count = get<uint32_t>(data + pos);
+            block.bytes = get<uint32_t>(data + pos + 4);
+            block.crc = get<uint32_t>(data + pos + 8);
+            pos += BLOCK_HEADER_BYTES;
+            if (block.count == 0 && block.bytes == 0) return found;
+            if (size - pos < block.bytes) {
+                throw runtime_error("Binary snapshot is truncated.");
+            }
+            block.offset = pos;
+            found.push_back(block);
+            pos += block.bytes;
+        }
+    }
+
+    static void verify(const char* data, const BlockRef& block) {
+        if (crc32(data + block.offset, block.bytes) != block.crc) {
+            throw runtime_error("Binary snapshot block checksum mismatch.");
+        }
+    }
+
+    // Hands the key, TTL and encoded value of every entry in one block to
+    // onEntry.
+    template <typename EntryFn>
+    static void parseBlock(const char* data, const BlockRef& ref, EntryFn&& onEntry) {
+        const char* block = data + ref.offset;
+        size_t off = 0;
+        for (uint32_t i = 0; i < ref.count; ++i) {
+            if (ref.bytes - off < 2) throw runtime_error("Corrupt binary snapshot block.");
+            uint16_t keyLen = get<uint16_t>(block + off);
+            off += 2;
+            if (ref.bytes - off < size_t(keyLen) + 12) throw runtime_error("Corrupt binary snapshot block.");
+            string_view key(block + off, keyLen);
+            off += keyLen;
+            time_t ttl = static_cast<time_t>(get<int64_t>(block + off));
+            off += 8;
+            uint32_t valueLen = get<uint32_t>(block + off);
+            off += 4;
+            if (ref.bytes - off < valueLen) throw runtime_error("Corrupt binary snapshot block.");
+            onEntry(key, ttl, block + off, static_cast<size_t>(valueLen));
+            off += valueLen;
+        }
+    }
+
+    // Walks every entry in a snapshot image and hands the encoded bytes of
+    // each value to onEntry. onBlock sees each block before its entries;
+    // checksums are only checked when verifyBlocks is set.
+    template <typename BlockFn, typename EntryFn>
+    static void walk(const char* data, size_t size, bool verifyBlocks, BlockFn&& onBlock, EntryFn&& onEntry) {
+        for (const BlockRef& block : blocks(data, size)) {
+            if (verifyBlocks) verify(data, block);
+            onBlock(block.offset, block.bytes, block.crc);
+            parseBlock(data, block, onEntry);
+        }
+    }
+
+    template <typename EntryFn>
+    static void parse(const char* data, size_t size, EntryFn&& onEntry) {
+        walk(data, size, true, [](size_t, uint32_t, uint32_t) {}, onEntry);
+    }
+};
+
+// Where the bytes of a cold value live. A value is found by the block it
+// belongs to, for sources that checksum blocks, and its offset and length.
+class ColdSource {
+public:
+    virtual ~ColdSource() = default;
+    virtual uint32_t valueCodec() const = 0;
+    virtual string_view bytes(uint32_t block, size_t offset, uint32_t length) const = 0;
+};
+
+// Read-only mmap of a binary snapshot, used by KVOptions::lazyLoad. Only
+// keys and TTLs are read at startup; values stay in the mapping until
+// their first read. The checksum of a block is verified the first time
+// one of its values is decoded.
+class MappedSnapshot : public ColdSource {
+private:
+    struct Block {
+        size_t offset;
+        uint32_t bytes;
+        uint32_t crc;
+    };
+
+    const char* data = nullptr;
+    size_t size = 0;
+    vector<Block> blocks;
+    vector<atomic<bool>> verified;
+    uint32_t codec = BinarySnapshot::CODEC_CBOR;
+
+public:
+    explicit MappedSnapshot(const string& path) {
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            throw runtime_error("Failed to open snapshot for mapping.");
+        }
+        struct stat st;
+        if (::fstat(fd, &st) != 0) {
+            ::close(fd);
+            throw runtime_error("Failed to stat snapshot.");
+        }
+        size = static_cast<size_t>(st.st_size);
+        void* addr = size == 0 ? MAP_FAILED : ::mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        ::close(fd);
+        if (addr == MAP_FAILED) {
+            throw runtime_error("Failed to map snapshot.");
+        }
+        data = static_cast<const char*>(addr);
+    }
+
+    ~MappedSnapshot() {
+        if (data) {
+            ::munmap(const_cast<char*>(data), size);
+        }
+    }
+
+    MappedSnapshot(const MappedSnapshot&) = delete;
+    MappedSnapshot& operator=(const MappedSnapshot&) = delete;
+
+    // Walks the entry headers without touching checksums and reports each
+    // entry as (key, ttl, block, value offset, value length).
+    template <typename Callback>
+    void index(Callback&& onEntry) {
+        uint32_t block = 0;
+        BinarySnapshot::walk(data, size, false,
+            [&](size_t offset, uint32_t bytes, uint32_t crc) {
+                block = static_cast<uint32_t>(blocks.size());
+                blocks.push_back({offset, bytes, crc});
+            },
+            [&](string_view key, time_t ttl, const char* value, size_t len) {
+                onEntry(key, ttl, block, static_cast<size_t>(value - data), static_cast<uint32_t>(len));
+            });
+        verified = vector<atomic<bool>>(blocks.size());
+        codec = BinarySnapshot::codec(data);
+    }
+
+    uint32_t valueCodec() const override {
+        return codec;
+    }
+
+    void verifyBlock(uint32_t block) const {
+        if (verified[block].load(memory_order_acquire)) return;
+        const Block& b = blocks[block];
+        if (BinarySnapshot::crc32(data + b.offset, b.bytes) != b.crc) {
+            throw runtime_error("Binary snapshot block checksum mismatch.");
+        }
+        const_cast<atomic<bool>&>(verified[block]).store(true, memory_order_release);
+    }
+
+    string_view bytes(uint32_t block, size_t offset, uint32_t length) const override {
+        verifyBlock(block);
+        return string_view(data + offset, length);
+    }
+};
+
+// Append-only file a tiered store pages cold values out to, one per shard.
+// It is unlinked as soon as it is created: everything in it is a copy of
+// what the snapshot and log already hold, so nothing needs it once the
+// process is gone. It grows in mapped segments that never move, so readers
+// follow an offset without a lock; appends are serialized by the owning
+// shard's exclusive lock.
+class SpillFile : public ColdSource {
+private:
+    static constexpr size_t SEGMENT_BYTES = 64 * 1024 * 1024;
+    static constexpr size_t MAX_SEGMENTS = 256;
+
+    int fd = -1;
+    array<atomic<char*>, MAX_SEGMENTS> segments;
+    size_t used = 0;
+
+public:
+    explicit SpillFile(const string& path) {
+        fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0600);
+        if (fd < 0) {
+            throw runtime_error("Failed to open spill file " + path + ".");
+        }
+        ::unlink(path.c_str());
+        for (auto& segment : segments) {
+            segment.store(nullptr, memory_order_relaxed);
+        }
+    }
+
+    ~SpillFile() {
+        for (auto& segment : segments) {
+            char* addr = segment.load(memory_order_relaxed);
+            if (addr) ::munmap(addr, SEGMENT_BYTES);
+        }
+        ::close(fd);
+    }
+
+    SpillFile(const SpillFile&) = delete;
+    SpillFile& operator=(const SpillFile&) = delete;
+
+    // Copies value into the file and returns its offset. Values never
+    // straddle two segments.
+    size_t append(string_view value) {
+        if (used % SEGMENT_BYTES + value.size() > SEGMENT_BYTES) {
+            used = (used / SEGMENT_BYTES + 1) * SEGMENT_BYTES;
+        }
+        size_t index = used / SEGMENT_BYTES;
+        if (index >= MAX_SEGMENTS) {
+            throw runtime_error("Spill file is full.");
+        }
+        char* segment = segments[index].load(memory_order_relaxed);
+        if (!segment) {
+            off_t offset = static_cast<off_t>(index * SEGMENT_BYTES);
+            if (::ftruncate(fd, offset + static_cast<off_t>(SEGMENT_BYTES)) != 0) {
+                throw runtime_error("Failed to grow spill file.");
+            }
+            void* addr = ::mmap(nullptr, SEGMENT_BYTES, PROT_READ | PROT_WRITE, MAP_SHARED, fd, offset);
+            if (addr == MAP_FAILED) {
+                throw runtime_error("Failed to map spill file.");
+            }
+            segment = static_cast<char*>(addr);
+            segments[index].store(segment, memory_order_release);
+        }
+        size_t at = used;
+        memcpy(segment + at % SEGMENT_BYTES, value.data(), value.size());
+        used += value.size();
+        return at;
+    }
+
+    size_t sizeBytes() const {
+        return used;
+    }
+
+    uint32_t valueCodec() const override {
+        return BinarySnapshot::CODEC_JSON_TEXT;
+    }
+
+    string_view bytes(uint32_t, size_t offset, uint32_t length) const override {
+        const char* segment = segments[offset / SEGMENT_BYTES].load(memory_order_acquire);
+        return string_view(segment + offset % SEGMENT_BYTES, length);
+    }
+};
+
+// Read-only image of a store that its owner publishes for KVSharedReader.
+// Both live in shared memory, under a name derived from the datastore path:
+//
+//   <base>.ctl  Control: generation of the latest image, and the owner's
+//               pid, or 0 once the owner has closed the store
+//   <base>.img  header (magic, version, generation, slot count, entry
+//               count), a power-of-two table of (key hash, entry offset)
+//               slots probed linearly with hash 0 marking an empty slot,
+//               then the entries: key length (uint8), key, expiry (int64),
+//               value length (uint32), value as JSON text
+//
+// Each image is written to a temp file and renamed into place before the
+// generation is bumped, so a reader never maps a partial image.
+struct SharedImage {
+    static constexpr char MAGIC[4] = {'K', 'V', 'S', 'I'};
+    static constexpr uint32_t VERSION = 1;
+    static constexpr size_t HEADER_BYTES = 32;
+    static constexpr size_t SLOT_BYTES = 16;
+
+    struct Control {
+        atomic<uint64_t> generation;
+        atomic<int64_t> ownerPid;
+    };
+
+    // FNV-1a, so every process agrees on slots whatever its std::hash is.
+    static uint64_t hashOf(string_view key) {
+        uint64_t h = 14695981039346656037ull;
+        for (char c : key) {
+            h = (h ^ static_cast<uint8_t>(c)) * 1099511628211ull;
+        }
+        return h != 0 ? h : 1;
+    }
+
+    static string basePath(const string& dataPath) {
+        string canonical = filesystem::weakly_canonical(filesystem::absolute(dataPath)).string();
+        char name[32];
+        snprintf(name, sizeof(name), "kvstore-%016llx", static_cast<unsigned long long>(hashOf(canonical)));
+        error_code ec;
+        if (filesystem::is_directory("/dev/shm", ec)) return string("/dev/shm/") + name;
+        return dataPath + ".shm";
+    }
+
+    static void appendEntry(string& data, vector<pair<uint64_t, uint64_t>>& slots, string_view key,
+                            time_t expiry, const string& text) {
+        slots.emplace_back(hashOf(key), data.size());
+        data.push_back(static_cast<char>(key.size()));
+        data.append(key.data(), key.size());
+        BinarySnapshot::put<int64_t>(data, expiry);
+        BinarySnapshot::put<uint32_t>(data, static_cast<uint32_t>(text.size()));
+        data += text;
+    }
+
+    static void write(const string& path, const string& data, const vector<pair<uint64_t, uint64_t>>& entries,
+                      uint64_t generation) {
+        size_t slotCount = 16;
+        while (slotCount < entries.size() * 2) slotCount <<= 1;
+        size_t dataStart = HEADER_BYTES + slotCount * SLOT_BYTES;
+
+        vector<uint64_t> table(slotCount * 2, 0);
+        for (const auto& [h, offset] : entries) {
+            size_t i = h & (slotCount - 1);
+            while (table[i * 2] != 0) i = (i + 1) & (slotCount - 1);
+            table[i * 2] = h;
+            table[i * 2 + 1] = dataStart + offset;
+        }
+
+        string head(MAGIC, sizeof(MAGIC));
+        BinarySnapshot::put<uint32_t>(head, VERSION);
+        BinarySnapshot::put<uint64_t>(head, generation);
+        BinarySnapshot::put<uint64_t>(head, slotCount);
+        BinarySnapshot::put<uint64_t>(head, entries.size());
+        for (uint64_t v : table) BinarySnapshot::put<uint64_t>(head, v);
+
+        string tmpPath = path + ".tmp";
+        ofstream file(tmpPath, ios::trunc | ios::binary);
+        file.write(head.data(), static_cast<streamsize>(head.size()));
+        file.write(data.data(), static_cast<streamsize>(data.size()));
+        file.close();
+        if (!file) {
+            throw runtime_error("Failed to write shared image.");
+        }
+        filesystem::rename(tmpPath, path);
+    }
+};
+
+// A value that is not held in memory: not yet decoded out of a mapped
+// snapshot, or paged out to a spill file.
+struct ColdValue {
+    shared_ptr<const ColdSource> source;
+    uint32_t block = 0;
+    size_t offset = 0;
+    uint32_t length = 0;
+
+    explicit operator bool() const {
+        return source != nullptr;
+    }
+
+    uint32_t codec() const {
+        return source->valueCodec();
+    }
+
+    // The value exactly as encoded in its source.
+    string_view raw() const {
+        return source->bytes(block, offset, length);
+    }
+
+    // For the packed codec: whether the value is compressed, and its bytes
+    // after the tag.
+    bool packed() const {
+        return codec() == BinarySnapshot::CODEC_PACKED_TEXT && raw()[0] == 1;
+    }
+
+    string_view untagged() const {
+        return raw().substr(1);
+    }
+
+    json decode() const {
+        string_view bytes = raw();
+        if (codec() == BinarySnapshot::CODEC_JSON_TEXT) {
+            return json::parse(bytes.begin(), bytes.end());
+        }
+        if (codec() == BinarySnapshot::CODEC_PACKED_TEXT) {
+            return json::parse(text());
+        }
+        return json::from_cbor(bytes.begin(), bytes.end());
+    }
+
+    string text() const {
+        if (codec() == BinarySnapshot::CODEC_JSON_TEXT) {
+            return string(raw());
+        }
+        if (codec() == BinarySnapshot::CODEC_PACKED_TEXT) {
+            return packed() ? ValueCompression::unpack(untagged()) : string(untagged());
+        }
+        return decode().dump();
+    }
+};
+
+// A stored value. In ValueMode::Json it is held in value as a json tree;
+// in ValueMode::Bytes it is the compact JSON text produced when it was
+// written. Either is shared and never changed once stored, so copies of
+// the entry, such as a checkpoint's cut, never copy the tree or the text.
+// A compressed value is in bytes, packed, in either mode.
+struct ValueEntry {
+    // Reference bit for CLOCK eviction. Readers set it, possibly under a
+    // shared lock or none at all, so it is atomic; copies take its value.
+    struct RefBit {
+        atomic<bool> bit{true};
+
+        RefBit() = default;
+        RefBit(const RefBit& other) : bit(other.bit.load(memory_order_relaxed)) {}
+        RefBit& operator=(const RefBit& other) {
+            bit.store(other.bit.load(memory_order_relaxed), memory_order_relaxed);
+            return *this;
+        }
+    };
+
+    shared_ptr<const json> value;
+    SharedBytes bytes;
+    time_t ttl = 0;
+    ColdValue cold;
+    // Bytes charged against the memory budget; 0 until the entry is stored.
+    uint32_t charge = 0;
+    mutable RefBit referenced;
+    // bytes holds a ValueCompression packed value rather than text.
+    bool packed = false;
+
+    // Marks the entry as recently used. Only writes when the bit is clear,
+    // so hot entries do not bounce their cache line between readers.
+    void touch() const {
+        if (!referenced.bit.load(memory_order_relaxed)) {
+            referenced.bit.store(true, memory_order_relaxed);
+        }
+    }
+
+    // The value as compact JSON text, which is what read() returns.
+    string text() const {
+        if (packed) return ValueCompression::unpack(bytes.view());
+        if (bytes) return string(bytes.view());
+        if (cold) return cold.text();
+        return value->dump();
+    }
+
+    json decoded() const {
+        if (packed) return json::parse(text());
+        if (bytes) return json::parse(bytes.data(), bytes.data() + bytes.size());
+        if (cold) return cold.decode();
+        return *value;
+    }
+
+    // Replaces a lazily loaded value with its decoded form.
+    void materialize(bool asBytes, bool pooled) {
+        if (!cold) return;
+        if (cold.packed()) {
+            bytes = SharedBytes::copyOf(cold.untagged(), pooled);
+            packed = true;
+        } else if (asBytes) {
+            bytes = SharedBytes::copyOf(cold.text(), pooled);
+        } else {
+            value = make_shared<const json>(cold.decode());
+        }
+        cold = ColdValue();
+    }
+
+    // Encodes the value for a binary snapshot, copying it as is whenever
+    // it is already held in the requested codec.
+    void appendEncoded(string& out, uint32_t codec) const {
+        if (cold && cold.codec() == codec) {
+            string_view raw = cold.raw();
+            out.append(raw.data(), raw.size());
+        } else if (codec == BinarySnapshot::CODEC_JSON_TEXT) {
+            out += text();
+        } else if (codec == BinarySnapshot::CODEC_PACKED_TEXT) {
+            out += static_cast<char>(packed ? 1 : 0);
+            if (packed) {
+                out.append(bytes.data(), bytes.size());
+            } else {
+                out += text();
+            }
+        } else if (bytes || cold) {
+            json::to_cbor(decoded(), out);
+        } else {
+            json::to_cbor(*value, out);
+        }
+    }
+};
+
+// Epoch-based reclamation for the lock-free read path. A reader announces
+// the global epoch in its slot for the duration of a lookup; memory that a
+// writer unlinks is tagged with the epoch current at unlink time and freed
+// only once every announced epoch has moved past that tag.
+class EpochDomain {
+private:
+    static constexpr uint64_t IDLE = ~uint64_t(0);
+    static constexpr size_t MAX_READERS = 512;
+
+    struct alignas(64) Slot {
+        atomic<uint64_t> epoch{IDLE};
+        atomic<bool> claimed{false};
+    };
+
+    struct Retired {
+        uint64_t epoch;
+        function<void()> free;
+    };
+
+    Slot slots[MAX_READERS];
+    atomic<uint64_t> globalEpoch{1};
+    mutex retireMtx;
+    vector<Retired> retired;
+
+    // Each thread holds one slot for its lifetime and gives it back on exit.
+    struct SlotOwner {
+        Slot* slot = nullptr;
+        ~SlotOwner() {
+            if (slot) slot->claimed.store(false, memory_order_release);
+        }
+    };
+
+    Slot* slotForThread() {
+        thread_local SlotOwner owner;
+        if (!owner.slot) {
+            for (auto& slot : slots) {
+                bool expected = false;
+                if (slot.claimed.compare_exchange_strong(expected, true)) {
+                    owner.slot = &slot;
+                    break;
+                }
+            }
+        }
+        return owner.slot;
+    }
+
+    uint64_t oldestActive() const {
+        uint64_t oldest = IDLE;
+        for (const auto& slot : slots) {
+            oldest = min(oldest, slot.epoch.load(memory_order_acquire));
+        }
+        return oldest;
+    }
+
+public:
+    static EpochDomain& instance() {
+        static EpochDomain domain;
+        return domain;
+    }
+
+    ~EpochDomain() {
+        for (auto& r : retired) r.free();
+    }
+
+    // Pins the current epoch while alive. If every slot is taken the guard
+    // is inactive and the caller has to fall back to locking.
+    class Guard {
+    private:
+        Slot* slot;
+
+    public:
+        explicit Guard(EpochDomain& domain) : slot(domain.slotForThread()) {
+            if (slot) {
+                slot->epoch.store(domain.globalEpoch.load(memory_order_acquire), memory_order_seq_cst);
+                atomic_thread_fence(memory_order_seq_cst);
+            }
+        }
+        ~Guard() {
+            if (slot) slot->epoch.store(IDLE, memory_order_release);
+        }
+        Guard(const Guard&) = delete;
+        Guard& operator=(const Guard&) = delete;
+
+        bool active() const {
+            return slot != nullptr;
+        }
+    };
+
+    // Schedules memory that is no longer reachable for freeing once no
+    // reader can still be looking at it.
+    void retire(function<void()> free) {
+        lock_guard<mutex> lock(retireMtx);
+        retired.push_back({globalEpoch.fetch_add(1, memory_order_acq_rel), move(free)});
+        if (retired.size() >= 64) {
+            reclaimLocked();
+        }
+    }
+
+    void reclaim() {
+        lock_guard<mutex> lock(retireMtx);
+        reclaimLocked();
+    }
+
+private:
+    void reclaimLocked() {
+        atomic_thread_fence(memory_order_seq_cst);
+        uint64_t oldest = oldestActive();
+        auto keep = std::remove_if(retired.begin(), retired.end(), [oldest](Retired& r) {
+            if (r.epoch < oldest) {
+                r.free();
+                return true;
+            }
+            return false;
+        });
+        retired.erase(keep, retired.end());
+    }
+};
+
+// Hash table whose readers take no locks. Writers are serialized by the
+// owning shard's lock and never modify a published node: they link in a
+// replacement and retire the old node through EpochDomain. Growing copies
+// every node into a new bucket array, which is then swapped in whole.
+class RcuTable {
+private:
+    struct Node {
+        string key;
+        size_t hash;
+        ValueEntry entry;
+        atomic<Node*> next{nullptr};
+    };
+
+    struct Buckets {
+        size_t mask;
+        unique_ptr<atomic<Node*>[]> heads;
+
+        explicit Buckets(size_t count) : mask(count - 1), heads(new atomic<Node*>[count]) {
+            for (size_t i = 0; i < count; ++i) heads[i].store(nullptr, memory_order_relaxed);
+        }
+    };
+
+    atomic<Buckets*> table;
+    size_t count = 0;
+
+    static void freeChains(Buckets* buckets) {
+        for (size_t i = 0; i <= buckets->mask; ++i) {
+            Node* node = buckets->heads[i].load(memory_order_relaxed);
+            while (node) {
+                Node* next = node->next.load(memory_order_relaxed);
+                delete node;
+                node = next;
+            }
+        }
+        delete buckets;
+    }
+
+    // Walks the chain for key and returns the link that points at its node,
+    // or at null if the key is absent.
+    atomic<Node*>* findLink(string_view key, size_t h) const {
+        Buckets* buckets = table.load(memory_order_relaxed);
+        atomic<Node*>* link = &buckets->heads[h & buckets->mask];
+        for (Node* node = link->load(memory_order_relaxed); node; node = link->load(memory_order_relaxed)) {
+            if (node->hash == h && node->key == key) return link;
+            link = &node->next;
+        }
+        return link;
+    }
+
+    void grow() {
+        Buckets* old = table.load(memory_order_relaxed);
+        auto* bigger = new Buckets((old->mask + 1) * 2);
+        for (size_t i = 0; i <= old->mask; ++i) {
+            for (Node* node = old->heads[i].load(memory_order_relaxed); node;
+                 node = node->next.load(memory_order_relaxed)) {
+                auto* copy = new Node{node->key, node->hash, node->entry};
+                atomic<Node*>& head = bigger->heads[node->hash & bigger->mask];
+                copy->next.store(head.load(memory_order_relaxed), memory_order_relaxed);
+                head.store(copy, memory_order_relaxed);
+            }
+        }
+        table.store(bigger, memory_order_release);
+        EpochDomain::instance().retire([old]() { freeChains(old); });
+    }
+
+public:
+    RcuTable() : table(new Buckets(16)) {}
+
+    ~RcuTable() {
+        freeChains(table.load(memory_order_relaxed));
+    }
+
+    RcuTable(const RcuTable&) = delete;
+    RcuTable& operator=(const RcuTable&) = delete;
+
+    // Lock-free lookup. fn sees the entry only for the duration of the call.
+    // Returns false without calling fn when the key is absent.
+    template <typename Fn>
+    bool read(string_view key, Fn&& fn) const {
+        size_t h = hash<string_view>{}(key);
+        Buckets* buckets = table.load(memory_order_acquire);
+        for (Node* node = buckets->heads[h & buckets->mask].load(memory_order_acquire); node;
+             node = node->next.load(memory_order_acquire)) {
+            if (node->hash == h && node->key == key) {
+                fn(static_cast<const ValueEntry&>(node->entry));
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // The rest requires the shard lock.
+    const ValueEntry* find(string_view key) const {
+        Node* node = findLink(key, hash<string_view>{}(key))->load(memory_order_relaxed);
+        return node ? &node->entry : nullptr;
+    }
+
+    void put(const string& key, ValueEntry entry) {
+        size_t h = hash<string_view>{}(key);
+        atomic<Node*>* link = findLink(key, h);
+        Node* old = link->load(memory_order_relaxed);
+        auto* node = new Node{key, h, move(entry)};
+        if (old) {
+            node->next.store(old->next.load(memory_order_relaxed), memory_order_relaxed);
+            link->store(node, memory_order_release);
+            EpochDomain::instance().retire([old]() { delete old; });
+            return;
+        }
+        Buckets* buckets = table.load(memory_order_relaxed);
+        atomic<Node*>& head = buckets->heads[h & buckets->mask];
+        node->next.store(head.load(memory_order_relaxed), memory_order_relaxed);
+        head.store(node, memory_order_release);
+        if (++count > buckets->mask + 1) {
+            grow();
+        }
+    }
+
+    bool erase(string_view key) {
+        atomic<Node*>* link = findLink(key, hash<string_view>{}(key));
+        Node* old = link->load(memory_order_relaxed);
+        if (!old) return false;
+        link->store(old->next.load(memory_order_relaxed), memory_order_release);
+        EpochDomain::instance().retire([old]() { delete old; });
+        --count;
+        return true;
+    }
+
+    size_t size() const {
+        return count;
+    }
+
+    template <typename Fn>
+    void forEach(Fn&& fn) const {
+        Buckets* buckets = table.load(memory_order_relaxed);
+        for (size_t i = 0; i <= buckets->mask; ++i) {
+            for (Node* node = buckets->heads[i].load(memory_order_relaxed); node;
+                 node = node->next.load(memory_order_relaxed)) {
+                fn(node->key, static_cast<const ValueEntry&>(node->entry));
+            }
+        }
+    }
+};
+
+// A key held inside its index node. Keys never exceed MAX_KEY_LENGTH, so
+// unlike std::string no key needs a heap buffer of its own.
+class InlineKey {
+public:
+    static constexpr size_t CAPACITY = 32;
+
+private:
+    char chars[CAPACITY];
+    uint8_t length = 0;
+
+public:
+    InlineKey(string_view key) {
+        if (key.size() > CAPACITY) {
+            throw length_error("Key length exceeds 32 characters.");
+        }
+        memcpy(chars, key.data(), key.size());
+        length = static_cast<uint8_t>(key.size());
+    }
+
+    string_view view() const {
+        return string_view(chars, length);
+    }
+
+    operator string_view() const {
+        return view();
+    }
+
+    friend bool operator==(const InlineKey& a, const InlineKey& b) {
+        return a.view() == b.view();
+    }
+
+    friend bool operator<(const InlineKey& a, const InlineKey& b) {
+        return a.view() < b.view();
+    }
+
+    friend bool operator>(const InlineKey& a, const InlineKey& b) {
+        return b < a;
+    }
+};
+
+// Fixed-size block pool for one shard's index. Blocks come in 16-byte size
+// classes up to 512 bytes, are carved from 64 KB slabs and are recycled
+// through a free list per class. It is unsynchronized: only use it under
+// the owning shard's exclusive lock.
+class SlabPool {
+private:
+    static constexpr size_t GRANULE = 16;
+    static constexpr size_t MAX_BLOCK = 512;
+    static constexpr size_t SLAB_BYTES = 64 * 1024;
+
+    struct FreeBlock {
+        FreeBlock* next;
+    };
+
+    struct SizeClass {
+        FreeBlock* free = nullptr;
+        char* cursor = nullptr;
+        char* end = nullptr;
+    };
+
+    array<SizeClass, MAX_BLOCK / GRANULE> classes;
+    vector<unique_ptr<char[]>> slabs;
+
+public:
+    SlabPool() = default;
+    SlabPool(const SlabPool&) = delete;
+    SlabPool& operator=(const SlabPool&) = delete;
+
+    static bool fits(size_t bytes) {
+        return bytes <= MAX_BLOCK;
+    }
+
+    void* allocate(size_t bytes) {
+        size_t blockSize = (bytes + GRANULE - 1) / GRANULE * GRANULE;
+        SizeClass& sc = classes[blockSize / GRANULE - 1];
+        if (sc.free) {
+            FreeBlock* block = sc.free;
+            sc.free = block->next;
+            return block;
+        }
+        if (static_cast<size_t>(sc.end - sc.cursor) < blockSize) {
+            slabs.emplace_back(new char[SLAB_BYTES]);
+            sc.cursor = slabs.back().get();
+            sc.end = sc.cursor + SLAB_BYTES;
+        }
+        void* block = sc.cursor;
+        sc.cursor += blockSize;
+        return block;
+    }
+
+    void deallocate(void* block, size_t bytes) {
+        size_t blockSize = (bytes + GRANULE - 1) / GRANULE * GRANULE;
+        SizeClass& sc = classes[blockSize / GRANULE - 1];
+        auto* freed = static_cast<FreeBlock*>(block);
+        freed->next = sc.free;
+        sc.free = freed;
+    }
+
+    size_t reservedBytes() const {
+        return slabs.size() * SLAB_BYTES;
+    }
+};
+
+// STL allocator over a SlabPool. Without a pool, or for requests too big
+// for one (large bucket arrays), it falls back to operator new.
+template <typename T>
+class PoolAllocator {
+public:
+    using value_type = T;
+
+    SlabPool* pool = nullptr;
+
+    PoolAllocator(SlabPool* slabs = nullptr) noexcept : pool(slabs) {}
+
+    template <typename U>
+    PoolAllocator(const PoolAllocator<U>& other) noexcept : pool(other.pool) {}
+
+    T* allocate(size_t n) {
+        size_t bytes = n * sizeof(T);
+        if (pool && SlabPool::fits(bytes)) {
+            return static_cast<T*>(pool->allocate(bytes));
+        }
+        return static_cast<T*>(::operator new(bytes));
+    }
+
+    void deallocate(T* block, size_t n) noexcept {
+        size_t bytes = n * sizeof(T);
+        if (pool && SlabPool::fits(bytes)) {
+            pool->deallocate(block, bytes);
+        } else {
+            ::operator delete(block);
+        }
+    }
+
+    template <typename U>
+    bool operator==(const PoolAllocator<U>& other) const {
+        return pool == other.pool;
+    }
+
+    template <typename U>
+    bool operator!=(const PoolAllocator<U>& other) const {
+        return pool != other.pool;
+    }
+};
+
+// Open-addressing hash table in the style of a Swiss table. Slots hold the
+// inline key, its full hash and the entry in one array; a parallel array of
+// control bytes holds 7 bits of each slot's hash, or marks it empty or
+// deleted. A lookup scans a group of 16 control bytes at once (with SSE2
+// where available) and only touches slots whose 7 bits match, so most
+// misses and hits cost one or two cache lines. Groups are probed
+// triangularly, which visits every group of a power-of-two table.
+class FlatTable {
+private:
+    static constexpr size_t GROUP = 16;
+    static constexpr int8_t EMPTY = -128;
+    static constexpr int8_t DELETED = -2;
+
+    struct Slot {
+        InlineKey key;
+        size_t hash;
+        ValueEntry entry;
+    };
+
+    int8_t* ctrl = nullptr;
+    Slot* slots = nullptr;
+    size_t capacity = 0;
+    size_t count = 0;
+    size_t growthLeft = 0;
+
+    static int8_t tagOf(size_t h) {
+        return static_cast<int8_t>(h & 0x7f);
+    }
+
+    size_t groupCount() const {
+        return capacity / GROUP;
+    }
+
+    // Bit i is set when control byte i of the group equals tag.
+    static uint32_t match(const int8_t* group, int8_t tag) {
+#if defined(__SSE2__)
+        __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(group));
+        return static_cast<uint32_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(bytes, _mm_set1_epi8(tag))));
+#else
+        uint32_t bits = 0;
+        for (size_t i = 0; i < GROUP; ++i) {
+            if (group[i] == tag) bits |= 1u << i;
+        }
+        return bits;
+#endif
+    }
+
+    // Empty and deleted are the only negative control bytes.
+    static uint32_t matchFree(const int8_t* group) {
+#if defined(__SSE2__)
+        __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(group));
+        return static_cast<uint32_t>(_mm_movemask_epi8(bytes));
+#else
+        uint32_t bits = 0;
+        for (size_t i = 0; i < GROUP; ++i) {
+            if (group[i] < 0) bits |= 1u << i;
+        }
+        return bits;
+#endif
+    }
+
+    static size_t lowestBit(uint32_t bits) {
+        size_t i = 0;
+        while (!(bits & 1u)) {
+            bits >>= 1;
+            ++i;
+        }
+        return i;
+    }
+
+    // Returns the slot holding key, or capacity if it is absent.
+    size_t findSlot(string_view key, size_t h) const {
+        if (capacity == 0) return capacity;
+        size_t mask = groupCount() - 1;
+        size_t group = (h >> 7) & mask;
+        for (size_t step = 1;; ++step) {
+            const int8_t* g = ctrl + group * GROUP;
+            for (uint32_t bits = match(g, tagOf(h)); bits; bits &= bits - 1) {
+                size_t i = group * GROUP + lowestBit(bits);
+                if (slots[i].hash == h && slots[i].key.view() == key) return i;
+            }
+            if (match(g, EMPTY)) return capacity;
+            if (step > mask) return capacity;
+            group = (group + step) & mask;
+        }
+    }
+
+    // First empty or deleted slot on key's probe sequence.
+    size_t freeSlot(size_t h) const {
+        size_t mask = groupCount() - 1;
+        size_t group = (h >> 7) & mask;
+        for (size_t step = 1;; ++step) {
+            uint32_t bits = matchFree(ctrl + group * GROUP);
+            if (bits) return group * GROUP + lowestBit(bits);
+            group = (group + step) & mask;
+        }
+    }
+
+    void allocate(size_t slotCount) {
+        capacity = slotCount;
+        ctrl = new int8_t[capacity];
+        memset(ctrl, EMPTY, capacity);
+        slots = static_cast<Slot*>(::operator new(capacity * sizeof(Slot)));
+        growthLeft = capacity - capacity / 8 - count;
+    }
+
+    void release() {
+        for (size_t i = 0; i < capacity; ++i) {
+            if (ctrl[i] >= 0) slots[i].~Slot();
+        }
+        delete[] ctrl;
+        ::operator delete(slots);
+        ctrl = nullptr;
+        slots = nullptr;
+        capacity = 0;
+    }
+
+    // Moves every entry into a fresh table, using the cached hashes. Also
+    // how tombstones are cleared, so the size only doubles if the table is
+    // genuinely more than half full.
+    void rehash() {
+        size_t target = capacity == 0 ? GROUP : capacity;
+        if (count >= target / 2) target *= 2;
+
+        int8_t* oldCtrl = ctrl;
+        Slot* oldSlots = slots;
+        size_t oldCapacity = capacity;
+        allocate(target);
+        for (size_t i = 0; i < oldCapacity; ++i) {
+            if (oldCtrl[i] < 0) continue;
+            size_t j = freeSlot(oldSlots[i].hash);
+            ctrl[j] = tagOf(oldSlots[i].hash);
+            new (&slots[j]) Slot(move(oldSlots[i]));
+            oldSlots[i].~Slot();
+        }
+        delete[] oldCtrl;
+        ::operator delete(oldSlots);
+    }
+
+public:
+    FlatTable() = default;
+
+    ~FlatTable() {
+        if (capacity) release();
+    }
+
+    FlatTable(const FlatTable&) = delete;
+    FlatTable& operator=(const FlatTable&) = delete;
+
+    const ValueEntry* find(string_view key) const {
+        size_t i = findSlot(key, hash<string_view>{}(key));
+        return i == capacity ? nullptr : &slots[i].entry;
+    }
+
+    // Entry pointers stay valid until the next put(), which may move them.
+    void put(string_view key, ValueEntry entry) {
+        size_t h = hash<string_view>{}(key);
+        size_t i = findSlot(key, h);
+        if (i != capacity) {
+            slots[i].entry = move(entry);
+            return;
+        }
+        if (growthLeft == 0) rehash();
+        i = freeSlot(h);
+        if (ctrl[i] == EMPTY) --growthLeft;
+        ctrl[i] = tagOf(h);
+        new (&slots[i]) Slot{InlineKey(key), h, move(entry)};
+        ++count;
+    }
+
+    bool erase(string_view key) {
+        size_t i = findSlot(key, hash<string_view>{}(key));
+        if (i == capacity) return false;
+        slots[i].~Slot();
+        // A probe only continues past a group with no empty byte, and a group
+        // that has one has never been full, so no probe ever went past it and
+        // the slot can go straight back to empty.
+        if (match(ctrl + (i / GROUP) * GROUP, EMPTY)) {
+            ctrl[i] = EMPTY;
+            ++growthLeft;
+        } else {
+            ctrl[i] = DELETED;
+        }
+        --count;
+        return true;
+    }
+
+    size_t size() const {
+        return count;
+    }
+
+    template <typename Fn>
+    void forEach(Fn&& fn) const {
+        for (size_t i = 0; i < capacity; ++i) {
+            if (ctrl[i] >= 0) fn(slots[i].key.view(), static_cast<const ValueEntry&>(slots[i].entry));
+        }
+    }
+};
+
+// The per-shard key index: an unordered_map or a FlatTable as configured,
+// or an RcuTable when lock-free reads were asked for, in which case readers
+// may skip the shard lock via readLockFree().
+class ShardIndex {
+private:
+    struct KeyHash {
+        size_t operator()(string_view key) const {
+            return hash<string_view>{}(key);
+        }
+    };
+
+    using Map = unordered_map<InlineKey, ValueEntry, KeyHash, equal_to<InlineKey>,
+                              PoolAllocator<pair<const InlineKey, ValueEntry>>>;
+
+    Map map;
+    unique_ptr<FlatTable> flat;
+    unique_ptr<RcuTable> table;
+
+    // Building an InlineKey costs no allocation, so lookups need no
+    // heterogeneous find. A key too long to store cannot be present.
+    Map::const_iterator mapFind(string_view key) const {
+        if (key.size() > InlineKey::CAPACITY) return map.end();
+        return map.find(InlineKey(key));
+    }
+
+public:
+    // Map nodes come from pool when one is given. The RcuTable frees nodes
+    // from whichever thread reclaims them, and a FlatTable's slot array is
+    // one large block, so both always use the heap.
+    ShardIndex(bool lockFree, IndexBackend backend, SlabPool* pool = nullptr)
+        : map(0, KeyHash(), equal_to<InlineKey>(), Map::allocator_type(pool)) {
+        if (lockFree) {
+            table = make_unique<RcuTable>();
+        } else if (backend == IndexBackend::Flat) {
+            flat = make_unique<FlatTable>();
+        }
+    }
+
+    bool lockFree() const {
+        return table != nullptr;
+    }
+
+    template <typename Fn>
+    bool readLockFree(string_view key, Fn&& fn) const {
+        return table->read(key, fn);
+    }
+
+    const ValueEntry* find(string_view key) const {
+        if (table) return table->find(key);
+        if (flat) return flat->find(key);
+        auto it = mapFind(key);
+        return it == map.end() ? nullptr : &it->second;
+    }
+
+    bool contains(string_view key) const {
+        return find(key) != nullptr;
+    }
+
+    // May invalidate pointers returned by find().
+    void put(const string& key, ValueEntry entry) {
+        if (table) {
+            table->put(key, move(entry));
+        } else if (flat) {
+            flat->put(key, move(entry));
+        } else {
+            map.insert_or_assign(InlineKey(key), move(entry));
+        }
+    }
+
+    bool erase(string_view key) {
+        if (table) return table->erase(key);
+        if (flat) return flat->erase(key);
+        auto it = mapFind(key);
+        if (it == map.end()) return false;
+        map.erase(it);
+        return true;
+    }
+
+    size_t size() const {
+        if (table) return table->size();
+        if (flat) return flat->size();
+        return map.size();
+    }
+
+    template <typename Fn>
+    void forEach(Fn&& fn) const {
+        if (table) {
+            table->forEach(fn);
+        } else if (flat) {
+            flat->forEach(fn);
+        } else {
+            for (const auto& [key, entry] : map) fn(key.view(), entry);
+        }
+    }
+
+    // Removes every entry the predicate accepts. The predicate runs before
+    // the entry is unlinked, so it may log the removal.
+    template <typename Pred>
+    void eraseIf(Pred&& pred) {
+        if (table || flat) {
+            vector<string> doomed;
+            forEach([&](string_view key, const ValueEntry& entry) {
+                if (pred(key, entry)) doomed.emplace_back(key);
+            });
+            for (const auto& key : doomed) erase(key);
+            return;
+        }
+        for (auto it = map.begin(); it != map.end();) {
+            if (pred(it->first.view(), it->second)) {
+                it = map.erase(it);
+            } else {
+                ++it;
+            }
+        }
+    }
+};
+
+// Layouts importRecords() reads and exportRecords() writes. In all of them
+// ttl is an absolute expiry time, 0 for none, as in a snapshot.
+enum class RecordFormat {
+    Ndjson,     // one {"key":…,"value":…,"ttl":…} object per line
+    Snapshot,   // one object of key: {"value":…,"ttl":…}, as in a text datastore.json
+    Binary      // RecordStream::MAGIC, then RecordStream binary records
+};
+
+struct ImportStats {
+    size_t imported = 0;
+    // Over the key or value size limit, or already expired.
+    size_t skipped = 0;
+};
+
+// Framing of bulk record streams. A binary record is a u32 key length, the
+// key, an i64 ttl, a u32 value length and the value as JSON text, all
+// little-endian.
+struct RecordStream {
+    static constexpr char MAGIC[8] = {'K', 'V', 'R', 'E', 'C', 'S', '1', '\n'};
+    // Sanity bounds, so a corrupt length fails the read instead of an
+    // allocation.
+    static constexpr uint32_t MAX_KEY_BYTES = 64 * 1024;
+    static constexpr uint32_t MAX_VALUE_BYTES = 256 * 1024 * 1024;
+
+    static void append(string& out, RecordFormat format, string_view key, time_t ttl, string_view text,
+                       bool first) {
+        if (format == RecordFormat::Binary) {
+            BinarySnapshot::put<uint32_t>(out, static_cast<uint32_t>(key.size()));
+            out.append(key);
+            BinarySnapshot::put<int64_t>(out, ttl);
+            BinarySnapshot::put<uint32_t>(out, static_cast<uint32_t>(text.size()));
+            out.append(text);
+        } else if (format == RecordFormat::Ndjson) {
+            out += "{\"key\":" + json(string(key)).dump() + ",\"value\":";
+            out.append(text);
+            out += ",\"ttl\":" + to_string(ttl) + "}\n";
+        } else {
+            if (!first) out += ',';
+            out += json(string(key)).dump() + ":{\"value\":";
+            out.append(text);
+            out += ",\"ttl\":" + to_string(ttl) + "}";
+        }
+    }
+
+    static void readMagic(istream& in) {
+        char magic[sizeof(MAGIC)] = {};
+        in.read(magic, sizeof(magic));
+        if (in.gcount() != sizeof(magic) || memcmp(magic, MAGIC, sizeof(MAGIC)) != 0) {
+            throw runtime_error("Not a binary record stream.");
+        }
+    }
+
+    // Reads the next binary record. False at a clean end of the stream.
+    static bool readBinary(istream& in, string& key, time_t& ttl, string& text) {
+        char header[sizeof(uint32_t)];
+        in.read(header, sizeof(header));
+        if (in.gcount() == 0) return false;
+        uint32_t keyBytes = BinarySnapshot::get<uint32_t>(header);
+        if (!in || keyBytes > MAX_KEY_BYTES) throw runtime_error("Binary record stream is corrupt.");
+        key.resize(keyBytes);
+        in.read(key.data(), keyBytes);
+        char ttlBytes[sizeof(int64_t)];
+        in.read(ttlBytes, sizeof(ttlBytes));
+        in.read(header, sizeof(header));
+        uint32_t valueBytes = BinarySnapshot::get<uint32_t>(header);
+        if (!in || valueBytes > MAX_VALUE_BYTES) throw runtime_error("Binary record stream is corrupt.");
+        ttl = static_cast<time_t>(BinarySnapshot::get<int64_t>(ttlBytes));
+        text.resize(valueBytes);
+        in.read(text.data(), valueBytes);
+        if (!in) throw runtime_error("Binary record stream is truncated.");
+        return true;
+    }
+};
+
+// json::sax_parse handler that hands records to a sink one at a time, so
+// only the value of the record being read is ever built. Keyed reads the
+// Snapshot layout, whose records are the members of one top-level object;
+// otherwise each parse reads one Ndjson record.
+class RecordReader : public json::json_sax_t {
+public:
+    using Sink = function<void(std::string& key, json& value, time_t ttl)>;
+
+private:
+    enum Field { NONE, KEY, VALUE, TTL };
+
+    // Nesting of the object holding one record's fields.
+    size_t recordDepth;
+    bool keyed;
+    Sink sink;
+    size_t depth = 0;
+    size_t records = 0;
+    Field field = NONE;
+    std::string recordKey;
+    bool hasKey = false;
+    json value;
+    bool hasValue = false;
+    time_t ttl = 0;
+    // Containers open inside the value; each is the last child of the one
+    // before it, so the pointers stay valid while it is open.
+    vector<json*> open;
+    std::string member;
+
+    [[noreturn]] void fail(const std::string& why) const {
+        throw runtime_error("Import failed at record " + to_string(records + 1) + ": " + why + ".");
+    }
+
+    json* place(json v) {
+        if (open.empty()) {
+            value = move(v);
+            hasValue = true;
+            return &value;
+        }
+        json& parent = *open.back();
+        if (parent.is_array()) {
+            parent.push_back(move(v));
+            return &parent.back();
+        }
+        json& slot = parent[member];
+        slot = move(v);
+        return &slot;
+    }
+
+    bool scalar(json v) {
+        if (field == VALUE) {
+            place(move(v));
+            if (open.empty()) field = NONE;
+        } else if (field == KEY) {
+            if (!v.is_string()) fail("key is not a string");
+            recordKey = move(v.get_ref<std::string&>());
+            hasKey = true;
+            field = NONE;
+        } else if (field == TTL) {
+            if (!v.is_number()) fail("ttl is not a number");
+            ttl = v.get<time_t>();
+            field = NONE;
+        } else {
+            fail("expected an object");
+        }
+        return true;
+    }
+
+    bool close() {
+        open.pop_back();
+        if (open.empty()) field = NONE;
+        return true;
+    }
+
+public:
+    RecordReader(bool keyedRecords, Sink recordSink)
+        : recordDepth(keyedRecords ? 2 : 1), keyed(keyedRecords), sink(move(recordSink)) {}
+
+    size_t count() const {
+        return records;
+    }
+
+    bool null() override {
+        return scalar(nullptr);
+    }
+
+    bool boolean(bool val) override {
+        return scalar(val);
+    }
+
+    bool number_integer(number_integer_t val) override {
+        return scalar(val);
+    }
+
+    bool number_unsigned(number_unsigned_t val) override {
+        return scalar(val);
+    }
+
+    bool number_float(number_float_t val, const std::string&) override {
+        return scalar(val);
+    }
+
+    bool string(std::string& val) override {
+        return scalar(move(val));
+    }
+
+    bool binary(binary_t&) override {
+        fail("unexpected binary value");
+    }
+
+    bool start_object(size_t) override {
+        if (field == VALUE) {
+            open.push_back(place(json::object()));
+            return true;
+        }
+        if (field != NONE || depth == recordDepth) fail("expected a value");
+        if (++depth == recordDepth) {
+            hasKey = keyed;
+            hasValue = false;
+            ttl = 0;
+        }
+        return true;
+    }
+
+    bool end_object() override {
+        if (field == VALUE) return close();
+        if (depth-- == recordDepth) {
+            if (!hasKey) fail("key is missing");
+            if (!hasValue) fail("value is missing");
+            sink(recordKey, value, ttl);
+            ++records;
+        }
+        return true;
+    }
+
+    bool start_array(size_t) override {
+        if (field != VALUE) fail("unexpected array");
+        open.push_back(place(json::array()));
+        return true;
+    }
+
+    bool end_array() override {
+        return close();
+    }
+
+    bool key(std::string& val) override {
+        if (field == VALUE) {
+            member = move(val);
+        } else if (depth < recordDepth) {
+            recordKey = move(val);
+        } else if (val == "value") {
+            field = VALUE;
+        } else if (val == "ttl") {
+            field = TTL;
+        } else if (val == "key" && !keyed) {
+            field = KEY;
+        } else {
+            fail("unknown field \"" + val + "\"");
+        }
+        return true;
+    }
+
+    bool parse_error(size_t, const std::string&, const nlohmann::detail::exception& e) override {
+        fail(e.what());
+    }
+};
+
+// Shard lock policies. Mutex is what each shard is guarded by; it needs the
+// shared_mutex interface, since readers take it through shared_lock.
+struct SharedLocking {
+    using Mutex = shared_mutex;
+    static constexpr bool threadSafe = true;
+};
+
+// One plain mutex per shard, readers included. Cheaper than a shared_mutex
+// when reads rarely overlap on a shard.
+struct ExclusiveLocking {
+    struct Mutex : mutex {
+        void lock_shared() { lock(); }
+        bool try_lock_shared() { return try_lock(); }
+        void unlock_shared() { unlock(); }
+    };
+    static constexpr bool threadSafe = true;
+};
+
+// No locking at all, for a store only ever used from one thread. Such a
+// store starts no background threads: the *Async calls complete before
+// they return, and expiry, checkpoints and shared image publishing happen
+// when the owner calls runMaintenance().
+struct NoLocking {
+    struct Mutex {
+        void lock() {}
+        bool try_lock() { return true; }
+        void unlock() {}
+        void lock_shared() {}
+        bool try_lock_shared() { return true; }
+        void unlock_shared() {}
+    };
+    static constexpr bool threadSafe = false;
+};
+
+// Compile-time settings of a BasicKVDataStore. Custom policies derive from
+// this one and override what they change.
+struct DefaultStorePolicy {
+    // Keys are stored inline, so longer keys than InlineKey holds are not
+    // possible; a smaller limit is.
+    static constexpr size_t maxKeyLength = InlineKey::CAPACITY;
+    static constexpr size_t maxValueSize = 16 * 1024;
+    static constexpr size_t maxFileSize = 1024ull * 1024 * 1024;
+    using Locking = SharedLocking;
+    // Picks the shard for a key.
+    using KeyHash = hash<string_view>;
+};
+
+struct SingleThreadedStorePolicy : DefaultStorePolicy {
+    using Locking = NoLocking;
+};
+
+template <typename Policy = DefaultStorePolicy>
+class BasicKVDataStore {
+private:
+    static_assert(Policy::maxKeyLength <= InlineKey::CAPACITY, "Keys longer than InlineKey::CAPACITY cannot be stored.");
+
+    using Locking = typename Policy::Locking;
+    using StoreMap = unordered_map<string, ValueEntry>;
+
+    // One slice of the key space. Lookups take mtx shared, or no lock at
+    // all on a lock-free index; anything that changes the index takes it
+    // exclusively.
+    struct Shard {
+        mutable typename Locking::Mutex mtx;
+        // Declared before index, which allocates from it.
+        SlabPool pool;
+        ShardIndex index;
+        // Min-heap of (expiry time, key) for every entry put with a TTL.
+        // Entries go stale when their key is removed or rewritten and are
+        // simply dropped when they reach the top.
+        priority_queue<pair<time_t, InlineKey>, vector<pair<time_t, InlineKey>>, greater<>> expiries;
+        // CLOCK ring over the keys of a bounded store. Removed keys leave
+        // dead slots that the hand drops when it reaches them.
+        vector<InlineKey> clock;
+        size_t hand = 0;
+        size_t usedBytes = 0;
+        // Created on the first spill. spillLive counts the bytes in it that
+        // entries still point at; the rest is garbage left by rewrites.
+        shared_ptr<SpillFile> spill;
+        size_t spillLive = 0;
+        // Sorted copy of the keys when options.orderedIndex is set.
+        set<InlineKey> ordered;
+        // Bumped by every put and erase, so the shared image publisher can
+        // tell which shards it has to encode again.
+        uint64_t changes = 0;
+
+        Shard(bool lockFree, IndexBackend backend, bool pooled)
+            : index(lockFree, backend, pooled ? &pool : nullptr) {}
+    };
+
+    vector<unique_ptr<Shard>> shards;
+    size_t shardMask = 0;
+    string filePath;
+    string logPath;
+    string oldLogPath;
+    KVOptions options;
+    // Before log, so it is taken before any file is touched and released
+    // only after the final snapshot is written.
+    FileLock writerLock;
+    MutationLog log;
+    uintmax_t replayedBytes = 0;
+    size_t replayedRecords = 0;
+    mutex checkpointMtx;
+    static constexpr size_t MAX_KEY_LENGTH = Policy::maxKeyLength;
+    static constexpr size_t MAX_VALUE_SIZE = Policy::maxValueSize;
+    static constexpr size_t MAX_FILE_SIZE = Policy::maxFileSize;
+
+    static string keyLengthError() {
+        return "Error: Key length exceeds " + to_string(MAX_KEY_LENGTH) + " characters.";
+    }
+
+    static string valueSizeError() {
+        string limit = MAX_VALUE_SIZE % 1024 == 0 ? to_string(MAX_VALUE_SIZE / 1024) + "KB"
+                                                  : to_string(MAX_VALUE_SIZE) + " bytes";
+        return "Error: Value size exceeds " + limit + ".";
+    }
+
+    thread checkpointThread;
+    thread cleanupThread;
+    mutex workerMtx;
+    condition_variable workerCv;
+    bool stopping = false;
+
+    // Set once loading is done; eviction only starts from then on.
+    bool loaded = false;
+    atomic<uint64_t> evictions{0};
+    atomic<uint64_t> evictedBytes{0};
+    atomic<uint64_t> spills{0};
+    atomic<uint64_t> spilledBytes{0};
+    const size_t SPILL_COMPACT_BYTES = 64 * 1024 * 1024;
+
+    mutable KVMetrics metrics;
+    unique_ptr<LockProfiler> lockProfiler;
+
+    // Owner side of the shared image when options.sharedReaders is set.
+    string imageBase;
+    int controlFd = -1;
+    SharedImage::Control* control = nullptr;
+    uint64_t publishedLsn = 0;
+    thread publishThread;
+    // Each shard's part of the last image, encoded after shard.changes
+    // reached changes. Guarded by publishMtx.
+    struct ImagePart {
+        uint64_t changes = ~uint64_t(0);
+        string data;
+        vector<pair<uint64_t, uint64_t>> entries;
+    };
+    vector<ImagePart> imageParts;
+    mutex publishMtx;
+
+    unique_ptr<ReplicationBacklog> backlog;
+
+    size_t shardIndex(string_view key) const {
+        return typename Policy::KeyHash{}(key) & shardMask;
+    }
+
+    Shard& shardFor(string_view key) {
+        return *shards[shardIndex(key)];
+    }
+
+    using ExclusiveLock = ProfiledLock<unique_lock<typename Locking::Mutex>>;
+    using SharedLock = ProfiledLock<shared_lock<typename Locking::Mutex>>;
+
+    ExclusiveLock exclusive(const Shard& shard, LockProfiler::Site site) const {
+        return ExclusiveLock(shard.mtx, lockProfiler.get(), site);
+    }
+
+    SharedLock shared(const Shard& shard, LockProfiler::Site site) const {
+        return SharedLock(shard.mtx, lockProfiler.get(), site);
+    }
+
+    // Locks every shard in index order. Any operation that holds more than
+    // one shard lock takes them in this order, so they cannot deadlock.
+    template <typename Lock>
+    vector<Lock> lockAll(LockProfiler::Site site) const {
+        vector<Lock> locks;
+        locks.reserve(shards.size());
+        for (const auto& shard : shards) {
+            locks.emplace_back(shard->mtx, lockProfiler.get(), site);
+        }
+        return locks;
+    }
+
+    // Serializes a snapshot to a temp file and renames it over datastore.json,
+    // so a crash mid-write never leaves a half-written snapshot behind.
+    void writeSnapshot(const vector<StoreMap>& parts) const {
+        auto started = metrics.start();
+        string tmpPath = filePath + ".tmp";
+        ofstream file(tmpPath, ios::trunc | ios::binary);
+        if (!file.is_open()) {
+            throw runtime_error("Failed to open file for writing.");
+        }
+
+        if (options.snapshotFormat == SnapshotFormat::Binary) {
+            BinarySnapshot::write(file, parts,
+                                  compressing() ? BinarySnapshot::CODEC_PACKED_TEXT
+                                  : bytesMode() ? BinarySnapshot::CODEC_JSON_TEXT
+                                                : BinarySnapshot::CODEC_CBOR,
+                                  snapshotThreads());
+        } else {
+            // Streamed entry by entry rather than built as one json object.
+            file << '{';
+            bool first = true;
+            for (const auto& part : parts) {
+                for (const auto& [key, entry] : part) {
+                    if (!first) file << ',';
+                    first = false;
+                    file << json(key).dump() << ":{\"value\":" << entry.text() << ",\"ttl\":" << entry.ttl << '}';
+                }
+            }
+            file << '}';
+        }
+        file.close();
+        if (!file) {
+            throw runtime_error("Failed to write snapshot file.");
+        }
+
+        if (options.durability != Durability::None) {
+            syncPath(tmpPath);
+        }
+        uintmax_t written = filesystem::file_size(tmpPath);
+        filesystem::rename(tmpPath, filePath);
+        if (options.durability != Durability::None) {
+            // Persist the rename itself before the log it replaces goes away.
+            filesystem::path dir = filesystem::absolute(filePath).parent_path();
+            syncPath(dir.string());
+        }
+        metrics.finish(KVMetrics::SNAPSHOT, started, KVMetrics::SNAPSHOTS);
+        metrics.count(KVMetrics::SNAPSHOT_BYTES, written);
+    }
+
+    static void syncPath(const string& path) {
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            throw runtime_error("Failed to open " + path + " for sync.");
+        }
+        int rc = ::fsync(fd);
+        ::close(fd);
+        if (rc != 0) {
+            throw runtime_error("Failed to sync " + path + ".");
+        }
+    }
+
+    // Copies every shard while holding all shard locks, giving a cut that
+    // is consistent with the log position at the moment it is taken. The
+    // copied entries share their values, so it costs a key and a few
+    // pointers per entry in either value mode.
+    vector<StoreMap> copyShards() const {
+        vector<StoreMap> parts;
+        parts.reserve(shards.size());
+        for (const auto& shard : shards) {
+            StoreMap part;
+            part.reserve(shard->index.size());
+            shard->index.forEach([&part](string_view key, const ValueEntry& entry) {
+                part.emplace(string(key), entry);
+            });
+            parts.push_back(move(part));
+        }
+        return parts;
+    }
+
+    // Writes a full snapshot of the store and truncates the mutation log.
+    // Caller must hold every shard lock.
+    void saveToFile() {
+        writeSnapshot(copyShards());
+
+        // Everything in the log is now covered by the snapshot.
+        log.truncate();
+        filesystem::remove(oldLogPath);
+    }
+
+    bool checkpointDue() {
+        return (options.checkpointLogBytes != 0 && log.sizeBytes() >= options.checkpointLogBytes) ||
+               (options.checkpointLogRecords != 0 && log.recordCount() >= options.checkpointLogRecords);
+    }
+
+    void checkpointWorker() {
+        unique_lock<mutex> lock(workerMtx);
+        while (!stopping) {
+            workerCv.wait_for(lock, options.checkpointInterval);
+            if (stopping) break;
+            lock.unlock();
+            if (checkpointDue()) {
+                try {
+                    checkpoint();
+                } catch (const exception& e) {
+                    // The rotated log segment is kept, so nothing is lost;
+                    // the next round retries.
+                    cerr << "Checkpoint failed: " << e.what() << endl;
+                }
+            }
+            lock.lock();
+        }
+    }
+
+    void openSharedImage() {
+        imageBase = SharedImage::basePath(filePath);
+        string controlPath = imageBase + ".ctl";
+        // An existing control file is reused so generations keep rising
+        // across owners and readers still attached notice the new image.
+        controlFd = ::open(controlPath.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+        if (controlFd < 0 || ::ftruncate(controlFd, sizeof(SharedImage::Control)) != 0) {
+            throw runtime_error("Failed to create " + controlPath + ".");
+        }
+        void* addr = ::mmap(nullptr, sizeof(SharedImage::Control), PROT_READ | PROT_WRITE, MAP_SHARED, controlFd, 0);
+        if (addr == MAP_FAILED) {
+            throw runtime_error("Failed to map " + controlPath + ".");
+        }
+        control = static_cast<SharedImage::Control*>(addr);
+        publishImage(true);
+        control->ownerPid.store(::getpid(), memory_order_release);
+    }
+
+    void closeSharedImage() {
+        if (!control) return;
+        // Unlinked first, so a reader that sees the store closed and looks
+        // again finds either nothing or the next owner's files.
+        ::unlink((imageBase + ".img").c_str());
+        ::unlink((imageBase + ".ctl").c_str());
+        control->ownerPid.store(0, memory_order_release);
+        control->generation.fetch_add(1, memory_order_release);
+        ::munmap(control, sizeof(SharedImage::Control));
+        ::close(controlFd);
+        control = nullptr;
+    }
+
+    // Writes a new image if anything was logged since the last one. Shards
+    // changed since the last image are encoded again one at a time, each
+    // under its own shared lock, so writers only wait on the shard being
+    // encoded; the others keep their part from before. The slot table is
+    // built and the file written with no lock held. Writes made meanwhile
+    // may or may not be in the image; they move the LSN, so the next round
+    // publishes them.
+    void publishImage(bool force) {
+        lock_guard<mutex> publishLock(publishMtx);
+        uint64_t lsn = log.currentLsn();
+        if (!force && lsn == publishedLsn) return;
+        imageParts.resize(shards.size());
+        size_t dataBytes = 0;
+        size_t entryCount = 0;
+        for (size_t i = 0; i < shards.size(); ++i) {
+            ImagePart& part = imageParts[i];
+            auto lock = shared(*shards[i], LockProfiler::PUBLISH);
+            if (part.changes != shards[i]->changes) {
+                part.data.clear();
+                part.entries.clear();
+                shards[i]->index.forEach([&](string_view key, const ValueEntry& entry) {
+                    SharedImage::appendEntry(part.data, part.entries, key, entry.ttl, entry.text());
+                });
+                part.changes = shards[i]->changes;
+            }
+            dataBytes += part.data.size();
+            entryCount += part.entries.size();
+        }
+
+        string data;
+        vector<pair<uint64_t, uint64_t>> entries;
+        data.reserve(dataBytes);
+        entries.reserve(entryCount);
+        for (const auto& part : imageParts) {
+            for (const auto& [h, offset] : part.entries) entries.emplace_back(h, data.size() + offset);
+            data += part.data;
+        }
+        uint64_t generation = control->generation.load(memory_order_relaxed) + 1;
+        SharedImage::write(imageBase + ".img", data, entries, generation);
+        control->generation.store(generation, memory_order_release);
+        publishedLsn = lsn;
+    }
+
+    void publishWorker() {
+        unique_lock<mutex> lock(workerMtx);
+        while (!stopping) {
+            workerCv.wait_for(lock, options.sharedPublishInterval);
+            if (stopping) break;
+            lock.unlock();
+            try {
+                publishImage(false);
+            } catch (const exception& e) {
+                // Readers keep the previous image; the next round retries.
+                cerr << "Publishing shared image failed: " << e.what() << endl;
+            }
+            lock.lock();
+        }
+    }
+
+    // Runs before any other thread exists, so shards are filled unlocked;
+    // loadBinary() gives each shard to a single thread.
+    void loadFromFile() {
+        ifstream file(filePath, ios::binary);
+        if (file.is_open()) {
+            char magic[sizeof(BinarySnapshot::MAGIC)] = {};
+            file.read(magic, sizeof(magic));
+            bool binary = BinarySnapshot::matches(magic, static_cast<size_t>(file.gcount()));
+            file.clear();
+            file.seekg(0);
+
+            if (binary && options.lazyLoad) {
+                auto mapped = make_shared<MappedSnapshot>(filePath);
+                mapped->index([&](string_view key, time_t ttl, uint32_t block, size_t offset, uint32_t len) {
+                    ValueEntry ve;
+                    ve.ttl = ttl;
+                    ve.cold = {mapped, block, offset, len};
+                    string k(key);
+                    putEntry(shardFor(k), k, move(ve));
+                });
+            } else if (binary) {
+                string image((istreambuf_iterator<char>(file)), istreambuf_iterator<char>());
+                loadBinary(image);
+            } else {
+                json data;
+                file >> data;
+                for (auto& [key, entry] : data.items()) {
+                    putEntry(shardFor(key), key, entryFromJson(move(entry["value"]), entry["ttl"]));
+                }
+            }
+            file.close();
+        }
+        replayLog(oldLogPath);
+        replayLog(logPath);
+    }
+
+    size_t snapshotThreads() const {
+        return options.snapshotThreads != 0 ? options.snapshotThreads : max(1u, thread::hardware_concurrency());
+    }
+
+    ValueEntry entryFromSnapshot(uint32_t codec, time_t ttl, const char* value, size_t len) const {
+        if (codec == BinarySnapshot::CODEC_PACKED_TEXT) {
+            if (len == 0) throw runtime_error("Snapshot value is missing its tag.");
+            string_view body(value + 1, len - 1);
+            return value[0] == 1 ? packedEntry(body, ttl) : entryFromText(body, ttl);
+        }
+        if (codec == BinarySnapshot::CODEC_JSON_TEXT) {
+            return entryFromText(string_view(value, len), ttl);
+        }
+        return entryFromJson(json::from_cbor(value, value + len), ttl);
+    }
+
+    // Decodes a binary snapshot on snapshotThreads() threads. Each takes
+    // blocks in turn and sorts the entries it decodes by shard; then each
+    // shard is filled by one thread, from every thread's share for it.
+    void loadBinary(const string& image) {
+        const char* data = image.data();
+        vector<BinarySnapshot::BlockRef> blocks = BinarySnapshot::blocks(data, image.size());
+        uint32_t codec = BinarySnapshot::codec(data);
+        size_t workers = min(snapshotThreads(), max<size_t>(blocks.size(), 1));
+
+        using Decoded = vector<pair<string, ValueEntry>>;
+        vector<vector<Decoded>> decoded(workers, vector<Decoded>(shards.size()));
+        atomic<size_t> nextBlock{0};
+        runParallel(workers, [&](size_t worker) {
+            for (size_t b; (b = nextBlock.fetch_add(1)) < blocks.size();) {
+                BinarySnapshot::verify(data, blocks[b]);
+                BinarySnapshot::parseBlock(data, blocks[b], [&](string_view key, time_t ttl, const char* value,
+                                                                size_t len) {
+                    decoded[worker][shardIndex(key)].emplace_back(string(key),
+                                                                  entryFromSnapshot(codec, ttl, value, len));
+                });
+            }
+        });
+
+        atomic<size_t> nextShard{0};
+        runParallel(workers, [&](size_t) {
+            for (size_t s; (s = nextShard.fetch_add(1)) < shards.size();) {
+                for (auto& part : decoded) {
+                    for (auto& [key, entry] : part[s]) putEntry(*shards[s], key, move(entry));
+                    Decoded().swap(part[s]);
+                }
+            }
+        });
+    }
+
+    // Applies every complete record in the log on top of the snapshot. A
+    // record is only complete once its trailing newline is on disk, so a
+    // torn final line left by a crash is dropped and cut off the file. A
+    // complete record that does not parse cannot come from a crash, and
+    // throws rather than losing the records after it.
+    void replayLog(const string& path) {
+        ifstream file(path, ios::binary);
+        if (!file.is_open()) return;
+
+        string line;
+        uintmax_t validBytes = 0;
+        size_t lineNumber = 0;
+        bool torn = false;
+        while (getline(file, line)) {
+            ++lineNumber;
+            if (file.eof()) {
+                torn = true;
+                break;
+            }
+            json record = json::parse(line, nullptr, false);
+            if (record.is_discarded() || !record.is_object()) {
+                throw runtime_error("Corrupt log record at line " + to_string(lineNumber) + " of " + path + ".");
+            }
+            applyLogRecord(record);
+            validBytes += line.size() + 1;
+            ++replayedRecords;
+        }
+        file.close();
+        replayedBytes += validBytes;
+
+        if (torn) {
+            filesystem::resize_file(path, validBytes);
+        }
+    }
+
+    void applyLogRecord(const json& record) {
+        const string& op = record.at("op").get_ref<const string&>();
+        if (op == "create") {
+            const string& key = record.at("key").get_ref<const string&>();
+            auto packed = record.find("packed");
+            if (packed != record.end()) {
+                putEntry(shardFor(key), key,
+                         packedEntry(ValueCompression::fromBase64(packed->get_ref<const string&>()), record.at("ttl")));
+            } else {
+                putEntry(shardFor(key), key, entryFromJson(record.at("value"), record.at("ttl")));
+            }
+        } else if (op == "batch") {
+            for (const auto& item : record.at("entries")) {
+                applyLogRecord(item);
+            }
+        } else if (op == "delete" || op == "expire" || op == "evict") {
+            const string& key = record.at("key").get_ref<const string&>();
+            eraseEntry(shardFor(key), key);
+        } else if (op == "reset") {
+            for (auto& shard : shards) clearShard(*shard);
+        }
+    }
+
+    // Imported entries bypassed the log, so they are saved by a checkpoint
+    // before anything else records the import. A marker record then moves
+    // the LSN past them, so every follower takes a full copy. The backlog
+    // is dropped through the marker's LSN before the marker is appended,
+    // both under every shard lock, so no follower is ever sent the marker
+    // in place of that copy.
+    void finishImport(const ImportStats& stats) {
+        if (stats.imported == 0) return;
+        checkpoint(true);
+        uint64_t lsn;
+        {
+            auto locks = lockAll<ExclusiveLock>(LockProfiler::IMPORT);
+            if (backlog) backlog->dropThrough(log.currentLsn() + 1);
+            lsn = appendLog(json{{"op", "import"}, {"records", stats.imported}});
+        }
+        log.commit(lsn);
+    }
+
+    void clearShard(Shard& shard) {
+        vector<string> keys;
+        keys.reserve(shard.index.size());
+        shard.index.forEach([&](string_view key, const ValueEntry&) { keys.emplace_back(key); });
+        for (const auto& key : keys) eraseEntry(shard, key);
+    }
+
+    // Appends one mutation record to the log and returns its LSN. Call
+    // while holding the lock of every shard the record touches, so log
+    // order matches the order changes are applied; commit the LSN after
+    // releasing them.
+    uint64_t appendLog(const json& record) {
+        return log.append(record.dump());
+    }
+
+    uint64_t appendLog(const string& record) {
+        return log.append(record);
+    }
+
+    // Create records are assembled as text around the already serialized
+    // value, so the value is never put back into a json tree to log it.
+    static string createRecord(const string& key, const string& text, time_t ttl) {
+        return "{\"op\":\"create\",\"key\":" + json(key).dump() + ",\"value\":" + text +
+               ",\"ttl\":" + to_string(ttl) + "}";
+    }
+
+    // A compressed entry is logged packed, as base64 in place of the value.
+    static string createRecord(const string& key, const string& text, const ValueEntry& entry) {
+        if (!entry.packed) return createRecord(key, text, entry.ttl);
+        return "{\"op\":\"create\",\"key\":" + json(key).dump() + ",\"packed\":\"" +
+               ValueCompression::toBase64(entry.bytes.view()) + "\",\"ttl\":" + to_string(entry.ttl) + "}";
+    }
+
+    bool bytesMode() const {
+        return options.valueMode == ValueMode::Bytes;
+    }
+
+    bool pooled() const {
+        return options.allocation == AllocationMode::Pooled;
+    }
+
+    bool compressing() const {
+        return options.compression != Compression::None;
+    }
+
+    ValueEntry entryFromJson(json value, time_t ttl) const {
+        if (compressing()) {
+            string text = value.dump();
+            if (text.size() >= options.compressionThreshold) return entryFromText(text, ttl, &value);
+        }
+        ValueEntry entry;
+        entry.ttl = ttl;
+        if (bytesMode()) {
+            entry.bytes = SharedBytes::copyOf(value.dump(), pooled());
+        } else {
+            entry.value = make_shared<const json>(move(value));
+        }
+        return entry;
+    }
+
+    // Text at or past the compression threshold is kept packed if that
+    // makes it smaller. value, if given, is text already parsed.
+    ValueEntry entryFromText(string_view text, time_t ttl, const json* value = nullptr) const {
+        if (compressing() && text.size() >= options.compressionThreshold) {
+            string packed = ValueCompression::pack(text, options.compressionLevel, options.compressionDictionary);
+            if (!packed.empty()) {
+                metrics.count(KVMetrics::COMPRESSED_VALUES);
+                metrics.count(KVMetrics::COMPRESSION_INPUT_BYTES, text.size());
+                metrics.count(KVMetrics::COMPRESSION_OUTPUT_BYTES, packed.size());
+                return packedEntry(packed, ttl);
+            }
+        }
+        ValueEntry entry;
+        entry.ttl = ttl;
+        if (bytesMode()) {
+            entry.bytes = SharedBytes::copyOf(text, pooled());
+        } else {
+            entry.value = make_shared<const json>(value ? *value : json::parse(text.begin(), text.end()));
+        }
+        return entry;
+    }
+
+    // packed comes from the log, a snapshot or a primary, so its length
+    // prefix is checked against the value limit before it is trusted.
+    ValueEntry packedEntry(string_view packed, time_t ttl) const {
+        ValueCompression::unpackedLength(packed, MAX_VALUE_SIZE);
+        ValueEntry entry;
+        entry.ttl = ttl;
+        entry.bytes = SharedBytes::copyOf(packed, pooled());
+        entry.packed = true;
+        return entry;
+    }
+
+    static json keyRecord(const char* op, const string& key) {
+        return {{"op", op}, {"key", key}};
+    }
+
+    static bool isExpired(const ValueEntry& entry, time_t now) {
+        return entry.ttl != 0 && now > entry.ttl;
+    }
+
+    bool bounded() const {
+        return options.memoryBudget != 0;
+    }
+
+    size_t shardBudget() const {
+        return max<size_t>(options.memoryBudget / shards.size(), 1);
+    }
+
+    static uint32_t chargeFor(string_view key, size_t valueBytes) {
+        return static_cast<uint32_t>(sizeof(InlineKey) + sizeof(ValueEntry) + key.size() + valueBytes);
+    }
+
+    // Cold values are charged for their key only: their bytes are in the
+    // page cache, not on the heap.
+    static uint32_t chargeFor(string_view key, const ValueEntry& entry) {
+        return chargeFor(key, entry.bytes ? entry.bytes.size()
+                            : entry.cold  ? 0
+                                          : entry.value->dump().size());
+    }
+
+    bool spilling() const {
+        return options.overflow == OverflowPolicy::Spill;
+    }
+
+    // Takes an entry that is being replaced or removed off the books.
+    static void discharge(Shard& shard, const ValueEntry& entry) {
+        shard.usedBytes -= entry.charge;
+        if (shard.spill && entry.cold.source == shard.spill) {
+            shard.spillLive -= entry.cold.length;
+        }
+    }
+
+    string spillPath(const Shard& shard) const {
+        for (size_t i = 0; i < shards.size(); ++i) {
+            if (shards[i].get() == &shard) return filePath + ".spill." + to_string(i);
+        }
+        return filePath + ".spill";
+    }
+
+    // Stores an entry and registers its TTL. In a bounded store it also
+    // charges the entry to the shard and evicts until the shard is back
+    // within budget. Caller must hold the shard lock.
+    void putEntry(Shard& shard, const string& key, ValueEntry entry) {
+        ++shard.changes;
+        if (entry.ttl != 0) {
+            shard.expiries.emplace(entry.ttl, key);
+        }
+        if (options.orderedIndex) {
+            shard.ordered.emplace(key);
+        }
+        if (!bounded()) {
+            shard.index.put(key, move(entry));
+            return;
+        }
+
+        if (entry.charge == 0) {
+            entry.charge = chargeFor(key, entry);
+        }
+        const ValueEntry* old = shard.index.find(key);
+        if (old) {
+            discharge(shard, *old);
+        } else {
+            // A new key has to be read before the hand comes round to earn
+            // its place, so keys written once and never read go first.
+            entry.referenced.bit.store(false, memory_order_relaxed);
+        }
+        // When spilling, the ring only holds entries with a value in memory;
+        // a value read back from disk joins it again.
+        bool inRing = old && !(spilling() && old->cold);
+        if (!inRing && !(spilling() && entry.cold)) {
+            shard.clock.emplace_back(key);
+        }
+        shard.usedBytes += entry.charge;
+        shard.index.put(key, move(entry));
+
+        // While loading, the log's own evict records reproduce the evictions
+        // made at run time, which depended on reads that are not logged.
+        // Spilling changes no contents, so it keeps a big load within budget.
+        if (loaded || spilling()) {
+            enforceBudget(shard, key);
+        }
+        if (shard.clock.size() > 2 * shard.index.size() + 1024) {
+            shard.clock.clear();
+            shard.index.forEach([this, &shard](string_view k, const ValueEntry& e) {
+                if (!(spilling() && e.cold)) shard.clock.emplace_back(k);
+            });
+            shard.hand = 0;
+        }
+    }
+
+    void enforceBudget(Shard& shard, string_view keep) {
+        while (shard.usedBytes > shardBudget() && shard.index.size() > 1) {
+            if (!evictOne(shard, keep)) break;
+        }
+    }
+
+    // Removes an entry, keeping the memory accounting in step. Caller must
+    // hold the shard lock exclusively.
+    bool eraseEntry(Shard& shard, string_view key) {
+        ++shard.changes;
+        if (bounded()) {
+            const ValueEntry* entry = shard.index.find(key);
+            if (entry) discharge(shard, *entry);
+        }
+        if (options.orderedIndex && key.size() <= InlineKey::CAPACITY) {
+            shard.ordered.erase(InlineKey(key));
+        }
+        return shard.index.erase(key);
+    }
+
+    // Advances the CLOCK hand until it finds an entry whose reference bit
+    // is clear, clearing the bits it passes, and evicts or spills it. The
+    // key being written is never the victim. Returns false if nothing can
+    // be freed.
+    bool evictOne(Shard& shard, string_view keep) {
+        size_t passed = 0;
+        while (!shard.clock.empty()) {
+            if (shard.hand >= shard.clock.size()) shard.hand = 0;
+            InlineKey key = shard.clock[shard.hand];
+            const ValueEntry* entry = shard.index.find(key);
+            if (!entry || (spilling() && entry->cold)) {
+                shard.clock[shard.hand] = shard.clock.back();
+                shard.clock.pop_back();
+                continue;
+            }
+            if (key.view() == keep || entry->referenced.bit.load(memory_order_relaxed)) {
+                entry->referenced.bit.store(false, memory_order_relaxed);
+                ++shard.hand;
+                if (++passed > 2 * shard.clock.size()) return false;
+                continue;
+            }
+
+            if (spilling()) {
+                spillEntry(shard, key, *entry);
+            } else {
+                evictedBytes += entry->charge;
+                ++evictions;
+                appendLog(keyRecord("evict", string(key.view())));
+                eraseEntry(shard, key);
+            }
+            shard.clock[shard.hand] = shard.clock.back();
+            shard.clock.pop_back();
+            return true;
+        }
+        return false;
+    }
+
+    // Pages a value out to the shard's spill file and keeps only a reference
+    // to it in memory. Caller must hold the shard lock exclusively.
+    void spillEntry(Shard& shard, const InlineKey& key, const ValueEntry& entry) {
+        if (!shard.spill) {
+            shard.spill = make_shared<SpillFile>(spillPath(shard));
+        }
+        string text = entry.text();
+        size_t offset = shard.spill->append(text);
+
+        ValueEntry cold;
+        cold.ttl = entry.ttl;
+        cold.cold = {shard.spill, 0, offset, static_cast<uint32_t>(text.size())};
+        cold.charge = chargeFor(key, size_t(0));
+        cold.referenced.bit.store(false, memory_order_relaxed);
+        discharge(shard, entry);
+        shard.usedBytes += cold.charge;
+        shard.spillLive += text.size();
+        shard.index.put(string(key.view()), move(cold));
+        ++spills;
+        spilledBytes += text.size();
+    }
+
+    // Copies the values still in use out of a spill file that is mostly
+    // garbage into a fresh one. Readers that copied an entry beforehand keep
+    // the old file mapped until they are done. Caller must hold the shard
+    // lock exclusively; the time taken is proportional to the live bytes.
+    void compactSpill(Shard& shard) {
+        auto fresh = make_shared<SpillFile>(spillPath(shard));
+        vector<string> keys;
+        shard.index.forEach([&](string_view key, const ValueEntry& entry) {
+            if (entry.cold.source == shard.spill) keys.emplace_back(key);
+        });
+        size_t live = 0;
+        for (const auto& key : keys) {
+            ValueEntry moved = *shard.index.find(key);
+            moved.cold.offset = fresh->append(moved.cold.raw());
+            moved.cold.source = fresh;
+            live += moved.cold.length;
+            shard.index.put(key, move(moved));
+        }
+        shard.spill = fresh;
+        shard.spillLive = live;
+    }
+
+    // Pops keys that expired before cutoff off one shard's TTL heap until
+    // none are left or the time slice is used up. Returns true if due keys
+    // are left over. Caller must hold the shard lock exclusively.
+    bool expireSlice(Shard& shard, time_t cutoff, chrono::steady_clock::time_point deadline) {
+        while (!shard.expiries.empty() && shard.expiries.top().first < cutoff) {
+            if (chrono::steady_clock::now() >= deadline) return true;
+            InlineKey key = shard.expiries.top().second;
+            time_t due = shard.expiries.top().first;
+            shard.expiries.pop();
+            const ValueEntry* entry = shard.index.find(key);
+            if (entry && entry->ttl == due) {
+                appendLog(keyRecord("expire", string(key.view())));
+                eraseEntry(shard, key);
+                metrics.count(KVMetrics::EXPIRATIONS);
+            }
+        }
+
+        // Rewritten keys leave stale heap entries behind; rebuild once they
+        // outnumber the live ones so the heap cannot grow without bound.
+        if (shard.expiries.size() > 2 * shard.index.size() + 1024) {
+            decltype(shard.expiries) rebuilt;
+            shard.index.forEach([&rebuilt](string_view key, const ValueEntry& entry) {
+                if (entry.ttl != 0) rebuilt.emplace(entry.ttl, key);
+            });
+            shard.expiries.swap(rebuilt);
+        }
+        return false;
+    }
+
+    // Removes expired keys shard by shard. Work is proportional to the number
+    // of keys actually expiring, and no shard lock is held for longer than
+    // options.expirySlice at a time.
+    void cleanupExpiredKeys() {
+        auto started = metrics.start();
+        time_t cutoff = time(nullptr) - static_cast<time_t>(options.expiryGrace.count());
+        for (auto& shard : shards) {
+            bool more = true;
+            while (more) {
+                auto lock = exclusive(*shard, LockProfiler::CLEANUP);
+                more = expireSlice(*shard, cutoff, chrono::steady_clock::now() + options.expirySlice);
+                lock.unlock();
+                if (more) this_thread::yield();
+            }
+            if (spilling()) {
+                auto lock = exclusive(*shard, LockProfiler::CLEANUP);
+                if (shard->spill && shard->spill->sizeBytes() > SPILL_COMPACT_BYTES &&
+                    shard->spillLive * 2 < shard->spill->sizeBytes()) {
+                    compactSpill(*shard);
+                }
+            }
+        }
+        if (options.lockFreeReads) {
+            EpochDomain::instance().reclaim();
+        }
+        metrics.finish(KVMetrics::CLEANUP, started, KVMetrics::CLEANUP_RUNS);
+    }
+
+    void periodicCleanup() {
+        unique_lock<mutex> lock(workerMtx);
+        while (!stopping) {
+            workerCv.wait_for(lock, options.expiryInterval);
+            if (stopping) break;
+            lock.unlock();
+            cleanupExpiredKeys();
+            lock.lock();
+        }
+    }
+
+    // Logs and stores a new value for key. Caller must hold the shard lock
+    // exclusively and commit the returned LSN once it is released.
+    uint64_t storeValue(Shard& shard, const string& key, const json& value, const string& text, time_t expiry) {
+        return storeEntry(shard, key, prepareEntry(key, value, text), text, expiry);
+    }
+
+    // The entry for a value about to be written, compressed if it should
+    // be. Built before taking the shard lock where the caller can.
+    ValueEntry prepareEntry(const string& key, const json& value, const string& text) const {
+        ValueEntry entry = entryFromText(text, 0, &value);
+        entry.charge = chargeFor(key, entry.packed ? entry.bytes.size() : text.size());
+        return entry;
+    }
+
+    uint64_t storeEntry(Shard& shard, const string& key, ValueEntry entry, const string& text, time_t expiry) {
+        entry.ttl = expiry;
+        uint64_t lsn = appendLog(createRecord(key, text, entry));
+        putEntry(shard, key, move(entry));
+        return lsn;
+    }
+
+    // Without a ttl, a key that exists keeps its expiry.
+    string replace(const string& key, const json& value, optional<time_t> ttl, bool insertMissing) {
+        if (key.length() > MAX_KEY_LENGTH) return keyLengthError();
+        string text = value.dump();
+        if (text.length() > MAX_VALUE_SIZE) return valueSizeError();
+
+        ValueEntry entry = prepareEntry(key, value, text);
+        uint64_t lsn;
+        bool existed;
+        {
+            Shard& shard = shardFor(key);
+            auto lock = exclusive(shard, LockProfiler::UPDATE);
+            const ValueEntry* existing = shard.index.find(key);
+            existed = existing && !isExpired(*existing, time(nullptr));
+            if (!existed && !insertMissing) {
+                return statusMessage(existing ? KVStatus::Expired : KVStatus::NotFound);
+            }
+            time_t expiry = !ttl ? (existed ? existing->ttl : 0) : *ttl == 0 ? 0 : time(nullptr) + *ttl;
+            lsn = storeEntry(shard, key, move(entry), text, expiry);
+        }
+        log.commit(lsn);
+        return existed ? "Key-value pair updated successfully." : "Key-value pair created successfully.";
+    }
+
+    // Read-modify-write of one value under its shard lock. The result is
+    // logged as a plain create record holding the whole new value rather
+    // than the change, so replaying a log segment twice stays harmless.
+    template <typename Fn>
+    string modify(const string& key, Fn&& change) {
+        uint64_t lsn;
+        {
+            Shard& shard = shardFor(key);
+            auto lock = exclusive(shard, LockProfiler::PATCH);
+            const ValueEntry* existing = shard.index.find(key);
+            if (!existing) return statusMessage(KVStatus::NotFound);
+            if (isExpired(*existing, time(nullptr))) return statusMessage(KVStatus::Expired);
+
+            json value;
+            try {
+                value = change(existing->decoded());
+            } catch (const json::exception& e) {
+                return string("Error: Patch failed: ") + e.what();
+            }
+            string text = value.dump();
+            if (text.length() > MAX_VALUE_SIZE) return valueSizeError();
+            lsn = storeValue(shard, key, value, text, existing->ttl);
+        }
+        log.commit(lsn);
+        return "Key-value pair patched successfully.";
+    }
+
+    // Bounds of a scan: keys after from (or from itself when inclusive) and,
+    // if bounded, before upper.
+    struct ScanBounds {
+        string from;
+        bool inclusive = true;
+        string upper;
+        bool bounded = false;
+
+        bool before(string_view key) const {
+            return key < from || (!inclusive && key == from);
+        }
+
+        bool past(string_view key) const {
+            return bounded && key >= upper;
+        }
+    };
+
+    // One entry found by a scan, ordered by key for merging shards.
+    struct ScanHit {
+        string key;
+        string value;
+        time_t expiry;
+
+        bool operator<(const ScanHit& other) const {
+            return key < other.key;
+        }
+    };
+
+    // Copies up to limit live entries of one shard within bounds, in key
+    // order, holding the shard lock shared for just that long.
+    vector<ScanHit> scanShard(const Shard& shard, const ScanBounds& bounds, size_t limit) const {
+        vector<ScanHit> out;
+        auto lock = shared(shard, LockProfiler::SCAN);
+        time_t now = time(nullptr);
+        if (options.orderedIndex) {
+            // Stored keys are at most CAPACITY long, so a longer bound is
+            // sought by its prefix and the overshoot skipped below.
+            string_view seek = string_view(bounds.from).substr(0, InlineKey::CAPACITY);
+            for (auto it = shard.ordered.lower_bound(InlineKey(seek)); it != shard.ordered.end() && out.size() < limit; ++it) {
+                string_view key = it->view();
+                if (bounds.before(key)) continue;
+                if (bounds.past(key)) break;
+                const ValueEntry* entry = shard.index.find(key);
+                if (entry && !isExpired(*entry, now)) out.push_back({string(key), entry->text(), entry->ttl});
+            }
+            return out;
+        }
+
+        // Without the ordered index every key of the shard is visited.
+        vector<pair<string_view, const ValueEntry*>> matches;
+        shard.index.forEach([&](string_view key, const ValueEntry& entry) {
+            if (!bounds.before(key) && !bounds.past(key) && !isExpired(entry, now)) {
+                matches.emplace_back(key, &entry);
+            }
+        });
+        size_t count = min(limit, matches.size());
+        partial_sort(matches.begin(), matches.begin() + count, matches.end());
+        for (size_t i = 0; i < count; ++i) {
+            out.push_back({string(matches[i].first), matches[i].second->text(), matches[i].second->ttl});
+        }
+        return out;
+    }
+
+    // Takes the first limit + 1 entries of every shard and merges them, so
+    // no lock is held across shards and more is exact.
+    ScanResult scanBounds(const ScanBounds& bounds, size_t limit) const {
+        ScanResult result;
+        if (limit == 0) return result;
+        vector<ScanHit> merged;
+        for (const auto& shard : shards) {
+            auto part = scanShard(*shard, bounds, limit + 1);
+            merged.insert(merged.end(), make_move_iterator(part.begin()), make_move_iterator(part.end()));
+        }
+        sort(merged.begin(), merged.end());
+        if (merged.size() > limit) {
+            merged.resize(limit);
+            result.more = true;
+            result.cursor = merged.back().key;
+        }
+        result.entries.reserve(merged.size());
+        result.expiries.reserve(merged.size());
+        for (auto& hit : merged) {
+            result.entries.emplace_back(move(hit.key), move(hit.value));
+            result.expiries.push_back(hit.expiry);
+        }
+        return result;
+    }
+
+    ScanBounds boundsFrom(string_view first, string_view cursor) const {
+        ScanBounds bounds;
+        bounds.from = string(first);
+        if (!cursor.empty() && cursor >= first) {
+            bounds.from = string(cursor);
+            bounds.inclusive = false;
+        }
+        return bounds;
+    }
+
+    // One operation of a batch, pointing into the caller's arguments.
+    struct PendingOp {
+        BatchOp op;
+        const string* key;
+        const json* value;
+        time_t expiry;
+        string text;
+        ValueEntry entry;
+    };
+
+    // Validates and applies a batch of operations under the locks of every
+    // shard it touches, logged as a single record so that replay applies
+    // all of it or none of it. The caller commits lsn, which stays 0 if
+    // nothing was logged. Returns an error message, or an empty string
+    // on success.
+    string applyBatch(vector<PendingOp>& ops, uint64_t& lsn) {
+        lsn = 0;
+        if (ops.empty()) return string();
+
+        vector<size_t> touched;
+        touched.reserve(ops.size());
+        for (auto& op : ops) {
+            if (op.key->length() > MAX_KEY_LENGTH) {
+                return "Error: One or more keys/values exceed size limits.";
+            }
+            if (op.op == BatchOp::Create) {
+                // The text is needed for the log record anyway.
+                op.text = op.value->dump();
+                if (op.text.length() > MAX_VALUE_SIZE) {
+                    return "Error: One or more keys/values exceed size limits.";
+                }
+                op.entry = prepareEntry(*op.key, *op.value, op.text);
+                op.entry.ttl = op.expiry;
+            }
+            touched.push_back(shardIndex(*op.key));
+        }
+        sort(touched.begin(), touched.end());
+        touched.erase(unique(touched.begin(), touched.end()), touched.end());
+
+        {
+            vector<ExclusiveLock> locks;
+            locks.reserve(touched.size());
+            for (size_t index : touched) {
+                locks.emplace_back(shards[index]->mtx, lockProfiler.get(), LockProfiler::BATCH);
+            }
+
+            // Tracks keys already created or removed earlier in the batch.
+            unordered_map<string_view, bool> present;
+            time_t now = time(nullptr);
+            for (const auto& op : ops) {
+                auto it = present.find(*op.key);
+                const ValueEntry* existing = shardFor(*op.key).index.find(*op.key);
+                if (op.op == BatchOp::Create) {
+                    bool live = it != present.end() ? it->second : existing && !isExpired(*existing, now);
+                    if (live) return "Error: Duplicate key found in batch.";
+                } else {
+                    bool exists = it != present.end() ? it->second : existing != nullptr;
+                    if (!exists) return "Error: One or more keys not found.";
+                }
+                present[*op.key] = op.op == BatchOp::Create;
+            }
+
+            string record = "{\"op\":\"batch\",\"entries\":[";
+            for (size_t i = 0; i < ops.size(); ++i) {
+                if (i > 0) record += ',';
+                if (ops[i].op == BatchOp::Create) {
+                    record += createRecord(*ops[i].key, ops[i].text, ops[i].entry);
+                } else {
+                    record += keyRecord("delete", *ops[i].key).dump();
+                }
+            }
+            record += "]}";
+            lsn = appendLog(record);
+
+            for (auto& op : ops) {
+                Shard& shard = shardFor(*op.key);
+                if (op.op == BatchOp::Remove) {
+                    eraseEntry(shard, *op.key);
+                    continue;
+                }
+                putEntry(shard, *op.key, move(op.entry));
+            }
+        }
+        return string();
+    }
+
+    string writeItems(const vector<BatchItem>& items, uint64_t& lsn) {
+        vector<PendingOp> ops;
+        ops.reserve(items.size());
+        time_t now = time(nullptr);
+        for (const auto& item : items) {
+            time_t expiry = item.op == BatchOp::Create && item.ttl != 0 ? now + item.ttl : 0;
+            ops.push_back({item.op, &item.key, &item.value, expiry, string(), ValueEntry()});
+        }
+        string error = applyBatch(ops, lsn);
+        return error.empty() ? "Batch operation successful." : error;
+    }
+
+    // Finds a live entry and hands it to onValue while it is protected by
+    // an epoch guard or the shard lock.
+    template <typename Fn>
+    KVStatus lookup(string_view key, Fn&& onValue) {
+        auto started = metrics.start();
+        KVStatus status = lookupEntry(key, onValue);
+        metrics.finish(KVMetrics::READ, started,
+                       status == KVStatus::Ok         ? KVMetrics::READ_HITS
+                       : status == KVStatus::NotFound ? KVMetrics::READ_MISSES
+                                                      : KVMetrics::READ_EXPIRED);
+        return status;
+    }
+
+    template <typename Fn>
+    KVStatus lookupEntry(string_view key, Fn& onValue) {
+        Shard& shard = shardFor(key);
+        bool looked = false;
+        if (shard.index.lockFree()) {
+            EpochDomain::Guard guard(EpochDomain::instance());
+            if (guard.active()) {
+                looked = true;
+                KVStatus status = KVStatus::Ok;
+                bool cold = false;
+                bool found = shard.index.readLockFree(key, [&](const ValueEntry& entry) {
+                    // Expired entries are only reported here; the cleanup
+                    // thread removes them, so readers never write.
+                    if (isExpired(entry, time(nullptr))) {
+                        status = KVStatus::Expired;
+                    } else if (entry.cold) {
+                        cold = true;
+                    } else {
+                        entry.touch();
+                        onValue(entry);
+                    }
+                });
+                if (!found) return KVStatus::NotFound;
+                if (!cold) return status;
+            }
+        }
+        if (!looked) {
+            // Also the fallback when every epoch slot is taken: the shared
+            // lock keeps writers out just as well.
+            auto lock = shared(shard, LockProfiler::READ);
+            const ValueEntry* entry = shard.index.find(key);
+            if (!entry) return KVStatus::NotFound;
+            if (!isExpired(*entry, time(nullptr)) && !entry->cold) {
+                entry->touch();
+                onValue(*entry);
+                return KVStatus::Ok;
+            }
+        }
+
+        // Expiring or decoding a lazily loaded value both change the entry,
+        // so this rarer path retries under the exclusive lock.
+        auto lock = exclusive(shard, LockProfiler::READ_SLOW);
+        const ValueEntry* entry = shard.index.find(key);
+        if (!entry) return KVStatus::NotFound;
+        if (isExpired(*entry, time(nullptr))) {
+            if (!shard.index.lockFree()) {
+                appendLog(keyRecord("expire", string(key)));
+                eraseEntry(shard, key);
+                metrics.count(KVMetrics::EXPIRATIONS);
+            }
+            return KVStatus::Expired;
+        }
+        if (entry->cold) {
+            // Through putEntry so a bounded store charges the decoded value.
+            ValueEntry decoded = *entry;
+            decoded.materialize(bytesMode(), pooled());
+            decoded.charge = 0;
+            putEntry(shard, string(key), move(decoded));
+            entry = shard.index.find(key);
+        }
+        entry->touch();
+        onValue(*entry);
+        return KVStatus::Ok;
+    }
+
+    // insert and removeKey leave committing lsn to the caller, like applyBatch.
+    string insert(const string& key, const json& value, time_t ttl, uint64_t& lsn) {
+        lsn = 0;
+        if (key.length() > MAX_KEY_LENGTH) return keyLengthError();
+        string text = value.dump();
+        if (text.length() > MAX_VALUE_SIZE) return valueSizeError();
+
+        ValueEntry entry = prepareEntry(key, value, text);
+        {
+            Shard& shard = shardFor(key);
+            auto lock = exclusive(shard, LockProfiler::CREATE);
+            const ValueEntry* existing = shard.index.find(key);
+            if (existing && !isExpired(*existing, time(nullptr))) return "Error: Key already exists.";
+
+            lsn = storeEntry(shard, key, move(entry), text, ttl == 0 ? 0 : time(nullptr) + ttl);
+        }
+        return "Key-value pair created successfully.";
+    }
+
+    string removeKey(const string& key, uint64_t& lsn) {
+        lsn = 0;
+        {
+            Shard& shard = shardFor(key);
+            auto lock = exclusive(shard, LockProfiler::REMOVE);
+
+            if (!shard.index.contains(key)) return "Error: Key not found.";
+            lsn = appendLog(keyRecord("delete", key));
+            eraseEntry(shard, key);
+        }
+        return "Key-value pair deleted successfully.";
+    }
+
+    // A write queued by one of the *Async calls. Producers push onto the
+    // pendingWrites stack with a CAS; the writer thread takes the whole
+    // stack with one exchange and applies it oldest first.
+    struct AsyncWrite {
+        AsyncWrite* next = nullptr;
+        enum Kind { CREATE, REMOVE, BATCH } kind = CREATE;
+        string key;
+        json value;
+        time_t ttl = 0;
+        vector<BatchItem> items;
+        function<void(const string&)> callback;
+        promise<string> done;
+        string result;
+        exception_ptr error;
+    };
+
+    atomic<AsyncWrite*> pendingWrites{nullptr};
+    mutex writerMtx;
+    condition_variable writerCv;
+    bool writerStopping = false;
+    once_flag writerStarted;
+    thread writerThread;
+
+    void enqueue(unique_ptr<AsyncWrite> write) {
+        if constexpr (!Locking::threadSafe) {
+            vector<unique_ptr<AsyncWrite>> writes;
+            writes.push_back(move(write));
+            applyWrites(writes);
+            return;
+        }
+        call_once(writerStarted, [this]() { writerThread = thread([this]() { writeWorker(); }); });
+        AsyncWrite* node = write.release();
+        AsyncWrite* head = pendingWrites.load(memory_order_relaxed);
+        do {
+            node->next = head;
+        } while (!pendingWrites.compare_exchange_weak(head, node, memory_order_release, memory_order_relaxed));
+        // Only the push that ends an empty spell can find the writer asleep.
+        if (!head) {
+            lock_guard<mutex> lock(writerMtx);
+            writerCv.notify_one();
+        }
+    }
+
+    string applyWrite(const AsyncWrite& write, uint64_t& lsn) {
+        auto started = metrics.start();
+        string result;
+        switch (write.kind) {
+        case AsyncWrite::CREATE:
+            result = insert(write.key, write.value, write.ttl, lsn);
+            metrics.finish(KVMetrics::CREATE, started, failed(result) ? KVMetrics::CREATE_ERRORS : KVMetrics::CREATES);
+            break;
+        case AsyncWrite::REMOVE:
+            result = removeKey(write.key, lsn);
+            metrics.finish(KVMetrics::REMOVE, started, failed(result) ? KVMetrics::REMOVE_MISSES : KVMetrics::REMOVES);
+            break;
+        case AsyncWrite::BATCH:
+            result = writeItems(write.items, lsn);
+            break;
+        }
+        return result;
+    }
+
+    static void deliver(AsyncWrite& write) {
+        if (!write.callback) {
+            if (write.error) {
+                write.done.set_exception(write.error);
+            } else {
+                write.done.set_value(move(write.result));
+            }
+            return;
+        }
+        if (write.error) {
+            try {
+                rethrow_exception(write.error);
+            } catch (const exception& e) {
+                write.result = string("Error: ") + e.what();
+            }
+        }
+        write.callback(write.result);
+    }
+
+    // Applies queued writes in the order they were queued. Everything taken
+    // in one drain shares a single log commit, so under group commit a
+    // burst of async writes waits for one fsync rather than one each.
+    void writeWorker() {
+        while (true) {
+            AsyncWrite* taken = pendingWrites.exchange(nullptr, memory_order_acquire);
+            if (!taken) {
+                unique_lock<mutex> lock(writerMtx);
+                writerCv.wait(lock, [this]() {
+                    return writerStopping || pendingWrites.load(memory_order_relaxed) != nullptr;
+                });
+                if (!pendingWrites.load(memory_order_relaxed)) return;
+                continue;
+            }
+
+            vector<unique_ptr<AsyncWrite>> writes;
+            for (AsyncWrite* node = taken; node;) {
+                AsyncWrite* next = node->next;
+                writes.emplace_back(node);
+                node = next;
+            }
+            reverse(writes.begin(), writes.end());
+            applyWrites(writes);
+        }
+    }
+
+    void applyWrites(vector<unique_ptr<AsyncWrite>>& writes) {
+        uint64_t lsn = 0;
+        for (auto& write : writes) {
+            try {
+                uint64_t written = 0;
+                write->result = applyWrite(*write, written);
+                lsn = max(lsn, written);
+            } catch (...) {
+                write->error = current_exception();
+            }
+        }
+        try {
+            log.commit(lsn);
+        } catch (...) {
+            for (auto& write : writes) {
+                if (!write->error) write->error = current_exception();
+            }
+        }
+        for (auto& write : writes) deliver(*write);
+    }
+
+    future<string> submit(unique_ptr<AsyncWrite> write) {
+        future<string> result = write->done.get_future();
+        enqueue(move(write));
+        return result;
+    }
+
+    static bool failed(const string& message) {
+        return message.compare(0, 6, "Error:") == 0;
+    }
+
+public:
+    BasicKVDataStore(const string& path = "datastore.json", const KVOptions& opts = KVOptions())
+        : filePath(path), logPath(path + ".log"), oldLogPath(path + ".log.1"), options(opts),
+          writerLock(path + ".lock"), log(logPath, opts.durability, opts.fsyncInterval), metrics(opts.metrics) {
+        if (options.lockProfiling) {
+            lockProfiler = make_unique<LockProfiler>();
+        }
+        if (!options.compressionDictionary.empty()) {
+            ValueCompression::addDictionary(options.compressionDictionary);
+        }
+        size_t count = 1;
+        while (count < options.shardCount) count <<= 1;
+        shardMask = count - 1;
+        for (size_t i = 0; i < count; ++i) {
+            shards.push_back(make_unique<Shard>(options.lockFreeReads, options.indexBackend, pooled()));
+        }
+
+        loadFromFile();
+        log.open(replayedBytes, replayedRecords);
+        if (options.replicationBacklog != 0) {
+            backlog = make_unique<ReplicationBacklog>(options.replicationBacklog, log.currentLsn());
+            log.setListener([this](uint64_t lsn, const string& record) { backlog->append(lsn, record); });
+        }
+        loaded = true;
+        if (bounded()) {
+            // A smaller budget than last time takes effect here.
+            for (auto& shard : shards) enforceBudget(*shard, string_view());
+        }
+
+        if (options.sharedReaders) {
+            openSharedImage();
+        }
+        if constexpr (Locking::threadSafe) {
+            if (options.sharedReaders) {
+                publishThread = thread([this]() { publishWorker(); });
+            }
+            cleanupThread = thread([this]() { periodicCleanup(); });
+            if (options.checkpointLogBytes != 0 || options.checkpointLogRecords != 0) {
+                checkpointThread = thread([this]() { checkpointWorker(); });
+            }
+        }
+    }
+
+    // What the background threads do, done once on the calling thread: drops
+    // expired keys, checkpoints if the log has outgrown its thresholds and
+    // publishes the shared image if anything changed. Only a store without
+    // locking needs it, but any store may call it.
+    void runMaintenance() {
+        cleanupExpiredKeys();
+        if (checkpointDue()) checkpoint();
+        if (control) publishImage(false);
+    }
+
+    ~BasicKVDataStore() {
+        {
+            // Writes still queued are applied before the writer exits.
+            lock_guard<mutex> lock(writerMtx);
+            writerStopping = true;
+        }
+        writerCv.notify_all();
+        if (writerThread.joinable()) {
+            writerThread.join();
+        }
+        {
+            lock_guard<mutex> lock(workerMtx);
+            stopping = true;
+        }
+        workerCv.notify_all();
+        if (checkpointThread.joinable()) {
+            checkpointThread.join();
+        }
+        if (cleanupThread.joinable()) {
+            cleanupThread.join();
+        }
+        if (publishThread.joinable()) {
+            publishThread.join();
+        }
+        closeSharedImage();
+
+        lock_guard<mutex> cpLock(checkpointMtx);
+        auto locks = lockAll<ExclusiveLock>(LockProfiler::SAVE);
+        saveToFile();
+    }
+
+    // Defers the durability wait of every write this thread makes until
+    // the returned guard is finished, then waits once for all of them; see
+    // MutationLog::DeferredCommit. Results of those writes must not be
+    // passed on before finish() returns.
+    MutationLog::DeferredCommit deferCommits() {
+        return MutationLog::DeferredCommit(log);
+    }
+
+    // Folds the log into a new snapshot. Writers are only held up while the
+    // log is rotated and the shards are copied; serialization and the file
+    // write happen on the copy with every shard lock released. Nothing is
+    // written if nothing was logged since the last one, unless force is set.
+    void checkpoint(bool force = false) {
+        lock_guard<mutex> cpLock(checkpointMtx);
+        vector<StoreMap> cut;
+        {
+            // Shared locks keep writers out while still letting reads through.
+            auto locks = lockAll<SharedLock>(LockProfiler::CHECKPOINT);
+            if (!force && log.recordCount() == 0 && !filesystem::exists(oldLogPath)) return;
+            log.rotate(oldLogPath);
+            cut = copyShards();
+        }
+        writeSnapshot(cut);
+        filesystem::remove(oldLogPath);
+    }
+
+    // Epoch and LSN of the last record this store logged. Once a write has
+    // returned, a follower that reached this position can read it.
+    LogPosition logPosition() {
+        return {backlog ? backlog->epoch() : 0, log.currentLsn()};
+    }
+
+    // Null unless options.replicationBacklog is set.
+    ReplicationBacklog* replicationBacklog() {
+        return backlog.get();
+    }
+
+    // Passes emit a create record for every entry, for seeding a follower.
+    // Each shard's records are gathered under its shared lock and emitted
+    // once that is released, so writers only wait on the shard being
+    // copied and no more than one shard is held in memory. The copy is
+    // fuzzy: writes made meanwhile may or may not be in it. Replaying the
+    // log after an LSN read before the call makes it consistent, as every
+    // record overwrites or removes its key whole.
+    void snapshotRecords(const function<void(const vector<string>&)>& emit) {
+        vector<string> records;
+        for (const auto& shard : shards) {
+            records.clear();
+            {
+                auto lock = shared(*shard, LockProfiler::REPLICATE);
+                records.reserve(shard->index.size());
+                shard->index.forEach([&](string_view key, const ValueEntry& entry) {
+                    records.push_back(createRecord(string(key), entry.text(), entry.ttl));
+                });
+            }
+            emit(records);
+        }
+    }
+
+    // Loads a record stream straight into the shards. Nothing is logged
+    // per key: once the stream is read, one snapshot is written that covers
+    // it, so a bulk load costs one file write rather than a log append per
+    // record. Records are applied in batches under each shard's lock, and
+    // existing keys are overwritten. A malformed record throws, with the
+    // records before it imported and saved.
+    ImportStats importRecords(istream& in, RecordFormat format) {
+        static constexpr size_t BATCH_RECORDS = 4096;
+        ImportStats stats;
+        time_t now = time(nullptr);
+        vector<vector<pair<string, ValueEntry>>> pending(shards.size());
+        size_t buffered = 0;
+        auto flush = [&]() {
+            for (size_t i = 0; i < shards.size(); ++i) {
+                if (pending[i].empty()) continue;
+                auto lock = exclusive(*shards[i], LockProfiler::IMPORT);
+                for (auto& [key, entry] : pending[i]) putEntry(*shards[i], key, move(entry));
+                pending[i].clear();
+            }
+            buffered = 0;
+        };
+        // value, when given, is text parsed already and may be moved from.
+        auto add = [&](string& key, string_view text, json* value, time_t ttl) {
+            if (key.size() > MAX_KEY_LENGTH || text.size() > MAX_VALUE_SIZE || (ttl != 0 && now > ttl)) {
+                ++stats.skipped;
+                return;
+            }
+            ValueEntry entry = value && !bytesMode() && !compressing() ? entryFromJson(move(*value), ttl)
+                                                                       : entryFromText(text, ttl, value);
+            pending[shardIndex(key)].emplace_back(move(key), move(entry));
+            ++stats.imported;
+            if (++buffered == BATCH_RECORDS) flush();
+        };
+
+        try {
+            if (format == RecordFormat::Binary) {
+                RecordStream::readMagic(in);
+                string key, text;
+                time_t ttl;
+                while (RecordStream::readBinary(in, key, ttl, text)) {
+                    if (bytesMode() || compressing()) {
+                        // Stored as text, so it must be checked here.
+                        if (!json::accept(text)) {
+                            throw runtime_error("Import failed at record " +
+                                                to_string(stats.imported + stats.skipped + 1) +
+                                                ": value is not JSON.");
+                        }
+                        add(key, text, nullptr, ttl);
+                    } else {
+                        json value = json::parse(text);
+                        add(key, text, &value, ttl);
+                    }
+                }
+            } else {
+                RecordReader reader(format == RecordFormat::Snapshot, [&](string& key, json& value, time_t ttl) {
+                    string text = value.dump();
+                    add(key, text, &value, ttl);
+                });
+                if (format == RecordFormat::Snapshot) {
+                    json::sax_parse(in, &reader);
+                } else {
+                    // Not strict, so each parse stops at the end of its record.
+                    while ((in >> ws) && in.peek() != char_traits<char>::eof()) {
+                        json::sax_parse(in, &reader, json::input_format_t::json, false);
+                    }
+                }
+            }
+        } catch (...) {
+            flush();
+            finishImport(stats);
+            throw;
+        }
+        flush();
+        finishImport(stats);
+        return stats;
+    }
+
+    // Writes every live entry to out. Each shard is copied under its shared
+    // lock and written once that is released, so the export never holds
+    // more than one shard, in memory or locked; writes made meanwhile may
+    // or may not be included. Returns the number of records written.
+    size_t exportRecords(ostream& out, RecordFormat format) {
+        if (format == RecordFormat::Binary) {
+            out.write(RecordStream::MAGIC, sizeof(RecordStream::MAGIC));
+        } else if (format == RecordFormat::Snapshot) {
+            out << '{';
+        }
+        size_t count = 0;
+        string chunk;
+        for (const auto& shard : shards) {
+            chunk.clear();
+            {
+                auto lock = shared(*shard, LockProfiler::EXPORT);
+                time_t now = time(nullptr);
+                shard->index.forEach([&](string_view key, const ValueEntry& entry) {
+                    if (isExpired(entry, now)) return;
+                    RecordStream::append(chunk, format, key, entry.ttl, entry.text(), count == 0);
+                    ++count;
+                });
+            }
+            out.write(chunk.data(), static_cast<streamsize>(chunk.size()));
+        }
+        if (format == RecordFormat::Snapshot) {
+            out << '}';
+        }
+        out.flush();
+        if (!out) {
+            throw runtime_error("Failed to write export.");
+        }
+        return count;
+    }
+
+    // Applies records streamed from a leader's log, in order, and logs
+    // them here too so a follower restarts with what it was sent. A
+    // "reset" record, sent ahead of a full copy, empties the store; an
+    // "import" marker changes nothing.
+    void applyReplicated(const vector<json>& records) {
+        uint64_t lsn = 0;
+        for (const auto& record : records) {
+            const string& op = record.at("op").get_ref<const string&>();
+            vector<size_t> touched;
+            if (op == "batch") {
+                for (const auto& item : record.at("entries")) {
+                    touched.push_back(shardIndex(item.at("key").get_ref<const string&>()));
+                }
+                sort(touched.begin(), touched.end());
+                touched.erase(unique(touched.begin(), touched.end()), touched.end());
+            } else if (record.contains("key")) {
+                touched.push_back(shardIndex(record.at("key").get_ref<const string&>()));
+            } else {
+                // "reset", "import" and any other keyless record take every
+                // shard, so their append cannot race a log rotation.
+                for (size_t i = 0; i < shards.size(); ++i) touched.push_back(i);
+            }
+
+            vector<ExclusiveLock> locks;
+            locks.reserve(touched.size());
+            for (size_t index : touched) {
+                locks.emplace_back(shards[index]->mtx, lockProfiler.get(), LockProfiler::REPLICATE);
+            }
+            lsn = appendLog(record);
+            applyLogRecord(record);
+        }
+        if (lsn != 0) log.commit(lsn);
+    }
+
+    MemoryUsage memoryUsage() const {
+        MemoryUsage usage;
+        for (const auto& shard : shards) {
+            auto lock = shared(*shard, LockProfiler::STATS);
+            usage.indexSlabBytes += shard->pool.reservedBytes();
+        }
+        usage.valueArenaBytes = ValueArena::instance().reservedBytes();
+        return usage;
+    }
+
+    // Returns up to limit entries whose keys start with prefix, in key order.
+    // Pass the cursor of the previous page to continue from there.
+    ScanResult scan(string_view prefix, size_t limit, string_view cursor = string_view()) const {
+        ScanBounds bounds = boundsFrom(prefix, cursor);
+        // Every key with the prefix sorts before the prefix with its last
+        // byte below 0xff incremented and anything after it cut off.
+        string upper(prefix);
+        while (!upper.empty() && static_cast<unsigned char>(upper.back()) == 0xff) upper.pop_back();
+        if (!upper.empty()) {
+            upper.back() = static_cast<char>(static_cast<unsigned char>(upper.back()) + 1);
+            bounds.upper = move(upper);
+            bounds.bounded = true;
+        }
+        return scanBounds(bounds, limit);
+    }
+
+    // Returns up to limit entries with first <= key < last, in key order.
+    ScanResult scanRange(string_view first, string_view last, size_t limit,
+                         string_view cursor = string_view()) const {
+        ScanBounds bounds = boundsFrom(first, cursor);
+        bounds.upper = string(last);
+        bounds.bounded = true;
+        return scanBounds(bounds, limit);
+    }
+
+    EvictionStats evictionStats() const {
+        EvictionStats stats;
+        stats.budgetBytes = options.memoryBudget;
+        for (const auto& shard : shards) {
+            auto lock = shared(*shard, LockProfiler::STATS);
+            stats.usedBytes += shard->usedBytes;
+        }
+        stats.evictions = evictions.load();
+        stats.evictedBytes = evictedBytes.load();
+        stats.spills = spills.load();
+        stats.spilledBytes = spilledBytes.load();
+        return stats;
+    }
+
+    KVStats stats() const {
+        KVStats stats;
+        metrics.collect(stats.counters, stats.latencies);
+        for (const auto& shard : shards) {
+            auto lock = shared(*shard, LockProfiler::STATS);
+            stats.keys += shard->index.size();
+        }
+        stats.logBytes = log.sizeBytes();
+        stats.logSyncs = log.syncCount();
+        stats.eviction = evictionStats();
+        return stats;
+    }
+
+    // Shard lock waits and hold times per call site, most total wait first.
+    // Empty unless options.lockProfiling is set.
+    vector<LockSiteStats> lockProfile() const {
+        return lockProfiler ? lockProfiler->report() : vector<LockSiteStats>();
+    }
+
+    // stats() in the Prometheus text exposition format.
+    string metricsText() const {
+        KVStats s = stats();
+        string out;
+        auto line = [&out](const string& name, const string& labels, double value) {
+            char number[32];
+            snprintf(number, sizeof(number), "%.17g", value);
+            out += name;
+            if (!labels.empty()) out += "{" + labels + "}";
+            out += " ";
+            out += number;
+            out += "\n";
+        };
+        auto counter = [&](const char* name, const char* help, const string& labels, uint64_t value) {
+            out += string("# HELP ") + name + " " + help + "\n# TYPE " + name + " counter\n";
+            line(name, labels, static_cast<double>(value));
+        };
+
+        out += "# HELP kvstore_reads_total Reads by outcome.\n# TYPE kvstore_reads_total counter\n";
+        line("kvstore_reads_total", "result=\"hit\"", static_cast<double>(s[KVMetrics::READ_HITS]));
+        line("kvstore_reads_total", "result=\"miss\"", static_cast<double>(s[KVMetrics::READ_MISSES]));
+        line("kvstore_reads_total", "result=\"expired\"", static_cast<double>(s[KVMetrics::READ_EXPIRED]));
+        out += "# HELP kvstore_writes_total Writes by operation and outcome.\n# TYPE kvstore_writes_total counter\n";
+        line("kvstore_writes_total", "op=\"create\",result=\"ok\"", static_cast<double>(s[KVMetrics::CREATES]));
+        line("kvstore_writes_total", "op=\"create\",result=\"error\"",
+             static_cast<double>(s[KVMetrics::CREATE_ERRORS]));
+        line("kvstore_writes_total", "op=\"remove\",result=\"ok\"", static_cast<double>(s[KVMetrics::REMOVES]));
+        line("kvstore_writes_total", "op=\"remove\",result=\"error\"",
+             static_cast<double>(s[KVMetrics::REMOVE_MISSES]));
+        line("kvstore_writes_total", "op=\"batch_create\",result=\"ok\"",
+             static_cast<double>(s[KVMetrics::BATCH_CREATES]));
+        line("kvstore_writes_total", "op=\"batch_create\",result=\"error\"",
+             static_cast<double>(s[KVMetrics::BATCH_ERRORS]));
+        counter("kvstore_batch_keys_total", "Keys written by successful batch creates.", "", s[KVMetrics::BATCH_KEYS]);
+        counter("kvstore_expirations_total", "Keys removed because their TTL ran out.", "", s[KVMetrics::EXPIRATIONS]);
+        counter("kvstore_snapshots_total", "Snapshots written.", "", s[KVMetrics::SNAPSHOTS]);
+        counter("kvstore_snapshot_bytes_total", "Bytes written to snapshots.", "", s[KVMetrics::SNAPSHOT_BYTES]);
+        counter("kvstore_cleanup_runs_total", "Expiry sweeps run.", "", s[KVMetrics::CLEANUP_RUNS]);
+        counter("kvstore_evictions_total", "Entries evicted or spilled to stay in budget.", "", s.eviction.evictions);
+        counter("kvstore_compressed_values_total", "Values stored compressed.", "", s[KVMetrics::COMPRESSED_VALUES]);
+        counter("kvstore_compression_input_bytes_total", "Bytes of values before compression.", "",
+                s[KVMetrics::COMPRESSION_INPUT_BYTES]);
+        counter("kvstore_compression_output_bytes_total", "Bytes of values after compression.", "",
+                s[KVMetrics::COMPRESSION_OUTPUT_BYTES]);
+
+        out += "# HELP kvstore_keys Keys held, including expired ones not yet swept.\n# TYPE kvstore_keys gauge\n";
+        line("kvstore_keys", "", static_cast<double>(s.keys));
+        out += "# HELP kvstore_log_bytes Size of the mutation log.\n# TYPE kvstore_log_bytes gauge\n";
+        line("kvstore_log_bytes", "", static_cast<double>(s.logBytes));
+        out += "# HELP kvstore_log_syncs_total fsyncs of the mutation log.\n# TYPE kvstore_log_syncs_total counter\n";
+        line("kvstore_log_syncs_total", "", static_cast<double>(s.logSyncs));
+
+        out += "# HELP kvstore_duration_seconds Call latency by operation.\n"
+               "# TYPE kvstore_duration_seconds summary\n";
+        for (size_t t = 0; t < KVMetrics::TIMER_COUNT; ++t) {
+            const LatencySummary& l = s.latencies[t];
+            string op = string("op=\"") + KVMetrics::timerName(static_cast<KVMetrics::Timer>(t)) + "\"";
+            line("kvstore_duration_seconds", op + ",quantile=\"0.5\"", l.p50Us / 1e6);
+            line("kvstore_duration_seconds", op + ",quantile=\"0.99\"", l.p99Us / 1e6);
+            line("kvstore_duration_seconds", op + ",quantile=\"0.999\"", l.p999Us / 1e6);
+            line("kvstore_duration_seconds_sum", op, l.meanUs * static_cast<double>(l.count) / 1e6);
+            line("kvstore_duration_seconds_count", op, static_cast<double>(l.count));
+        }
+
+        vector<LockSiteStats> locks = lockProfile();
+        if (!locks.empty()) {
+            out += "# HELP kvstore_lock_acquisitions_total Shard lock acquisitions by call site.\n"
+                   "# TYPE kvstore_lock_acquisitions_total counter\n";
+            for (const auto& l : locks) {
+                string site = string("site=\"") + l.site + "\"";
+                line("kvstore_lock_acquisitions_total", site, static_cast<double>(l.acquisitions));
+                line("kvstore_lock_acquisitions_total", site + ",contended=\"true\"", static_cast<double>(l.contended));
+            }
+            for (const char* kind : {"wait", "hold"}) {
+                string name = string("kvstore_lock_") + kind + "_seconds";
+                out += "# HELP " + name + " Shard lock " + kind + " time by call site.\n# TYPE " + name + " summary\n";
+                for (const auto& l : locks) {
+                    const LatencySummary& t = kind[0] == 'w' ? l.wait : l.hold;
+                    string site = string("site=\"") + l.site + "\"";
+                    line(name, site + ",quantile=\"0.5\"", t.p50Us / 1e6);
+                    line(name, site + ",quantile=\"0.99\"", t.p99Us / 1e6);
+                    line(name, site + ",quantile=\"0.999\"", t.p999Us / 1e6);
+                    line(name + "_sum", site, (kind[0] == 'w' ? l.totalWaitUs : l.totalHoldUs) / 1e6);
+                    line(name + "_count", site, static_cast<double>(t.count));
+                }
+            }
+        }
+        return out;
+    }
+
+    string create(const string& key, const json& value, time_t ttl = 0) {
+        auto started = metrics.start();
+        uint64_t lsn;
+        string result = insert(key, value, ttl, lsn);
+        log.commit(lsn);
+        metrics.finish(KVMetrics::CREATE, started, failed(result) ? KVMetrics::CREATE_ERRORS : KVMetrics::CREATES);
+        return result;
+    }
+
+    // Replaces the value of an existing key. Its expiry is kept unless a
+    // ttl is given; a ttl of 0 clears it.
+    string update(const string& key, const json& value, optional<time_t> ttl = nullopt) {
+        return replace(key, value, ttl, false);
+    }
+
+    // Creates the key or replaces its value, as a single step. As with
+    // update(), an existing key keeps its expiry unless a ttl is given.
+    string upsert(const string& key, const json& value, optional<time_t> ttl = nullopt) {
+        return replace(key, value, ttl, true);
+    }
+
+    // Applies an RFC 6902 JSON Patch to the stored value atomically. The
+    // key keeps its TTL.
+    string patch(const string& key, const json& operations) {
+        return modify(key, [&operations](const json& current) { return current.patch(operations); });
+    }
+
+    // Applies an RFC 7386 merge patch to the stored value atomically. The
+    // key keeps its TTL.
+    string mergePatch(const string& key, const json& changes) {
+        return modify(key, [&changes](json current) {
+            current.merge_patch(changes);
+            return current;
+        });
+    }
+
+    string read(const string& key) {
+        string result;
+        KVStatus status = lookup(key, [&result](const ValueEntry& entry) {
+            result = entry.text();
+        });
+        if (status == KVStatus::Ok) return result;
+        return statusMessage(status);
+    }
+
+    // Zero-copy read. The handle shares the stored buffer in ValueMode::Bytes
+    // and stays valid after the key is overwritten or removed; in Json mode
+    // the value is serialized into a fresh buffer.
+    ReadResult readView(string_view key) {
+        ReadResult result;
+        result.status = lookup(key, [this, &result](const ValueEntry& entry) {
+            result.value = ValueHandle(entry.bytes && !entry.packed ? entry.bytes
+                                                                    : SharedBytes::copyOf(entry.text(), pooled()));
+        });
+        return result;
+    }
+
+    string remove(const string& key) {
+        auto started = metrics.start();
+        uint64_t lsn;
+        string result = removeKey(key, lsn);
+        log.commit(lsn);
+        metrics.finish(KVMetrics::REMOVE, started, failed(result) ? KVMetrics::REMOVE_MISSES : KVMetrics::REMOVES);
+        return result;
+    }
+
+    string batchCreate(const vector<pair<string, json>>& entries, time_t ttl = 0) {
+        auto started = metrics.start();
+        vector<PendingOp> ops;
+        ops.reserve(entries.size());
+        time_t expiry = ttl == 0 ? 0 : time(nullptr) + ttl;
+        for (const auto& [key, value] : entries) {
+            ops.push_back({BatchOp::Create, &key, &value, expiry, string(), ValueEntry()});
+        }
+        uint64_t lsn;
+        string error = applyBatch(ops, lsn);
+        log.commit(lsn);
+        if (error.empty()) {
+            metrics.finish(KVMetrics::BATCH_CREATE, started, KVMetrics::BATCH_KEYS, entries.size());
+            metrics.count(KVMetrics::BATCH_CREATES);
+        } else {
+            metrics.finish(KVMetrics::BATCH_CREATE, started, KVMetrics::BATCH_ERRORS);
+        }
+        return error.empty() ? "Batch create operation successful." : error;
+    }
+
+    // Removes every key or, if any of them is missing, none of them.
+    string batchRemove(const vector<string>& keys) {
+        vector<PendingOp> ops;
+        ops.reserve(keys.size());
+        for (const auto& key : keys) {
+            ops.push_back({BatchOp::Remove, &key, nullptr, 0, string(), ValueEntry()});
+        }
+        uint64_t lsn;
+        string error = applyBatch(ops, lsn);
+        log.commit(lsn);
+        return error.empty() ? "Batch remove operation successful." : error;
+    }
+
+    // Applies creates and removes in order as one atomic step: each item
+    // sees the effect of the ones before it, and if any item fails nothing
+    // is applied.
+    string batchWrite(const vector<BatchItem>& items) {
+        uint64_t lsn;
+        string result = writeItems(items, lsn);
+        log.commit(lsn);
+        return result;
+    }
+
+    // The *Async writes return at once and leave the work to a writer
+    // thread, started on first use. Writes queued from every thread are
+    // applied in the order they were queued, and each result is handed
+    // over only once the write is as durable as options.durability
+    // promises: through the future, or by calling onDone on the writer
+    // thread, which should not block. Results match the synchronous calls.
+    // A store without locking applies them before returning instead.
+    future<string> createAsync(const string& key, const json& value, time_t ttl = 0) {
+        auto write = make_unique<AsyncWrite>();
+        write->key = key;
+        write->value = value;
+        write->ttl = ttl;
+        return submit(move(write));
+    }
+
+    void createAsync(const string& key, const json& value, time_t ttl, function<void(const string&)> onDone) {
+        auto write = make_unique<AsyncWrite>();
+        write->key = key;
+        write->value = value;
+        write->ttl = ttl;
+        write->callback = move(onDone);
+        enqueue(move(write));
+    }
+
+    future<string> removeAsync(const string& key) {
+        auto write = make_unique<AsyncWrite>();
+        write->kind = AsyncWrite::REMOVE;
+        write->key = key;
+        return submit(move(write));
+    }
+
+    void removeAsync(const string& key, function<void(const string&)> onDone) {
+        auto write = make_unique<AsyncWrite>();
+        write->kind = AsyncWrite::REMOVE;
+        write->key = key;
+        write->callback = move(onDone);
+        enqueue(move(write));
+    }
+
+    // batchWrite() through the writer thread.
+    future<string> batchAsync(vector<BatchItem> items) {
+        auto write = make_unique<AsyncWrite>();
+        write->kind = AsyncWrite::BATCH;
+        write->items = move(items);
+        return submit(move(write));
+    }
+
+    void batchAsync(vector<BatchItem> items, function<void(const string&)> onDone) {
+        auto write = make_unique<AsyncWrite>();
+        write->kind = AsyncWrite::BATCH;
+        write->items = move(items);
+        write->callback = move(onDone);
+        enqueue(move(write));
+    }
+
+    // Reads many keys, taking each shard lock once for all of its keys.
+    // Results are in key order and match what read() would return.
+    vector<string> batchRead(const vector<string>& keys) {
+        vector<string> results(keys.size());
+        vector<pair<size_t, size_t>> order;
+        order.reserve(keys.size());
+        for (size_t i = 0; i < keys.size(); ++i) {
+            order.emplace_back(shardIndex(keys[i]), i);
+        }
+        sort(order.begin(), order.end());
+
+        vector<size_t> slow;
+        for (size_t begin = 0; begin < order.size();) {
+            size_t end = begin;
+            while (end < order.size() && order[end].first == order[begin].first) ++end;
+            Shard& shard = *shards[order[begin].first];
+            if (shard.index.lockFree()) {
+                for (size_t j = begin; j < end; ++j) slow.push_back(order[j].second);
+            } else {
+                auto lock = shared(shard, LockProfiler::BATCH_READ);
+                time_t now = time(nullptr);
+                for (size_t j = begin; j < end; ++j) {
+                    size_t i = order[j].second;
+                    const ValueEntry* entry = shard.index.find(keys[i]);
+                    if (!entry) {
+                        results[i] = statusMessage(KVStatus::NotFound);
+                    } else if (isExpired(*entry, now) || entry->cold) {
+                        slow.push_back(i);
+                    } else {
+                        entry->touch();
+                        results[i] = entry->text();
+                    }
+                }
+            }
+            begin = end;
+        }
+
+        // Lock-free shards, and entries that must expire or be decoded,
+        // go through the single-key path.
+        for (size_t i : slow) {
+            results[i] = read(keys[i]);
+        }
+        return results;
+    }
+};
+
+using KVDataStore = BasicKVDataStore<>;
+
+// Reads the image a KVDataStore opened with options.sharedReaders publishes,
+// from any process on the same machine. Lookups are a hash probe into
+// mapped memory with no lock and no system call; the reader checks the
+// owner's generation on every call and maps the newer image when there is
+// one. Values are as of the owner's last publish. Not thread-safe: give
+// each thread its own reader.
+class KVSharedReader {
+private:
+    string controlPath;
+    string imagePath;
+    int controlFd = -1;
+    const SharedImage::Control* control = nullptr;
+    const char* image = nullptr;
+    size_t imageSize = 0;
+    uint64_t generation = 0;
+    uint64_t slotMask = 0;
+
+    bool attach() {
+        controlFd = ::open(controlPath.c_str(), O_RDONLY | O_CLOEXEC);
+        if (controlFd < 0) return false;
+        struct stat st;
+        void* addr = MAP_FAILED;
+        if (::fstat(controlFd, &st) == 0 && static_cast<size_t>(st.st_size) >= sizeof(SharedImage::Control)) {
+            addr = ::mmap(nullptr, sizeof(SharedImage::Control), PROT_READ, MAP_SHARED, controlFd, 0);
+        }
+        if (addr == MAP_FAILED) {
+            detach();
+            return false;
+        }
+        control = static_cast<const SharedImage::Control*>(addr);
+        // A different control file may have restarted its generations.
+        generation = 0;
+        return true;
+    }
+
+    void detach() {
+        if (control) ::munmap(const_cast<SharedImage::Control*>(control), sizeof(SharedImage::Control));
+        if (controlFd >= 0) ::close(controlFd);
+        control = nullptr;
+        controlFd = -1;
+    }
+
+    void unmapImage() {
+        if (image) ::munmap(const_cast<char*>(image), imageSize);
+        image = nullptr;
+        imageSize = 0;
+    }
+
+    void mapImage() {
+        int fd = ::open(imagePath.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) return;
+        struct stat st;
+        void* addr = MAP_FAILED;
+        size_t size = 0;
+        if (::fstat(fd, &st) == 0 && static_cast<size_t>(st.st_size) >= SharedImage::HEADER_BYTES) {
+            size = static_cast<size_t>(st.st_size);
+            addr = ::mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+        }
+        ::close(fd);
+        if (addr == MAP_FAILED) return;
+        const char* data = static_cast<const char*>(addr);
+        uint64_t slots = BinarySnapshot::get<uint64_t>(data + 16);
+        if (memcmp(data, SharedImage::MAGIC, sizeof(SharedImage::MAGIC)) != 0 ||
+            BinarySnapshot::get<uint32_t>(data + 4) != SharedImage::VERSION ||
+            slots == 0 || (slots & (slots - 1)) != 0 ||
+            size < SharedImage::HEADER_BYTES + slots * SharedImage::SLOT_BYTES) {
+            ::munmap(addr, size);
+            return;
+        }
+        unmapImage();
+        image = data;
+        imageSize = size;
+        slotMask = slots - 1;
+        generation = BinarySnapshot::get<uint64_t>(data + 8);
+    }
+
+    void refresh() {
+        if (!control && !attach()) return;
+        if (control->ownerPid.load(memory_order_acquire) == 0) {
+            // The owner closed the store; a new one may have opened it since.
+            detach();
+            unmapImage();
+            if (!attach()) return;
+        }
+        if (!image || control->generation.load(memory_order_acquire) != generation) {
+            mapImage();
+        }
+    }
+
+public:
+    explicit KVSharedReader(const string& dataPath) {
+        string base = SharedImage::basePath(dataPath);
+        controlPath = base + ".ctl";
+        imagePath = base + ".img";
+        refresh();
+    }
+
+    ~KVSharedReader() {
+        unmapImage();
+        detach();
+    }
+
+    KVSharedReader(const KVSharedReader&) = delete;
+    KVSharedReader& operator=(const KVSharedReader&) = delete;
+
+    // True while an owner is publishing images for this datastore.
+    bool connected() {
+        refresh();
+        return image != nullptr;
+    }
+
+    // Points value at the key's JSON text inside the mapped image. It stays
+    // valid until the next call on this reader.
+    KVStatus find(string_view key, string_view& value) {
+        refresh();
+        if (!image) return KVStatus::NotFound;
+        uint64_t h = SharedImage::hashOf(key);
+        const char* slots = image + SharedImage::HEADER_BYTES;
+        for (uint64_t i = h & slotMask;; i = (i + 1) & slotMask) {
+            const char* slot = slots + i * SharedImage::SLOT_BYTES;
+            uint64_t slotHash = BinarySnapshot::get<uint64_t>(slot);
+            if (slotHash == 0) return KVStatus::NotFound;
+            if (slotHash != h) continue;
+            const char* entry = image + BinarySnapshot::get<uint64_t>(slot + 8);
+            size_t keyLen = static_cast<uint8_t>(entry[0]);
+            if (string_view(entry + 1, keyLen) != key) continue;
+            time_t expiry = static_cast<time_t>(BinarySnapshot::get<int64_t>(entry + 1 + keyLen));
+            if (expiry != 0 && time(nullptr) > expiry) return KVStatus::Expired;
+            uint32_t len = BinarySnapshot::get<uint32_t>(entry + 1 + keyLen + 8);
+            value = string_view(entry + 1 + keyLen + 12, len);
+            return KVStatus::Ok;
+        }
+    }
+
+    // Same results as KVDataStore::read(), as of the last published image.
+    string read(const string& key) {
+        string_view value;
+        KVStatus status = find(key, value);
+        if (!image) return "Error: Datastore is not open.";
+        return status == KVStatus::Ok ? string(value) : string(statusMessage(status));
+    }
+
+    uint64_t imageGeneration() const {
+        return generation;
+    }
+};
@@ -1,23 +1,72 @@
 #define DOCTEST_CONFIG_IMPLEMENT_WITH_MAIN
 #include "doctest.h"
 #include "kvstoe.hpp"
+#include "kvnet.hpp"
 #include <thread>
 #include <fstream>
 #include <chrono>
 #include <string>
 #include <vector>
+#include <filesystem>
+#include <atomic>
+#include <sstream>
 #include "json.hpp"
 
 using json = nlohmann::json;
 
+struct EmbeddedPolicy : SingleThreadedStorePolicy {
+    static constexpr size_t maxKeyLength = 8;
+    static constexpr size_t maxValueSize = 100;
+};
+
+struct MutexPolicy : DefaultStorePolicy {
+    using Locking = ExclusiveLocking;
+};
+
+// Stores on fresh files named <name><i>.json, each served on a free port,
+// for the cluster tests. The servers stop before the stores close.
+struct ClusterNodes {
+    std::vector<std::unique_ptr<KVDataStore>> stores;
+    std::vector<std::unique_ptr<KVServer>> servers;
+
+    ClusterNodes(const std::string& name, int count) {
+        for (int i = 0; i < count; ++i) {
+            std::string path = name + std::to_string(i) + ".json";
+            std::filesystem::remove(path);
+            std::filesystem::remove(path + ".log");
+            stores.push_back(std::make_unique<KVDataStore>(path));
+            servers.push_back(std::make_unique<KVServer>(*stores.back(), 0, 1, "127.0.0.1"));
+            servers.back()->start();
+        }
+    }
+
+    ~ClusterNodes() {
+        for (auto& server : servers) server->stop();
+    }
+
+    std::pair<std::string, uint16_t> endpoint(size_t i) const {
+        return {"127.0.0.1", servers[i]->port()};
+    }
+};
+
+// Stores an entry that expired a minute ago, as a replayed log record
+// would, so tests see expiry without waiting for it.
+static void putExpired(KVDataStore& kvStore, const std::string& key, const json& value) {
+    kvStore.applyReplicated({json{{"op", "create"}, {"key", key}, {"value", value}, {"ttl", time(nullptr) - 60}}});
+}
+
 TEST_SUITE("KVDataStore Tests") {
     TEST_CASE("Test Allow Only One Client Connection") {
-        KVDataStore kvStore("datastore.json");
+        std::filesystem::remove("legacy_client.json");
+        std::filesystem::remove("legacy_client.json.log");
+        KVDataStore kvStore("legacy_client.json");
         CHECK_NOTHROW(kvStore.create("key1", { {"name", "Client"} }));
     }
 
     TEST_CASE("Test TTL Checking") {
-        KVDataStore kvStore("datastore.json");
+        std::filesystem::remove("legacy_ttl.json");
+        std::filesystem::remove("legacy_ttl.json.log");
+        KVDataStore kvStore("legacy_ttl.json");
         kvStore.create("key1", { {"name", "Alice"} }, 2);
         std::this_thread::sleep_for(std::chrono::seconds(3));
         std::string result = kvStore.read("key1");
@@ -25,7 +74,9 @@ TEST_SUITE("KVDataStore Tests") {
     }
 
     TEST_CASE("Test Batch Creation") {
-        KVDataStore kvStore("datastore.json");
+        std::filesystem::remove("legacy_batch.json");
+        std::filesystem::remove("legacy_batch.json.log");
+        KVDataStore kvStore("legacy_batch.json");
         std::vector<std::pair<std::string, json>> batch = {
             {"key1", { {"name", "Alice"} }},
             {"key2", { {"name", "Bob"} }}
@@ -37,7 +88,9 @@ TEST_SUITE("KVDataStore Tests") {
     }
 
     TEST_CASE("Test Not Overwriting") {
-        KVDataStore kvStore("datastore.json");
+        std::filesystem::remove("legacy_overwrite.json");
+        std::filesystem::remove("legacy_overwrite.json.log");
+        KVDataStore kvStore("legacy_overwrite.json");
         kvStore.create("key1", { {"name", "Alice"} });
         std::string result = kvStore.create("key1", { {"name", "Bob"} });
         CHECK(result == "Error: Key already exists.");
@@ -45,22 +98,36 @@ TEST_SUITE("KVDataStore Tests") {
     }
 
     TEST_CASE("Test Load Existing File") {
-        KVDataStore kvStore("datastore.json");
-        kvStore.create("key1", { {"name", "Alice"} });
-        // Simulate reloading by creating a new instance
-        KVDataStore reloadedStore("datastore.json");
+        std::filesystem::remove("legacy_reload.json");
+        std::filesystem::remove("legacy_reload.json.log");
+        {
+            KVDataStore kvStore("legacy_reload.json");
+            kvStore.create("key1", { {"name", "Alice"} });
+        }
+        // Simulate reloading by creating a new instance once the first
+        // has closed; only one store may have the file open at a time.
+        KVDataStore reloadedStore("legacy_reload.json");
         CHECK(reloadedStore.read("key1") == "{\"name\":\"Alice\"}");
     }
 
     TEST_CASE("Test Concurrent Create and Read") {
-        KVDataStore kvStore("datastore.json");
+        std::filesystem::remove("legacy_concurrent.json");
+        std::filesystem::remove("legacy_concurrent.json.log");
+        KVDataStore kvStore("legacy_concurrent.json");
         std::thread writer([&]() {
             kvStore.create("key1", { {"name", "Alice"} });
         });
 
+        // Polls rather than sleeping: until the create lands the key is
+        // missing, and once it has the whole value is there. Bounded, so a
+        // create that fails fails the test rather than hanging it.
         std::thread reader([&]() {
-            std::this_thread::sleep_for(std::chrono::milliseconds(50));
-            CHECK(kvStore.read("key1") == "{\"name\":\"Alice\"}");
+            auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+            std::string result;
+            do {
+                result = kvStore.read("key1");
+            } while (result == "Error: Key not found." && std::chrono::steady_clock::now() < deadline);
+            CHECK(result == "{\"name\":\"Alice\"}");
         });
 
         writer.join();
@@ -68,9 +135,1565 @@ TEST_SUITE("KVDataStore Tests") {
     }
 
     TEST_CASE("Test Error Handling Duplicate Keys") {
-        KVDataStore kvStore("datastore.json");
+        std::filesystem::remove("legacy_duplicate.json");
+        std::filesystem::remove("legacy_duplicate.json.log");
+        KVDataStore kvStore("legacy_duplicate.json");
         kvStore.create("key1", { {"name", "Alice"} });
         std::string result = kvStore.create("key1", { {"name", "Duplicate"} });
         CHECK(result == "Error: Key already exists.");
     }
+
+    TEST_CASE("Test Log Replay After Crash") {
+        std::filesystem::remove("wal_test.json");
+        std::filesystem::remove("wal_test.json.log");
+        std::filesystem::remove("wal_crash.json");
+        std::filesystem::remove("wal_crash.json.log");
+
+        KVDataStore kvStore("wal_test.json");
+        kvStore.create("key1", { {"name", "Alice"} });
+        kvStore.create("key2", { {"name", "Bob"} });
+        kvStore.remove("key1");
+        kvStore.batchCreate({ {"key3", { {"name", "Carol"} }} });
+        CHECK(!std::filesystem::exists("wal_test.json"));
+
+        // Copy the log while the store is still open, as if the process died here.
+        std::filesystem::copy_file("wal_test.json.log", "wal_crash.json.log");
+        KVDataStore recovered("wal_crash.json");
+        CHECK(recovered.read("key1") == "Error: Key not found.");
+        CHECK(recovered.read("key2") == "{\"name\":\"Bob\"}");
+        CHECK(recovered.read("key3") == "{\"name\":\"Carol\"}");
+    }
+
+    TEST_CASE("Test Torn Log Tail Is Discarded") {
+        std::filesystem::remove("wal_torn.json");
+        std::filesystem::remove("wal_torn.json.log");
+        {
+            std::ofstream log("wal_torn.json.log");
+            log << "{\"op\":\"create\",\"key\":\"key1\",\"value\":{\"name\":\"Alice\"},\"ttl\":0}\n";
+            log << "{\"op\":\"create\",\"key\":\"key2\",\"val";
+        }
+        KVDataStore kvStore("wal_torn.json");
+        CHECK(kvStore.read("key1") == "{\"name\":\"Alice\"}");
+        CHECK(kvStore.read("key2") == "Error: Key not found.");
+        CHECK(kvStore.create("key2", { {"name", "Bob"} }) == "Key-value pair created successfully.");
+    }
+
+    TEST_CASE("Test Corrupt Log Record Is Not Truncated") {
+        std::filesystem::remove("wal_corrupt.json");
+        std::filesystem::remove("wal_corrupt.json.log");
+        {
+            std::ofstream log("wal_corrupt.json.log");
+            log << "{\"op\":\"create\",\"key\":\"key1\",\"value\":1,\"ttl\":0}\n";
+            log << "{\"op\":\"create\",\"key\":\"key2\",\"val\n";
+            log << "{\"op\":\"create\",\"key\":\"key3\",\"value\":3,\"ttl\":0}\n";
+        }
+        auto size = std::filesystem::file_size("wal_corrupt.json.log");
+        // Only a crash's unterminated last line may be cut off; a bad record
+        // with acknowledged ones after it fails the open instead.
+        CHECK_THROWS_AS(KVDataStore("wal_corrupt.json"), std::runtime_error);
+        CHECK(std::filesystem::file_size("wal_corrupt.json.log") == size);
+    }
+
+    TEST_CASE("Test Background Checkpoint Compacts Log") {
+        std::filesystem::remove("cp_test.json");
+        std::filesystem::remove("cp_test.json.log");
+        std::filesystem::remove("cp_crash.json");
+        std::filesystem::remove("cp_crash.json.log");
+
+        KVOptions options;
+        options.checkpointLogRecords = 3;
+        options.checkpointInterval = std::chrono::milliseconds(10);
+        KVDataStore kvStore("cp_test.json", options);
+        kvStore.create("key1", { {"name", "Alice"} });
+        kvStore.create("key2", { {"name", "Bob"} });
+        kvStore.create("key3", { {"name", "Carol"} });
+
+        for (int i = 0; i < 200 && !std::filesystem::exists("cp_test.json"); ++i) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+        REQUIRE(std::filesystem::exists("cp_test.json"));
+        kvStore.remove("key2");
+
+        std::filesystem::copy_file("cp_test.json", "cp_crash.json");
+        std::filesystem::copy_file("cp_test.json.log", "cp_crash.json.log");
+        KVDataStore recovered("cp_crash.json");
+        CHECK(recovered.read("key1") == "{\"name\":\"Alice\"}");
+        CHECK(recovered.read("key2") == "Error: Key not found.");
+        CHECK(recovered.read("key3") == "{\"name\":\"Carol\"}");
+    }
+
+    TEST_CASE("Test Manual Checkpoint Truncates Log") {
+        std::filesystem::remove("cp_manual.json");
+        std::filesystem::remove("cp_manual.json.log");
+
+        KVDataStore kvStore("cp_manual.json");
+        kvStore.create("key1", { {"name", "Alice"} });
+        CHECK(std::filesystem::file_size("cp_manual.json.log") > 0);
+        kvStore.checkpoint();
+        CHECK(std::filesystem::file_size("cp_manual.json.log") == 0);
+        CHECK(!std::filesystem::exists("cp_manual.json.log.1"));
+        CHECK(kvStore.read("key1") == "{\"name\":\"Alice\"}");
+    }
+
+    TEST_CASE("Test Group Commit Durability") {
+        std::filesystem::remove("gc_test.json");
+        std::filesystem::remove("gc_test.json.log");
+        std::filesystem::remove("gc_crash.json");
+        std::filesystem::remove("gc_crash.json.log");
+
+        KVOptions options;
+        options.durability = Durability::GroupCommit;
+        KVDataStore kvStore("gc_test.json", options);
+
+        std::vector<std::thread> writers;
+        for (int t = 0; t < 4; ++t) {
+            writers.emplace_back([&kvStore, t]() {
+                for (int i = 0; i < 25; ++i) {
+                    std::string key = "key" + std::to_string(t) + "_" + std::to_string(i);
+                    kvStore.create(key, { {"n", i} });
+                }
+            });
+        }
+        for (auto& writer : writers) writer.join();
+
+        // Every create has returned, so every record must already be in the log.
+        std::filesystem::copy_file("gc_test.json.log", "gc_crash.json.log");
+        KVDataStore recovered("gc_crash.json");
+        for (int t = 0; t < 4; ++t) {
+            for (int i = 0; i < 25; ++i) {
+                std::string key = "key" + std::to_string(t) + "_" + std::to_string(i);
+                CHECK(recovered.read(key) == "{\"n\":" + std::to_string(i) + "}");
+            }
+        }
+    }
+
+    TEST_CASE("Test Periodic Durability") {
+        std::filesystem::remove("periodic_test.json");
+        std::filesystem::remove("periodic_test.json.log");
+
+        KVOptions options;
+        options.durability = Durability::Periodic;
+        options.fsyncInterval = std::chrono::milliseconds(5);
+        {
+            KVDataStore kvStore("periodic_test.json", options);
+            CHECK(kvStore.create("key1", { {"name", "Alice"} }) == "Key-value pair created successfully.");
+            std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        }
+        KVDataStore reloaded("periodic_test.json", options);
+        CHECK(reloaded.read("key1") == "{\"name\":\"Alice\"}");
+    }
+
+    TEST_CASE("Test Binary Snapshot Round Trip") {
+        std::filesystem::remove("bin_test.json");
+        std::filesystem::remove("bin_test.json.log");
+
+        KVOptions options;
+        options.snapshotFormat = SnapshotFormat::Binary;
+        {
+            KVDataStore kvStore("bin_test.json", options);
+            for (int i = 0; i < 3000; ++i) {
+                kvStore.create("key" + std::to_string(i), { {"n", i}, {"tags", {"a", "b"}} });
+            }
+            kvStore.create("ttl", { {"name", "Alice"} }, 3600);
+        }
+
+        std::ifstream raw("bin_test.json", std::ios::binary);
+        char magic[4] = {};
+        raw.read(magic, 4);
+        CHECK(std::string(magic, 4) == "KVSB");
+
+        KVDataStore reloaded("bin_test.json", options);
+        CHECK(reloaded.read("key0") == "{\"n\":0,\"tags\":[\"a\",\"b\"]}");
+        CHECK(reloaded.read("key2999") == "{\"n\":2999,\"tags\":[\"a\",\"b\"]}");
+        CHECK(reloaded.read("ttl") == "{\"name\":\"Alice\"}");
+    }
+
+    TEST_CASE("Test Binary Snapshot Detects Corruption") {
+        std::filesystem::remove("bin_corrupt.json");
+        std::filesystem::remove("bin_corrupt.json.log");
+
+        KVOptions options;
+        options.snapshotFormat = SnapshotFormat::Binary;
+        {
+            KVDataStore kvStore("bin_corrupt.json", options);
+            kvStore.create("key1", { {"name", "Alice"} });
+        }
+        {
+            std::fstream file("bin_corrupt.json", std::ios::in | std::ios::out | std::ios::binary);
+            file.seekp(30);
+            file.put('X');
+        }
+        CHECK_THROWS(KVDataStore("bin_corrupt.json", options));
+    }
+
+    TEST_CASE("Test Json Snapshot Converts To Binary") {
+        std::filesystem::remove("convert_test.json");
+        std::filesystem::remove("convert_test.json.log");
+        {
+            KVDataStore kvStore("convert_test.json");
+            kvStore.create("key1", { {"name", "Alice"} });
+        }
+        KVOptions options;
+        options.snapshotFormat = SnapshotFormat::Binary;
+        {
+            KVDataStore kvStore("convert_test.json", options);
+            CHECK(kvStore.read("key1") == "{\"name\":\"Alice\"}");
+        }
+        KVDataStore reloaded("convert_test.json");
+        CHECK(reloaded.read("key1") == "{\"name\":\"Alice\"}");
+    }
+
+    TEST_CASE("Test Lazy Load Decodes On Read") {
+        std::filesystem::remove("lazy_test.json");
+        std::filesystem::remove("lazy_test.json.log");
+
+        KVOptions options;
+        options.snapshotFormat = SnapshotFormat::Binary;
+        {
+            KVDataStore kvStore("lazy_test.json", options);
+            for (int i = 0; i < 2000; ++i) {
+                kvStore.create("key" + std::to_string(i), { {"n", i} });
+            }
+        }
+
+        options.lazyLoad = true;
+        {
+            KVDataStore lazy("lazy_test.json", options);
+            CHECK(lazy.read("key7") == "{\"n\":7}");
+            lazy.create("fresh", { {"name", "Alice"} });
+            // Untouched values are carried into the new snapshot undecoded.
+            lazy.checkpoint();
+        }
+        KVDataStore reloaded("lazy_test.json", options);
+        CHECK(reloaded.read("key1999") == "{\"n\":1999}");
+        CHECK(reloaded.read("fresh") == "{\"name\":\"Alice\"}");
+    }
+
+    TEST_CASE("Test Lazy Load Verifies Checksum On First Read") {
+        std::filesystem::remove("lazy_corrupt.json");
+        std::filesystem::remove("lazy_corrupt.json.log");
+
+        KVOptions options;
+        options.snapshotFormat = SnapshotFormat::Binary;
+        {
+            KVDataStore kvStore("lazy_corrupt.json", options);
+            kvStore.create("key1", { {"name", "Alice"} });
+        }
+        {
+            // Flip a byte inside the CBOR value, leaving the key intact.
+            std::fstream file("lazy_corrupt.json", std::ios::in | std::ios::out | std::ios::binary);
+            file.seekp(-20, std::ios::end);
+            file.put('X');
+        }
+        options.lazyLoad = true;
+        options.snapshotFormat = SnapshotFormat::Json;
+        KVDataStore lazy("lazy_corrupt.json", options);
+        CHECK_THROWS(lazy.read("key1"));
+        lazy.remove("key1");
+    }
+
+    TEST_CASE("Test Sharded Concurrent Writers And Readers") {
+        std::filesystem::remove("shard_test.json");
+        std::filesystem::remove("shard_test.json.log");
+
+        KVOptions options;
+        options.shardCount = 8;
+        KVDataStore kvStore("shard_test.json", options);
+
+        std::vector<std::thread> threads;
+        for (int t = 0; t < 4; ++t) {
+            threads.emplace_back([&kvStore, t]() {
+                std::vector<std::pair<std::string, json>> batch;
+                for (int i = 0; i < 50; ++i) {
+                    batch.push_back({ "b" + std::to_string(t) + "_" + std::to_string(i), { {"n", i} } });
+                }
+                CHECK(kvStore.batchCreate(batch) == "Batch create operation successful.");
+                for (int i = 0; i < 50; ++i) {
+                    std::string key = "k" + std::to_string(t) + "_" + std::to_string(i);
+                    CHECK(kvStore.create(key, { {"n", i} }) == "Key-value pair created successfully.");
+                    CHECK(kvStore.read(key) == "{\"n\":" + std::to_string(i) + "}");
+                }
+            });
+        }
+        for (auto& thread : threads) thread.join();
+
+        for (int t = 0; t < 4; ++t) {
+            CHECK(kvStore.read("b" + std::to_string(t) + "_49") == "{\"n\":49}");
+            CHECK(kvStore.remove("k" + std::to_string(t) + "_0") == "Key-value pair deleted successfully.");
+        }
+    }
+
+    TEST_CASE("Test Lock Free Reads") {
+        std::filesystem::remove("rcu_test.json");
+        std::filesystem::remove("rcu_test.json.log");
+
+        KVOptions options;
+        options.lockFreeReads = true;
+        options.shardCount = 4;
+        {
+            KVDataStore kvStore("rcu_test.json", options);
+            for (int i = 0; i < 500; ++i) {
+                kvStore.create("key" + std::to_string(i), { {"n", i} });
+            }
+
+            std::atomic<bool> done{false};
+            std::vector<std::thread> readers;
+            for (int t = 0; t < 3; ++t) {
+                readers.emplace_back([&]() {
+                    while (!done.load()) {
+                        for (int i = 0; i < 500; i += 7) {
+                            std::string result = kvStore.read("key" + std::to_string(i));
+                            CHECK((result == "{\"n\":" + std::to_string(i) + "}" || result == "Error: Key not found."));
+                        }
+                    }
+                });
+            }
+            // Grow the tables and churn entries while the readers run.
+            for (int i = 500; i < 3000; ++i) {
+                kvStore.create("key" + std::to_string(i), { {"n", i} });
+            }
+            for (int i = 0; i < 500; i += 2) {
+                kvStore.remove("key" + std::to_string(i));
+                kvStore.create("key" + std::to_string(i), { {"n", i} });
+            }
+            done = true;
+            for (auto& reader : readers) reader.join();
+
+            kvStore.create("short", { {"name", "Alice"} }, 1);
+            std::this_thread::sleep_for(std::chrono::milliseconds(2100));
+            CHECK(kvStore.read("short") == "Error: Key has expired.");
+            CHECK(kvStore.create("short", { {"name", "Bob"} }) == "Key-value pair created successfully.");
+        }
+        KVDataStore reloaded("rcu_test.json", options);
+        CHECK(reloaded.read("key2999") == "{\"n\":2999}");
+        CHECK(reloaded.read("short") == "{\"name\":\"Bob\"}");
+    }
+
+    TEST_CASE("Test Background Expiry Uses TTL Index") {
+        std::filesystem::remove("ttl_index.json");
+        std::filesystem::remove("ttl_index.json.log");
+
+        KVOptions options;
+        options.expiryInterval = std::chrono::milliseconds(50);
+        options.expiryGrace = std::chrono::seconds(0);
+        KVDataStore kvStore("ttl_index.json", options);
+        for (int i = 0; i < 100; ++i) {
+            kvStore.create("short" + std::to_string(i), { {"n", i} }, 1);
+            kvStore.create("long" + std::to_string(i), { {"n", i} });
+        }
+        // A rewritten key leaves a stale heap entry that must not expire it.
+        kvStore.remove("short0");
+        kvStore.create("short0", { {"n", 0} });
+
+        std::this_thread::sleep_for(std::chrono::milliseconds(2500));
+
+        std::ifstream log("ttl_index.json.log");
+        std::string line;
+        int expired = 0;
+        while (std::getline(log, line)) {
+            if (line.find("\"op\":\"expire\"") != std::string::npos) ++expired;
+        }
+        CHECK(expired == 99);
+        CHECK(kvStore.read("short0") == "{\"n\":0}");
+        CHECK(kvStore.read("short1") == "Error: Key not found.");
+        CHECK(kvStore.read("long1") == "{\"n\":1}");
+    }
+
+    TEST_CASE("Test Bytes Value Mode") {
+        for (auto format : { SnapshotFormat::Json, SnapshotFormat::Binary }) {
+            std::filesystem::remove("bytes_test.json");
+            std::filesystem::remove("bytes_test.json.log");
+
+            KVOptions options;
+            options.valueMode = ValueMode::Bytes;
+            options.snapshotFormat = format;
+            {
+                KVDataStore kvStore("bytes_test.json", options);
+                CHECK(kvStore.create("key1", { {"name", "Alice"}, {"age", 30} }) == "Key-value pair created successfully.");
+                CHECK(kvStore.batchCreate({ {"key2", { {"name", "Bob"} }}, {"key3", json::array({1, 2})} }) == "Batch create operation successful.");
+                CHECK(kvStore.read("key1") == "{\"age\":30,\"name\":\"Alice\"}");
+                CHECK(kvStore.read("key3") == "[1,2]");
+            }
+            {
+                KVOptions lazyOptions = options;
+                lazyOptions.lazyLoad = true;
+                KVDataStore lazy("bytes_test.json", lazyOptions);
+                CHECK(lazy.read("key3") == "[1,2]");
+            }
+            // Reopen with the tree representation to check the files are interchangeable.
+            KVDataStore reloaded("bytes_test.json");
+            CHECK(reloaded.read("key1") == "{\"age\":30,\"name\":\"Alice\"}");
+            CHECK(reloaded.read("key2") == "{\"name\":\"Bob\"}");
+        }
+    }
+
+    TEST_CASE("Test Zero Copy Read View") {
+        std::filesystem::remove("view_test.json");
+        std::filesystem::remove("view_test.json.log");
+
+        KVOptions options;
+        options.valueMode = ValueMode::Bytes;
+        KVDataStore kvStore("view_test.json", options);
+        kvStore.create("key1", { {"name", "Alice"} });
+        kvStore.create("short", { {"name", "Bob"} }, 1);
+
+        std::string_view key = "key1";
+        ReadResult first = kvStore.readView(key);
+        ReadResult second = kvStore.readView(key);
+        REQUIRE(first.ok());
+        CHECK(first.value.view() == "{\"name\":\"Alice\"}");
+        CHECK(first.value.data() == second.value.data());
+
+        kvStore.remove("key1");
+        CHECK(first.value.view() == "{\"name\":\"Alice\"}");
+        CHECK(kvStore.readView(key).status == KVStatus::NotFound);
+
+        std::this_thread::sleep_for(std::chrono::milliseconds(2100));
+        CHECK(kvStore.readView("short").status == KVStatus::Expired);
+        CHECK(std::string(statusMessage(KVStatus::Expired)) == "Error: Key has expired.");
+    }
+    TEST_CASE("Test Pooled Allocation Reuses Memory") {
+        std::filesystem::remove("pool_test.json");
+        std::filesystem::remove("pool_test.json.log");
+
+        KVOptions options;
+        options.allocation = AllocationMode::Pooled;
+        options.valueMode = ValueMode::Bytes;
+        {
+            KVDataStore kvStore("pool_test.json", options);
+            auto key = [](int i) { return "pooled-key-" + std::to_string(i) + std::string(16, 'x'); };
+            for (int i = 0; i < 2000; ++i) {
+                REQUIRE(kvStore.create(key(i), { {"n", i} }) == "Key-value pair created successfully.");
+            }
+            MemoryUsage before = kvStore.memoryUsage();
+            CHECK(before.indexSlabBytes > 0);
+            CHECK(before.valueArenaBytes > 0);
+
+            // Churn the same number of keys: freed blocks are reused, so no
+            // new slabs are taken.
+            for (int i = 0; i < 1000; ++i) {
+                kvStore.remove(key(i));
+            }
+            for (int i = 0; i < 1000; ++i) {
+                kvStore.create(key(i), { {"n", -i} });
+            }
+            MemoryUsage after = kvStore.memoryUsage();
+            CHECK(after.indexSlabBytes == before.indexSlabBytes);
+            CHECK(after.valueArenaBytes == before.valueArenaBytes);
+
+            CHECK(kvStore.read(key(5)) == "{\"n\":-5}");
+            CHECK(kvStore.read(key(1500)) == "{\"n\":1500}");
+            CHECK(kvStore.create(std::string(33, 'k'), 1) == "Error: Key length exceeds 32 characters.");
+        }
+        KVDataStore reloaded("pool_test.json", options);
+        CHECK(reloaded.read("pooled-key-7xxxxxxxxxxxxxxxx") == "{\"n\":-7}");
+    }
+    TEST_CASE("Test Flat Index Backend") {
+        std::filesystem::remove("flat_test.json");
+        std::filesystem::remove("flat_test.json.log");
+
+        KVOptions options;
+        options.indexBackend = IndexBackend::Flat;
+        options.shardCount = 4;
+        {
+            KVDataStore kvStore("flat_test.json", options);
+            for (int i = 0; i < 20000; ++i) {
+                REQUIRE(kvStore.create("flat" + std::to_string(i), i) == "Key-value pair created successfully.");
+            }
+            // Deleting and reinserting leaves tombstones that later inserts
+            // and rehashes have to cope with.
+            for (int round = 0; round < 3; ++round) {
+                for (int i = 0; i < 20000; i += 2) {
+                    REQUIRE(kvStore.remove("flat" + std::to_string(i)) == "Key-value pair deleted successfully.");
+                }
+                for (int i = 0; i < 20000; i += 2) {
+                    kvStore.create("flat" + std::to_string(i), i + round);
+                }
+            }
+            for (int i = 0; i < 20000; i += 997) {
+                CHECK(kvStore.read("flat" + std::to_string(i)) == std::to_string(i % 2 == 0 ? i + 2 : i));
+            }
+            CHECK(kvStore.read("missing") == "Error: Key not found.");
+            CHECK(kvStore.create("flat1", 0) == "Error: Key already exists.");
+        }
+        KVDataStore reloaded("flat_test.json", options);
+        CHECK(reloaded.read("flat19999") == "19999");
+        CHECK(reloaded.read("flat0") == "2");
+    }
+    TEST_CASE("Test Batch Read Remove And Mixed Writes") {
+        std::filesystem::remove("batch_test.json");
+        std::filesystem::remove("batch_test.json.log");
+        std::filesystem::remove("batch_crash.json");
+        std::filesystem::remove("batch_crash.json.log");
+
+        KVDataStore kvStore("batch_test.json");
+        std::vector<std::pair<std::string, json>> entries;
+        for (int i = 0; i < 1000; ++i) {
+            entries.push_back({ "bulk" + std::to_string(i), i });
+        }
+        CHECK(kvStore.batchCreate(entries) == "Batch create operation successful.");
+        CHECK(kvStore.batchCreate({ {"dup", 1}, {"dup", 2} }) == "Error: Duplicate key found in batch.");
+        CHECK(kvStore.read("dup") == "Error: Key not found.");
+
+        std::vector<std::string> reads = kvStore.batchRead({ "bulk7", "missing", "bulk999" });
+        CHECK(reads == std::vector<std::string>{ "7", "Error: Key not found.", "999" });
+
+        // All or nothing: one missing key leaves the others in place.
+        CHECK(kvStore.batchRemove({ "bulk1", "missing" }) == "Error: One or more keys not found.");
+        CHECK(kvStore.read("bulk1") == "1");
+        CHECK(kvStore.batchRemove({ "bulk1", "bulk2" }) == "Batch remove operation successful.");
+        CHECK(kvStore.read("bulk2") == "Error: Key not found.");
+
+        // Later items see earlier ones.
+        std::vector<BatchItem> items = {
+            { BatchOp::Remove, "bulk3", nullptr, 0 },
+            { BatchOp::Create, "bulk3", { {"again", true} }, 0 },
+            { BatchOp::Create, "fresh", "new", 0 },
+        };
+        CHECK(kvStore.batchWrite(items) == "Batch operation successful.");
+        CHECK(kvStore.batchWrite({ { BatchOp::Remove, "fresh", nullptr, 0 }, { BatchOp::Remove, "fresh", nullptr, 0 } }) ==
+              "Error: One or more keys not found.");
+        CHECK(kvStore.read("fresh") == "\"new\"");
+
+        std::filesystem::copy_file("batch_test.json.log", "batch_crash.json.log");
+        KVDataStore recovered("batch_crash.json");
+        CHECK(recovered.batchRead({ "bulk1", "bulk3", "fresh", "bulk500" }) ==
+              std::vector<std::string>{ "Error: Key not found.", "{\"again\":true}", "\"new\"", "500" });
+    }
+    TEST_CASE("Test Update Upsert And Patch") {
+        for (auto mode : { ValueMode::Json, ValueMode::Bytes }) {
+            std::filesystem::remove("patch_test.json");
+            std::filesystem::remove("patch_test.json.log");
+            std::filesystem::remove("patch_crash.json");
+            std::filesystem::remove("patch_crash.json.log");
+
+            KVOptions options;
+            options.valueMode = mode;
+            KVDataStore kvStore("patch_test.json", options);
+            CHECK(kvStore.update("user", { {"name", "Alice"} }) == "Error: Key not found.");
+            CHECK(kvStore.upsert("user", { {"name", "Alice"}, {"visits", 1} }) == "Key-value pair created successfully.");
+            CHECK(kvStore.upsert("user", { {"name", "Alice"}, {"visits", 2} }) == "Key-value pair updated successfully.");
+            CHECK(kvStore.update("counter", 0) == "Error: Key not found.");
+            kvStore.create("counter", 0, 3600);
+
+            json ops = json::array({ { {"op", "replace"}, {"path", "/visits"}, {"value", 3} },
+                                     { {"op", "add"}, {"path", "/tags"}, {"value", json::array({"new"})} } });
+            CHECK(kvStore.patch("user", ops) == "Key-value pair patched successfully.");
+            CHECK(kvStore.mergePatch("user", { {"name", "Alicia"}, {"tags", nullptr} }) == "Key-value pair patched successfully.");
+            CHECK(kvStore.read("user") == "{\"name\":\"Alicia\",\"visits\":3}");
+
+            json bad = json::array({ { {"op", "remove"}, {"path", "/missing"} } });
+            CHECK(kvStore.patch("user", bad).rfind("Error: Patch failed:", 0) == 0);
+            CHECK(kvStore.read("user") == "{\"name\":\"Alicia\",\"visits\":3}");
+            CHECK(kvStore.patch("nobody", ops) == "Error: Key not found.");
+            CHECK(kvStore.update("counter", 1) == "Key-value pair updated successfully.");
+
+            // A new value keeps the key's expiry unless a ttl is given, and a
+            // ttl of 0 clears it.
+            time_t expiry = kvStore.scan("counter", 1).expiries.at(0);
+            CHECK(expiry != 0);
+            CHECK(kvStore.upsert("counter", 1) == "Key-value pair updated successfully.");
+            CHECK(kvStore.scan("counter", 1).expiries.at(0) == expiry);
+            CHECK(kvStore.update("user", { {"name", "Alicia"}, {"visits", 3} }, 0) == "Key-value pair updated successfully.");
+            CHECK(kvStore.scan("user", 1).expiries.at(0) == 0);
+
+            std::filesystem::copy_file("patch_test.json.log", "patch_crash.json.log");
+            KVDataStore recovered("patch_crash.json", options);
+            CHECK(recovered.read("user") == "{\"name\":\"Alicia\",\"visits\":3}");
+            CHECK(recovered.read("counter") == "1");
+        }
+    }
+    TEST_CASE("Test Memory Budget Evicts Cold Keys") {
+        std::filesystem::remove("lru_test.json");
+        std::filesystem::remove("lru_test.json.log");
+        std::filesystem::remove("lru_crash.json");
+        std::filesystem::remove("lru_crash.json.log");
+
+        KVOptions options;
+        options.memoryBudget = 64 * 1024;
+        options.shardCount = 4;
+        KVDataStore kvStore("lru_test.json", options);
+        kvStore.create("hot", "keep me");
+        std::string filler(200, 'x');
+        for (int i = 0; i < 2000; ++i) {
+            REQUIRE(kvStore.create("cold" + std::to_string(i), filler) == "Key-value pair created successfully.");
+            CHECK(kvStore.read("hot") == "\"keep me\"");
+        }
+
+        EvictionStats stats = kvStore.evictionStats();
+        CHECK(stats.evictions > 1000);
+        CHECK(stats.usedBytes <= options.memoryBudget);
+        CHECK(kvStore.read("cold0") == "Error: Key not found.");
+        CHECK(kvStore.read("cold1999") == "\"" + filler + "\"");
+
+        // Evictions are logged, so recovery ends up with the same keys.
+        std::filesystem::copy_file("lru_test.json.log", "lru_crash.json.log");
+        KVDataStore recovered("lru_crash.json", options);
+        CHECK(recovered.read("hot") == "\"keep me\"");
+        CHECK(recovered.read("cold0") == "Error: Key not found.");
+        CHECK(recovered.evictionStats().usedBytes == stats.usedBytes);
+    }
+    TEST_CASE("Test Tiered Storage Spills Cold Values") {
+        std::filesystem::remove("tier_test.json");
+        std::filesystem::remove("tier_test.json.log");
+
+        KVOptions options;
+        // Keys and entry headers always stay in memory, so the budget has to
+        // cover them; only the values can go to disk.
+        options.memoryBudget = 512 * 1024;
+        options.overflow = OverflowPolicy::Spill;
+        options.shardCount = 4;
+        std::string filler(200, 'y');
+        {
+            KVDataStore kvStore("tier_test.json", options);
+            for (int i = 0; i < 3000; ++i) {
+                REQUIRE(kvStore.create("tier" + std::to_string(i), filler + std::to_string(i)) ==
+                        "Key-value pair created successfully.");
+            }
+            EvictionStats stats = kvStore.evictionStats();
+            CHECK(stats.evictions == 0);
+            CHECK(stats.spills > 1000);
+            CHECK(stats.usedBytes <= options.memoryBudget);
+
+            // Every key is still there; reading a spilled value brings it back.
+            for (int i = 0; i < 3000; i += 7) {
+                CHECK(kvStore.read("tier" + std::to_string(i)) == "\"" + filler + std::to_string(i) + "\"");
+            }
+            CHECK(kvStore.evictionStats().usedBytes <= options.memoryBudget);
+            CHECK(kvStore.update("tier0", "rewritten") == "Key-value pair updated successfully.");
+            CHECK(!std::filesystem::exists("tier_test.json.spill.0"));
+        }
+        KVDataStore reloaded("tier_test.json", options);
+        CHECK(reloaded.read("tier0") == "\"rewritten\"");
+        CHECK(reloaded.read("tier2999") == "\"" + filler + "2999\"");
+        CHECK(reloaded.evictionStats().usedBytes <= options.memoryBudget);
+    }
+    TEST_CASE("Test Prefix And Range Scan") {
+        for (bool ordered : { true, false }) {
+            std::filesystem::remove("scan_test.json");
+            std::filesystem::remove("scan_test.json.log");
+
+            KVOptions options;
+            options.orderedIndex = ordered;
+            KVDataStore kvStore("scan_test.json", options);
+            for (int i = 0; i < 10; ++i) {
+                kvStore.create("user:123:" + std::to_string(i), i);
+                kvStore.create("user:124:" + std::to_string(i), i);
+            }
+            kvStore.create("user:12", "short");
+            kvStore.remove("user:123:4");
+
+            std::vector<std::string> keys;
+            std::string cursor;
+            int pages = 0;
+            do {
+                ScanResult page = kvStore.scan("user:123:", 4, cursor);
+                CHECK(page.entries.size() <= 4);
+                for (const auto& [key, value] : page.entries) keys.push_back(key);
+                cursor = page.cursor;
+                ++pages;
+                if (!page.more) break;
+            } while (pages < 10);
+            CHECK(pages == 3);
+            CHECK(keys == std::vector<std::string>{ "user:123:0", "user:123:1", "user:123:2", "user:123:3",
+                                                    "user:123:5", "user:123:6", "user:123:7", "user:123:8",
+                                                    "user:123:9" });
+
+            ScanResult range = kvStore.scanRange("user:123:8", "user:124:2", 10);
+            REQUIRE(range.entries.size() == 4);
+            CHECK(range.entries[0] == std::make_pair(std::string("user:123:8"), std::string("8")));
+            CHECK(range.entries[3].first == "user:124:1");
+            CHECK(!range.more);
+            CHECK(kvStore.scan("nobody:", 10).entries.empty());
+        }
+    }
+
+    TEST_CASE("Test Network Server Pipelining") {
+        std::filesystem::remove("net_test.json");
+        std::filesystem::remove("net_test.json.log");
+
+        KVDataStore kvStore("net_test.json");
+        KVServer server(kvStore, 0, 2, "127.0.0.1");
+        server.start();
+        REQUIRE(server.port() != 0);
+
+        KVClient client("127.0.0.1", server.port());
+        std::vector<json> requests;
+        for (int i = 0; i < 100; ++i) {
+            requests.push_back({ {"op", "create"}, {"key", "net" + std::to_string(i)}, {"value", {{"n", i}}} });
+        }
+        requests.push_back({ {"op", "read"}, {"key", "net7"} });
+        requests.push_back({ {"op", "batch_read"}, {"keys", {"net1", "missing"}} });
+        requests.push_back({ {"op", "remove"}, {"key", "net7"} });
+        requests.push_back({ {"op", "read"}, {"key", "net7"} });
+        requests.push_back({ {"op", "frobnicate"} });
+        requests.push_back({ {"op", "create"}, {"value", 1} });
+        requests.push_back({ {"op", "ping"} });
+
+        std::vector<json> responses = client.pipeline(requests);
+        REQUIRE(responses.size() == requests.size());
+        for (size_t i = 0; i < responses.size(); ++i) {
+            CHECK(responses[i]["id"] == i + 1);
+        }
+        CHECK(responses[0]["ok"] == true);
+        CHECK(responses[100]["result"] == json({ {"n", 7} }));
+        CHECK(responses[101]["result"] == json::array({ {{"n", 1}}, nullptr }));
+        CHECK(responses[102]["result"] == "Key-value pair deleted successfully.");
+        CHECK(responses[103]["ok"] == false);
+        CHECK(responses[104]["error"] == "Error: Unknown operation.");
+        CHECK(responses[105]["ok"] == false);
+        CHECK(responses[106]["result"] == "pong");
+
+        // Connections are independent and may land on either loop.
+        KVClient other("127.0.0.1", server.port());
+        CHECK(other.call({ {"op", "batch"}, {"items", {{{"op", "create"}, {"key", "b"}, {"value", 2}}}} })["ok"] == true);
+        CHECK(kvStore.read("b") == "2");
+        server.stop();
+    }
+
+    TEST_CASE("Test Single Writer Lock And Shared Readers") {
+        std::filesystem::remove("shm_test.json");
+        std::filesystem::remove("shm_test.json.log");
+
+        KVOptions options;
+        options.sharedReaders = true;
+        options.sharedPublishInterval = std::chrono::milliseconds(10);
+        {
+            KVDataStore kvStore("shm_test.json", options);
+            CHECK_THROWS_AS(KVDataStore("shm_test.json"), std::runtime_error);
+
+            KVSharedReader reader("shm_test.json");
+            CHECK(reader.connected());
+            CHECK(reader.read("key1") == "Error: Key not found.");
+
+            kvStore.create("key1", { {"name", "Alice"} });
+            kvStore.create("key2", 42);
+            for (int i = 0; i < 200 && reader.read("key2") != "42"; ++i) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            }
+            CHECK(reader.read("key1") == "{\"name\":\"Alice\"}");
+            CHECK(reader.read("key2") == "42");
+
+            uint64_t generation = reader.imageGeneration();
+            kvStore.remove("key1");
+            for (int i = 0; i < 200 && reader.read("key1") != "Error: Key not found."; ++i) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            }
+            CHECK(reader.read("key1") == "Error: Key not found.");
+            CHECK(reader.imageGeneration() > generation);
+
+            std::string_view value;
+            CHECK(reader.find("key2", value) == KVStatus::Ok);
+            CHECK(value == "42");
+
+            // Only the shard written is encoded again; the parts kept from
+            // the last image still land at the right offsets.
+            for (int i = 0; i < 100; ++i) {
+                kvStore.create("many" + std::to_string(i), i);
+            }
+            for (int i = 0; i < 200 && reader.read("many99") != "99"; ++i) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            }
+            kvStore.upsert("many7", 700);
+            for (int i = 0; i < 200 && reader.read("many7") != "700"; ++i) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            }
+            CHECK(reader.read("many7") == "700");
+            for (int i = 0; i < 100; ++i) {
+                if (i != 7) CHECK(reader.read("many" + std::to_string(i)) == std::to_string(i));
+            }
+            CHECK(reader.read("key2") == "42");
+        }
+
+        KVSharedReader late("shm_test.json");
+        CHECK(!late.connected());
+        CHECK(late.read("key2") == "Error: Datastore is not open.");
+
+        // The lock is released with the store.
+        KVDataStore reopened("shm_test.json", options);
+        CHECK(reopened.read("key2") == "42");
+        CHECK(late.read("key2") == "42");
+    }
+
+    TEST_CASE("Test Stats And Metrics") {
+        std::filesystem::remove("stats_test.json");
+        std::filesystem::remove("stats_test.json.log");
+
+        KVOptions options;
+        options.expiryInterval = std::chrono::milliseconds(50);
+        options.expiryGrace = std::chrono::seconds(0);
+        KVDataStore kvStore("stats_test.json", options);
+        kvStore.create("key1", 1);
+        kvStore.create("key1", 2);
+        kvStore.create("short", 3, 1);
+        kvStore.batchCreate({ {"b1", 1}, {"b2", 2} });
+        kvStore.batchCreate({ {"b1", 1} });
+        kvStore.remove("b2");
+        kvStore.remove("b2");
+
+        std::vector<std::thread> readers;
+        for (int t = 0; t < 4; ++t) {
+            readers.emplace_back([&kvStore]() {
+                for (int i = 0; i < 250; ++i) {
+                    kvStore.read("key1");
+                    kvStore.read("missing");
+                }
+            });
+        }
+        for (auto& reader : readers) reader.join();
+        std::this_thread::sleep_for(std::chrono::milliseconds(2500));
+        kvStore.checkpoint();
+
+        KVStats stats = kvStore.stats();
+        CHECK(stats[KVMetrics::READ_HITS] == 1000);
+        CHECK(stats[KVMetrics::READ_MISSES] == 1000);
+        CHECK(stats[KVMetrics::CREATES] == 2);
+        CHECK(stats[KVMetrics::CREATE_ERRORS] == 1);
+        CHECK(stats[KVMetrics::BATCH_CREATES] == 1);
+        CHECK(stats[KVMetrics::BATCH_ERRORS] == 1);
+        CHECK(stats[KVMetrics::BATCH_KEYS] == 2);
+        CHECK(stats[KVMetrics::REMOVES] == 1);
+        CHECK(stats[KVMetrics::REMOVE_MISSES] == 1);
+        CHECK(stats[KVMetrics::EXPIRATIONS] == 1);
+        CHECK(stats[KVMetrics::CLEANUP_RUNS] > 0);
+        CHECK(stats[KVMetrics::SNAPSHOTS] == 1);
+        CHECK(stats[KVMetrics::SNAPSHOT_BYTES] == std::filesystem::file_size("stats_test.json"));
+        CHECK(stats.keys == 2);
+
+        const LatencySummary& reads = stats.latency(KVMetrics::READ);
+        CHECK(reads.count == 2000);
+        CHECK(reads.p50Us > 0);
+        CHECK(reads.p50Us <= reads.p99Us);
+        CHECK(reads.p99Us <= reads.p999Us);
+        CHECK(reads.p999Us <= reads.maxUs);
+
+        std::string text = kvStore.metricsText();
+        CHECK(text.find("kvstore_reads_total{result=\"hit\"} 1000\n") != std::string::npos);
+        CHECK(text.find("kvstore_duration_seconds_count{op=\"read\"} 2000\n") != std::string::npos);
+        CHECK(text.find("# TYPE kvstore_keys gauge\nkvstore_keys 2\n") != std::string::npos);
+
+        KVOptions quiet;
+        quiet.metrics = false;
+        std::filesystem::remove("stats_off.json");
+        std::filesystem::remove("stats_off.json.log");
+        KVDataStore off("stats_off.json", quiet);
+        off.create("key1", 1);
+        off.read("key1");
+        CHECK(off.stats()[KVMetrics::CREATES] == 0);
+        CHECK(off.stats().latency(KVMetrics::READ).count == 0);
+    }
+
+    TEST_CASE("Test Lock Contention Profile") {
+        std::filesystem::remove("lockprof_test.json");
+        std::filesystem::remove("lockprof_test.json.log");
+
+        KVOptions options;
+        options.lockProfiling = true;
+        options.shardCount = 1;
+        KVDataStore kvStore("lockprof_test.json", options);
+        for (int i = 0; i < 100; ++i) kvStore.create("key" + std::to_string(i), i);
+
+        std::atomic<bool> stop{false};
+        std::thread checkpointer([&]() {
+            while (!stop) {
+                kvStore.create("churn", 1);
+                kvStore.remove("churn");
+                kvStore.checkpoint();
+            }
+        });
+        std::vector<std::thread> readers;
+        for (int t = 0; t < 4; ++t) {
+            readers.emplace_back([&kvStore]() {
+                for (int i = 0; i < 2000; ++i) kvStore.read("key" + std::to_string(i % 100));
+            });
+        }
+        for (auto& reader : readers) reader.join();
+        stop = true;
+        checkpointer.join();
+
+        std::vector<LockSiteStats> profile = kvStore.lockProfile();
+        auto find = [&profile](const std::string& site) {
+            for (const auto& s : profile) if (site == s.site) return s;
+            return LockSiteStats();
+        };
+        CHECK(find("read").acquisitions == 8000);
+        CHECK(find("create").acquisitions >= 101);
+        CHECK(find("remove").acquisitions >= 1);
+        CHECK(find("checkpoint").acquisitions >= 1);
+        CHECK(find("read").hold.count == 8000);
+        CHECK(find("read").contended <= find("read").acquisitions);
+        CHECK(find("scan").acquisitions == 0);
+        for (size_t i = 1; i < profile.size(); ++i) {
+            CHECK(profile[i - 1].totalWaitUs >= profile[i].totalWaitUs);
+        }
+        CHECK(kvStore.metricsText().find("kvstore_lock_acquisitions_total{site=\"read\"} 8000\n") != std::string::npos);
+
+        std::filesystem::remove("lockprof_off.json");
+        std::filesystem::remove("lockprof_off.json.log");
+        KVDataStore plain("lockprof_off.json");
+        plain.create("key1", 1);
+        CHECK(plain.lockProfile().empty());
+    }
+
+    TEST_CASE("Test Async Writes") {
+        std::filesystem::remove("async_test.json");
+        std::filesystem::remove("async_test.json.log");
+        {
+            KVOptions options;
+            options.durability = Durability::GroupCommit;
+            KVDataStore kvStore("async_test.json", options);
+
+            std::vector<std::thread> producers;
+            std::vector<std::vector<std::future<std::string>>> results(4);
+            for (int t = 0; t < 4; ++t) {
+                producers.emplace_back([&kvStore, &results, t]() {
+                    for (int i = 0; i < 100; ++i) {
+                        results[t].push_back(kvStore.createAsync("t" + std::to_string(t) + "-" + std::to_string(i), i));
+                    }
+                });
+            }
+            for (auto& producer : producers) producer.join();
+            for (auto& futures : results) {
+                for (auto& result : futures) CHECK(result.get() == "Key-value pair created successfully.");
+            }
+            CHECK(kvStore.read("t3-99") == "99");
+
+            // Writes from one thread apply in the order they were queued.
+            auto created = kvStore.createAsync("ordered", 1);
+            auto duplicate = kvStore.createAsync("ordered", 2);
+            auto removed = kvStore.removeAsync("ordered");
+            auto missing = kvStore.removeAsync("ordered");
+            CHECK(created.get() == "Key-value pair created successfully.");
+            CHECK(duplicate.get() == "Error: Key already exists.");
+            CHECK(removed.get() == "Key-value pair deleted successfully.");
+            CHECK(missing.get() == "Error: Key not found.");
+
+            std::promise<std::string> done;
+            BatchItem first;
+            first.key = "b1";
+            first.value = 1;
+            BatchItem second;
+            second.op = BatchOp::Remove;
+            second.key = "t0-0";
+            kvStore.batchAsync({ first, second }, [&done](const std::string& result) { done.set_value(result); });
+            CHECK(done.get_future().get() == "Batch operation successful.");
+            CHECK(kvStore.read("b1") == "1");
+            CHECK(kvStore.read("t0-0") == "Error: Key not found.");
+
+            // Still queued when the store closes: applied before it does.
+            for (int i = 0; i < 50; ++i) {
+                kvStore.createAsync("late" + std::to_string(i), i, 0, [](const std::string&) {});
+            }
+        }
+        KVDataStore reloaded("async_test.json");
+        CHECK(reloaded.read("late49") == "49");
+        CHECK(reloaded.read("t1-50") == "50");
+    }
+
+    TEST_CASE("Test Log Shipping Replication") {
+        for (const char* base : {"repl_leader.json", "repl_follower.json"}) {
+            std::filesystem::remove(base);
+            std::filesystem::remove(std::string(base) + ".log");
+        }
+        KVOptions leaderOptions;
+        leaderOptions.replicationBacklog = 1 << 20;
+        KVDataStore leader("repl_leader.json", leaderOptions);
+        leader.create("before", 1);
+        KVLeader shipper(leader, 0, "127.0.0.1");
+        shipper.start();
+
+        {
+            KVDataStore replica("repl_follower.json");
+            KVFollower follower(replica, "127.0.0.1", shipper.port(), ReadConsistency::ReadYourWrites);
+            follower.start();
+
+            // A new follower starts with a full copy, then follows the log.
+            leader.create("a", json{{"n", 1}});
+            CHECK(follower.read("a", leader.logPosition()) == "{\"n\":1}");
+            CHECK(follower.read("before") == "1");
+            leader.remove("a");
+            leader.batchCreate({{"b1", 1}, {"b2", 2}});
+            LogPosition position = leader.logPosition();
+            CHECK(follower.read("a", position) == "Error: Key not found.");
+            CHECK(follower.read("b2", position) == "2");
+            CHECK(follower.status().resyncs == 1);
+            CHECK(follower.status().applied.lsn == position.lsn);
+
+            // A position the follower can never reach times out.
+            CHECK_FALSE(follower.waitFor({position.epoch + 1, 1}, std::chrono::milliseconds(50)));
+
+            // Served over the network, the follower is read-only and reads
+            // wait for the position a client got from the leader.
+            KVServer server(replica, 0, 1, "127.0.0.1", &follower);
+            server.start();
+            KVClient client("127.0.0.1", server.port());
+            json refused = client.call({{"op", "create"}, {"key", "x"}, {"value", 1}});
+            CHECK(refused["error"] == "Error: Replica is read-only.");
+            leader.create("c", 3);
+            position = leader.logPosition();
+            json read = client.call({{"op", "read"}, {"key", "c"},
+                                     {"after", {{"epoch", position.epoch}, {"lsn", position.lsn}}}});
+            CHECK(read["result"] == 3);
+            server.stop();
+            follower.stop();
+        }
+
+        // Changes made while the follower was away, removals included,
+        // reach it when it comes back.
+        leader.remove("b1");
+        leader.create("d", 4);
+        KVDataStore replica("repl_follower.json");
+        CHECK(replica.read("b1") == "1");
+        KVFollower follower(replica, "127.0.0.1", shipper.port(), ReadConsistency::ReadYourWrites);
+        follower.start();
+        LogPosition position = leader.logPosition();
+        CHECK(follower.read("d", position) == "4");
+        CHECK(follower.read("b1", position) == "Error: Key not found.");
+        CHECK(follower.read("c", position) == "3");
+        CHECK(follower.status().connected);
+        follower.stop();
+        shipper.stop();
+    }
+
+    TEST_CASE("Test Waiting Replica Reads Do Not Stall The Event Loop") {
+        for (const char* base : {"park_leader.json", "park_follower.json"}) {
+            std::filesystem::remove(base);
+            std::filesystem::remove(std::string(base) + ".log");
+        }
+        KVOptions leaderOptions;
+        leaderOptions.replicationBacklog = 1 << 20;
+        KVDataStore leader("park_leader.json", leaderOptions);
+        leader.create("a", 1);
+        KVLeader shipper(leader, 0, "127.0.0.1");
+        shipper.start();
+
+        KVDataStore replica("park_follower.json");
+        KVFollower follower(replica, "127.0.0.1", shipper.port(), ReadConsistency::ReadYourWrites,
+                            std::chrono::milliseconds(2000));
+        follower.start();
+        LogPosition position = leader.logPosition();
+        REQUIRE(follower.waitFor(position, std::chrono::milliseconds(5000)));
+
+        // One loop, so every connection shares the thread a waiting read
+        // used to block.
+        KVServer server(replica, 0, 1, "127.0.0.1", &follower);
+        server.start();
+        KVClient stalled("127.0.0.1", server.port());
+        KVClient other("127.0.0.1", server.port());
+        json ahead = {{"epoch", position.epoch}, {"lsn", position.lsn + 1000}};
+        auto started = std::chrono::steady_clock::now();
+        stalled.send({{"id", 1}, {"op", "read"}, {"key", "a"}, {"after", ahead}});
+        stalled.send({{"id", 2}, {"op", "ping"}});
+        for (int i = 0; i < 5; ++i) {
+            CHECK(other.call({{"op", "read"}, {"key", "a"}})["result"] == 1);
+        }
+        // A position from another leader fails at once.
+        json stale = other.call({{"op", "read"}, {"key", "a"}, {"after", {{"epoch", position.epoch + 1}, {"lsn", 1}}}});
+        CHECK(stale["error"] == "Error: Replica is behind the leader.");
+        CHECK(std::chrono::steady_clock::now() - started < std::chrono::milliseconds(1000));
+
+        // The parked read times out, and the request behind it follows.
+        json late = stalled.receive();
+        CHECK(late["id"] == 1);
+        CHECK(late["error"] == "Error: Replica is behind the leader.");
+        CHECK(std::chrono::steady_clock::now() - started >= std::chrono::milliseconds(2000));
+        CHECK(stalled.receive()["result"] == "pong");
+
+        // A read parked for a write yet to be replicated is answered once
+        // the follower applies it.
+        json next = {{"epoch", position.epoch}, {"lsn", position.lsn + 1}};
+        stalled.send({{"id", 3}, {"op", "read"}, {"key", "b"}, {"after", next}});
+        leader.create("b", 2);
+        json woken = stalled.receive();
+        CHECK(woken["id"] == 3);
+        CHECK(woken["result"] == 2);
+
+        server.stop();
+        follower.stop();
+        shipper.stop();
+    }
+
+    TEST_CASE("Test Resync Copy Taken While The Leader Is Written") {
+        for (const char* base : {"resync_leader.json", "resync_follower.json"}) {
+            std::filesystem::remove(base);
+            std::filesystem::remove(std::string(base) + ".log");
+        }
+        KVOptions leaderOptions;
+        leaderOptions.replicationBacklog = 64 << 20;
+        KVDataStore leader("resync_leader.json", leaderOptions);
+        for (int i = 0; i < 20000; ++i) {
+            leader.create("k" + std::to_string(i), i);
+        }
+        KVLeader shipper(leader, 0, "127.0.0.1");
+        shipper.start();
+
+        // Writes keep landing on shards already copied and on shards not
+        // yet reached; the log replayed after the copy reconciles both.
+        std::atomic<bool> writing{true};
+        std::thread writer([&]() {
+            for (int round = 1; writing; ++round) {
+                for (int i = round % 7; i < 20000; i += 97) {
+                    std::string key = "k" + std::to_string(i);
+                    if (i % 3 == 0) {
+                        leader.remove(key);
+                    } else {
+                        leader.upsert(key, round);
+                    }
+                }
+            }
+        });
+
+        KVDataStore replica("resync_follower.json");
+        KVFollower follower(replica, "127.0.0.1", shipper.port(), ReadConsistency::ReadYourWrites);
+        follower.start();
+        CHECK(follower.waitFor(leader.logPosition(), std::chrono::milliseconds(10000)));
+        writing = false;
+        writer.join();
+
+        LogPosition position = leader.logPosition();
+        REQUIRE(follower.waitFor(position, std::chrono::milliseconds(10000)));
+        for (int i = 0; i < 20000; ++i) {
+            std::string key = "k" + std::to_string(i);
+            CHECK(replica.read(key) == leader.read(key));
+        }
+        CHECK(follower.status().resyncs == 1);
+        follower.stop();
+        shipper.stop();
+    }
+
+    TEST_CASE("Test Consistent Hash Cluster") {
+        ClusterNodes nodes("cluster_node", 3);
+        auto& stores = nodes.stores;
+        auto& servers = nodes.servers;
+        KVCluster cluster({nodes.endpoint(0), nodes.endpoint(1)});
+        std::vector<std::pair<std::string, json>> entries;
+        std::vector<std::string> keys;
+        for (int i = 0; i < 300; ++i) {
+            keys.push_back("user" + std::to_string(i));
+            if (i < 200) {
+                CHECK(cluster.create(keys.back(), i) == "Key-value pair created successfully.");
+            } else {
+                entries.emplace_back(keys.back(), i);
+            }
+        }
+        CHECK(cluster.batchCreate(entries) == "Batch create operation successful.");
+        CHECK(cluster.create("user7", 0) == "Error: Key already exists.");
+        CHECK(stores[0]->stats().keys + stores[1]->stats().keys == 300);
+        CHECK(stores[0]->stats().keys > 100);
+        CHECK(stores[1]->stats().keys > 100);
+        CHECK(stores[cluster.nodeFor("user42")]->read("user42") == "42");
+
+        // A joining node takes its share while every key stays readable.
+        cluster.addNode("127.0.0.1", servers[2]->port());
+        CHECK(cluster.read("user250") == "250");
+        CHECK(cluster.rebalanceStep(50));
+        CHECK(cluster.remove("user1") == "Key-value pair deleted successfully.");
+        CHECK(cluster.create("user1", 1) == "Key-value pair created successfully.");
+        std::vector<std::string> values = cluster.batchRead(keys);
+        for (int i = 0; i < 300; ++i) CHECK(values[i] == std::to_string(i));
+        cluster.rebalance();
+        CHECK_FALSE(cluster.rebalancing());
+
+        size_t moved = stores[2]->stats().keys;
+        CHECK(moved > 50);
+        CHECK(moved < 150);
+        CHECK(stores[0]->stats().keys + stores[1]->stats().keys + moved == 300);
+        for (int i = 0; i < 300; ++i) {
+            CHECK(stores[cluster.nodeFor(keys[i])]->read(keys[i]) == std::to_string(i));
+        }
+        CHECK(cluster.batchRead({"user5", "missing"})[1] == "Error: Key not found.");
+        CHECK(cluster.remove("missing") == "Error: Key not found.");
+    }
+
+    TEST_CASE("Test Cluster Rebalance Keeps TTLs") {
+        ClusterNodes nodes("cluster_ttl", 2);
+        KVCluster cluster({nodes.endpoint(0)});
+        time_t expiry = time(nullptr) + 3600;
+        for (int i = 0; i < 40; ++i) {
+            CHECK(cluster.create("timed" + std::to_string(i), i, 3600) == "Key-value pair created successfully.");
+            CHECK(cluster.create("kept" + std::to_string(i), i) == "Key-value pair created successfully.");
+            putExpired(*nodes.stores[0], "due" + std::to_string(i), i);
+        }
+        cluster.addNode("127.0.0.1", nodes.servers[1]->port());
+        cluster.rebalance();
+
+        // Moved keys keep their expiry time; keys already due are dropped
+        // rather than moved.
+        ScanResult moved = nodes.stores[1]->scan("", 1000);
+        size_t movedTimed = 0;
+        for (size_t i = 0; i < moved.entries.size(); ++i) {
+            const std::string& key = moved.entries[i].first;
+            CHECK(key.compare(0, 3, "due") != 0);
+            if (key.compare(0, 5, "timed") == 0) {
+                ++movedTimed;
+                CHECK(moved.expiries[i] >= expiry - 1);
+                CHECK(moved.expiries[i] <= expiry + 1);
+            } else {
+                CHECK(moved.expiries[i] == 0);
+            }
+        }
+        CHECK(movedTimed > 0);
+        for (int i = 0; i < 40; ++i) {
+            std::string key = "due" + std::to_string(i);
+            CHECK(nodes.stores[1]->read(key) == "Error: Key not found.");
+        }
+    }
+
+    TEST_CASE("Test Cluster Rebalance Keeps Keys A Node Refuses") {
+        ClusterNodes nodes("cluster_refuse", 1);
+        KVCluster cluster({nodes.endpoint(0)});
+        for (int i = 0; i < 40; ++i) cluster.create("key" + std::to_string(i), i);
+
+        // A replica's server refuses every write, so no key can move to it.
+        std::filesystem::remove("cluster_refuse_replica.json");
+        std::filesystem::remove("cluster_refuse_replica.json.log");
+        KVDataStore replica("cluster_refuse_replica.json");
+        KVFollower follower(replica, "127.0.0.1", 1);
+        KVServer refusing(replica, 0, 1, "127.0.0.1", &follower);
+        refusing.start();
+        cluster.addNode("127.0.0.1", refusing.port());
+        CHECK_THROWS_WITH(cluster.rebalanceStep(), "Rebalancing failed: Error: Replica is read-only.");
+        CHECK(nodes.stores[0]->stats().keys == 40);
+        for (int i = 0; i < 40; ++i) CHECK(cluster.read("key" + std::to_string(i)) == std::to_string(i));
+        refusing.stop();
+    }
+
+    TEST_CASE("Test Cluster Batch Create Is All Or Nothing") {
+        ClusterNodes nodes("cluster_batch", 3);
+        KVCluster cluster({nodes.endpoint(0), nodes.endpoint(1)});
+        CHECK(cluster.create("taken", 0) == "Key-value pair created successfully.");
+        std::vector<std::pair<std::string, json>> entries = {{"taken", 1}};
+        for (int i = 0; i < 20; ++i) entries.emplace_back("new" + std::to_string(i), i);
+        CHECK(cluster.batchCreate(entries) == "Error: Duplicate key found in batch.");
+        CHECK(nodes.stores[0]->stats().keys + nodes.stores[1]->stats().keys == 1);
+        CHECK(cluster.read("taken") == "0");
+        entries.erase(entries.begin());
+        CHECK(cluster.batchCreate(entries) == "Batch create operation successful.");
+        CHECK(nodes.stores[0]->stats().keys + nodes.stores[1]->stats().keys == 21);
+
+        // Mid-rebalance, a key that expired on its new node can be created again.
+        cluster.addNode("127.0.0.1", nodes.servers[2]->port());
+        std::string key;
+        for (int i = 0; key.empty(); ++i) {
+            if (cluster.nodeFor("late" + std::to_string(i)) == 2) key = "late" + std::to_string(i);
+        }
+        putExpired(*nodes.stores[2], key, 1);
+        CHECK(cluster.read(key) == "Error: Key has expired.");
+        CHECK(cluster.rebalancing());
+        CHECK(cluster.create(key, 2) == "Key-value pair created successfully.");
+        CHECK(cluster.batchCreate({{key, 3}}) == "Error: Duplicate key found in batch.");
+    }
+
+    TEST_CASE("Test Value Compression") {
+        std::filesystem::remove("compress_test.json");
+        std::filesystem::remove("compress_test.json.log");
+        json doc = json::array();
+        for (int i = 0; i < 60; ++i) {
+            doc.push_back({{"id", i}, {"status", "active"}, {"region", "eu-west-1"}, {"tags", {"alpha", "beta"}}});
+        }
+        KVOptions options;
+        options.compression = Compression::Deflate;
+        options.compressionThreshold = 256;
+        options.snapshotFormat = SnapshotFormat::Binary;
+        {
+            KVDataStore kvStore("compress_test.json", options);
+            CHECK(kvStore.create("big", doc) == "Key-value pair created successfully.");
+            CHECK(kvStore.create("small", json{{"id", 1}}) == "Key-value pair created successfully.");
+            CHECK(kvStore.batchCreate({{"big2", doc}}) == "Batch create operation successful.");
+            CHECK(kvStore.read("big") == doc.dump());
+            CHECK(kvStore.read("small") == "{\"id\":1}");
+            CHECK(kvStore.patch("big2", json::parse(R"([{"op": "replace", "path": "/0/id", "value": 99}])")) ==
+                  "Key-value pair patched successfully.");
+            CHECK(kvStore.read("big2").find("\"id\":99") != std::string::npos);
+
+            KVStats stats = kvStore.stats();
+            CHECK(stats[KVMetrics::COMPRESSED_VALUES] == 3);
+            CHECK(stats.compressionRatio() > 5);
+            CHECK(kvStore.metricsText().find("kvstore_compressed_values_total 3") != std::string::npos);
+
+            std::ifstream logFile("compress_test.json.log");
+            std::string logText((std::istreambuf_iterator<char>(logFile)), std::istreambuf_iterator<char>());
+            CHECK(logText.find("\"packed\"") != std::string::npos);
+            CHECK(logText.find("eu-west-1") == std::string::npos);
+        }
+        {
+            // Replayed from the log, then saved packed in the binary snapshot.
+            KVDataStore kvStore("compress_test.json", options);
+            CHECK(kvStore.read("big") == doc.dump());
+        }
+        CHECK(std::filesystem::file_size("compress_test.json") < doc.dump().size());
+        {
+            KVOptions lazy = options;
+            lazy.lazyLoad = true;
+            lazy.valueMode = ValueMode::Bytes;
+            KVDataStore kvStore("compress_test.json", lazy);
+            CHECK(kvStore.read("big") == doc.dump());
+            ReadResult view = kvStore.readView("big");
+            CHECK(std::string(view.value.data(), view.value.size()) == doc.dump());
+            CHECK(kvStore.read("small") == "{\"id\":1}");
+        }
+
+        // A dictionary trained on similar documents lets small ones shrink.
+        std::vector<std::string> samples;
+        for (int i = 0; i < 50; ++i) {
+            samples.push_back(json{{"user", "u" + std::to_string(i)}, {"status", "active"},
+                                   {"region", "eu-west-1"}, {"plan", "enterprise"}}.dump());
+        }
+        std::string dictionary = ValueCompression::trainDictionary(samples);
+        CHECK(!dictionary.empty());
+        std::string small = json{{"user", "u77"}, {"status", "active"}, {"region", "eu-west-1"},
+                                 {"plan", "enterprise"}}.dump();
+        CHECK(ValueCompression::pack(small, 1, "").empty());
+        std::string packed = ValueCompression::pack(small, 1, dictionary);
+        REQUIRE(!packed.empty());
+        CHECK(packed.size() * 3 < small.size() * 2);
+        ValueCompression::addDictionary(dictionary);
+        CHECK(ValueCompression::unpack(packed) == small);
+        // A length prefix past the caller's limit or the stream is refused unread.
+        CHECK_THROWS_WITH(ValueCompression::unpack(packed, small.size() - 1), "Compressed value is corrupt.");
+        std::string forged = packed;
+        forged.replace(0, 4, "\xff\xff\xff\x7f");
+        CHECK_THROWS_WITH(ValueCompression::unpack(forged), "Compressed value is corrupt.");
+
+        std::filesystem::remove("compress_dict.json");
+        std::filesystem::remove("compress_dict.json.log");
+        KVOptions dictOptions;
+        dictOptions.compression = Compression::Deflate;
+        dictOptions.compressionThreshold = 32;
+        dictOptions.compressionDictionary = dictionary;
+        KVDataStore kvStore("compress_dict.json", dictOptions);
+        kvStore.create("u77", json::parse(small));
+        CHECK(kvStore.stats()[KVMetrics::COMPRESSED_VALUES] == 1);
+        CHECK(kvStore.read("u77") == small);
+    }
+
+    TEST_CASE("Test Parallel Snapshot Load And Save") {
+        for (const char* path : {"parallel_snap.json", "parallel_snap1.json"}) {
+            std::filesystem::remove(path);
+            std::filesystem::remove(std::string(path) + ".log");
+        }
+        KVOptions options;
+        options.snapshotFormat = SnapshotFormat::Binary;
+        options.shardCount = 8;
+        options.checkpointLogBytes = 0;
+        options.snapshotThreads = 4;
+        KVOptions serial = options;
+        serial.snapshotThreads = 1;
+        for (const auto& [path, opts] : {std::make_pair("parallel_snap.json", options),
+                                         std::make_pair("parallel_snap1.json", serial)}) {
+            KVDataStore kvStore(path, opts);
+            for (int i = 0; i < 5000; ++i) {
+                kvStore.create("key" + std::to_string(i), json{{"n", i}, {"pad", std::string(40, 'x')}});
+            }
+        }
+        // Shards are encoded apart but written in order, so the thread
+        // count does not change the file.
+        std::ifstream a("parallel_snap.json", std::ios::binary);
+        std::ifstream b("parallel_snap1.json", std::ios::binary);
+        std::string parallelImage((std::istreambuf_iterator<char>(a)), std::istreambuf_iterator<char>());
+        std::string serialImage((std::istreambuf_iterator<char>(b)), std::istreambuf_iterator<char>());
+        CHECK(parallelImage == serialImage);
+        CHECK(parallelImage.size() > 4 * BinarySnapshot::BLOCK_TARGET_BYTES);
+
+        for (ValueMode mode : {ValueMode::Json, ValueMode::Bytes}) {
+            KVOptions reopen = options;
+            reopen.valueMode = mode;
+            KVDataStore kvStore("parallel_snap.json", reopen);
+            CHECK(kvStore.stats().keys == 5000);
+            CHECK(kvStore.read("key0") == json{{"n", 0}, {"pad", std::string(40, 'x')}}.dump());
+            CHECK(kvStore.read("key4999") == json{{"n", 4999}, {"pad", std::string(40, 'x')}}.dump());
+        }
+
+        // A damaged block fails the load from whichever thread decodes it.
+        std::fstream file("parallel_snap.json", std::ios::in | std::ios::out | std::ios::binary);
+        file.seekp(static_cast<std::streamoff>(parallelImage.size() / 2));
+        file.put(static_cast<char>(parallelImage[parallelImage.size() / 2] ^ 0x55));
+        file.close();
+        CHECK_THROWS_WITH(KVDataStore("parallel_snap.json", options), "Binary snapshot block checksum mismatch.");
+    }
+    TEST_CASE("Test Policy Configured Store") {
+        std::filesystem::remove("policy_store.json");
+        std::filesystem::remove("policy_store.json.log");
+        KVOptions options;
+        options.checkpointLogRecords = 10;
+        {
+            BasicKVDataStore<EmbeddedPolicy> kvStore("policy_store.json", options);
+            CHECK(kvStore.create("toolongkey", json{{"a", 1}}) == "Error: Key length exceeds 8 characters.");
+            CHECK(kvStore.create("big", json(std::string(200, 'x'))) == "Error: Value size exceeds 100 bytes.");
+            for (int i = 0; i < 20; ++i) {
+                CHECK(kvStore.create("key" + std::to_string(i), json{{"n", i}}) == "Key-value pair created successfully.");
+            }
+            // Without locking there is no writer thread; the result is ready.
+            std::future<std::string> pending = kvStore.createAsync("async", json{{"n", -1}});
+            CHECK(pending.wait_for(std::chrono::seconds(0)) == std::future_status::ready);
+            CHECK(pending.get() == "Key-value pair created successfully.");
+
+            // Nor a checkpoint worker: runMaintenance() folds the log instead.
+            CHECK(kvStore.stats().logBytes > 0);
+            kvStore.runMaintenance();
+            CHECK(kvStore.stats().logBytes == 0);
+        }
+
+        // The files are the same whichever policy wrote them.
+        BasicKVDataStore<MutexPolicy> kvStore("policy_store.json");
+        CHECK(kvStore.stats().keys == 21);
+        CHECK(kvStore.read("async") == json{{"n", -1}}.dump());
+        std::vector<std::thread> readers;
+        std::atomic<int> found{0};
+        for (int t = 0; t < 4; ++t) {
+            readers.emplace_back([&]() {
+                for (int i = 0; i < 20; ++i) {
+                    if (kvStore.read("key" + std::to_string(i)) == json{{"n", i}}.dump()) ++found;
+                }
+            });
+        }
+        for (auto& reader : readers) reader.join();
+        CHECK(found == 80);
+    }
+    TEST_CASE("Test Streaming Import And Export") {
+        for (const char* path : {"import.json", "import_copy.json", "import_again.json"}) {
+            std::filesystem::remove(path);
+            std::filesystem::remove(std::string(path) + ".log");
+        }
+        time_t later = time(nullptr) + 3600;
+        std::stringstream input;
+        input << R"({"key":"plain","value":{"name":"Alice","tags":["a",{"b":[1,2.5,null,true]}]},"ttl":0})" << "\n"
+              << R"({"ttl":)" << later << R"(,"value":[1,2,3],"key":"timed"})" << "\n"
+              << R"({"key":"scalar","value":"text"})" << "\n\n"
+              << R"({"key":"gone","value":1,"ttl":1})" << "\n"
+              << R"({"key":")" << std::string(40, 'k') << R"(","value":1})" << "\n";
+        for (int i = 0; i < 5000; ++i) {
+            input << R"({"key":"bulk)" << i << R"(","value":{"n":)" << i << "}}\n";
+        }
+
+        KVOptions options;
+        options.shardCount = 4;
+        std::string binary;
+        {
+            KVDataStore kvStore("import.json", options);
+            ImportStats stats = kvStore.importRecords(input, RecordFormat::Ndjson);
+            CHECK(stats.imported == 5003);
+            CHECK(stats.skipped == 2);
+            CHECK(kvStore.read("plain") == R"({"name":"Alice","tags":["a",{"b":[1,2.5,null,true]}]})");
+            CHECK(kvStore.read("scalar") == R"("text")");
+            CHECK(kvStore.read("bulk4999") == R"({"n":4999})");
+            // Saved as one snapshot, not logged key by key: the log only
+            // holds the marker written after it.
+            CHECK(kvStore.stats().logBytes > 0);
+            CHECK(kvStore.stats().logBytes < 64);
+
+            std::stringstream out;
+            CHECK(kvStore.exportRecords(out, RecordFormat::Binary) == 5003);
+            binary = out.str();
+        }
+        {
+            KVDataStore kvStore("import.json", options);
+            CHECK(kvStore.stats().keys == 5003);
+            CHECK(kvStore.read("timed") == "[1,2,3]");
+        }
+
+        // Binary into a byte-mode store, back out as a snapshot, and that
+        // loaded again: nothing changes on the way.
+        KVOptions bytes = options;
+        bytes.valueMode = ValueMode::Bytes;
+        KVDataStore copy("import_copy.json", bytes);
+        std::stringstream binaryIn(binary);
+        CHECK(copy.importRecords(binaryIn, RecordFormat::Binary).imported == 5003);
+        std::stringstream snapshot;
+        CHECK(copy.exportRecords(snapshot, RecordFormat::Snapshot) == 5003);
+        KVDataStore again("import_again.json", options);
+        CHECK(again.importRecords(snapshot, RecordFormat::Snapshot).imported == 5003);
+        std::stringstream first, second;
+        copy.exportRecords(first, RecordFormat::Ndjson);
+        again.exportRecords(second, RecordFormat::Ndjson);
+        std::vector<std::string> a, b;
+        for (std::string line; std::getline(first, line);) a.push_back(line);
+        for (std::string line; std::getline(second, line);) b.push_back(line);
+        std::sort(a.begin(), a.end());
+        std::sort(b.begin(), b.end());
+        CHECK(a.size() == 5003);
+        CHECK(a == b);
+
+        // A bad record stops the import; the ones before it are kept.
+        std::stringstream broken(R"({"key":"ok","value":1})" "\n" R"({"key":"bad","valu":2})" "\n");
+        CHECK_THROWS_WITH(again.importRecords(broken, RecordFormat::Ndjson),
+                          "Import failed at record 2: unknown field \"valu\".");
+        CHECK(again.read("ok") == "1");
+        std::stringstream truncated(std::string(RecordStream::MAGIC, sizeof(RecordStream::MAGIC)) + "\x05");
+        CHECK_THROWS_WITH(again.importRecords(truncated, RecordFormat::Binary), "Binary record stream is corrupt.");
+    }
+    TEST_CASE("Test Import Reaches Followers") {
+        for (const char* base : {"import_leader.json", "import_follower.json"}) {
+            std::filesystem::remove(base);
+            std::filesystem::remove(std::string(base) + ".log");
+        }
+        KVOptions leaderOptions;
+        leaderOptions.replicationBacklog = 1 << 20;
+        leaderOptions.durability = Durability::GroupCommit;
+        KVDataStore leader("import_leader.json", leaderOptions);
+        KVLeader shipper(leader, 0, "127.0.0.1");
+        shipper.start();
+        KVDataStore replica("import_follower.json");
+        KVFollower follower(replica, "127.0.0.1", shipper.port(), ReadConsistency::ReadYourWrites);
+        follower.start();
+        leader.create("before", 1);
+        CHECK(follower.read("before", leader.logPosition()) == "1");
+
+        // A follower caught up when the import lands takes a full copy that
+        // holds it, rather than stepping over the marker.
+        std::stringstream input;
+        for (int i = 0; i < 500; ++i) input << R"({"key":"imp)" << i << R"(","value":)" << i << "}\n";
+        CHECK(leader.importRecords(input, RecordFormat::Ndjson).imported == 500);
+        leader.create("after", 2);
+        LogPosition position = leader.logPosition();
+        CHECK(follower.read("after", position) == "2");
+        CHECK(follower.read("imp499", position) == "499");
+        CHECK(follower.status().resyncs == 2);
+        CHECK(replica.stats().keys == 502);
+        follower.stop();
+        shipper.stop();
+
+        // Keyless records replayed on a follower stay ordered against its
+        // checkpoints, which rotate the log under them.
+        std::thread checkpoints([&replica]() {
+            for (int i = 0; i < 50; ++i) replica.checkpoint(true);
+        });
+        for (int i = 0; i < 200; ++i) {
+            replica.applyReplicated({json{{"op", "import"}, {"records", 1}}});
+        }
+        checkpoints.join();
+        CHECK(replica.stats().keys == 502);
+    }
+
+    TEST_CASE("Test Pipelined Writes Share A Group Commit") {
+        for (const char* path : {"net_group.json", "net_group_crash.json"}) {
+            std::filesystem::remove(path);
+            std::filesystem::remove(std::string(path) + ".log");
+        }
+        KVOptions options;
+        options.durability = Durability::GroupCommit;
+        KVDataStore kvStore("net_group.json", options);
+        KVServer server(kvStore, 0, 1, "127.0.0.1");
+        server.start();
+
+        KVClient client("127.0.0.1", server.port());
+        std::vector<json> requests;
+        for (int i = 0; i < 200; ++i) {
+            requests.push_back({ {"op", "create"}, {"key", "g" + std::to_string(i)}, {"value", i} });
+        }
+        uint64_t syncsBefore = kvStore.stats().logSyncs;
+        std::vector<json> responses = client.pipeline(requests);
+        REQUIRE(responses.size() == requests.size());
+        for (const auto& response : responses) CHECK(response["ok"] == true);
+        // One sync per read pass of the loop, not one per write.
+        CHECK(kvStore.stats().logSyncs - syncsBefore < 20);
+
+        // Every acknowledged write is on disk.
+        std::filesystem::copy_file("net_group.json.log", "net_group_crash.json.log");
+        KVDataStore recovered("net_group_crash.json");
+        for (int i = 0; i < 200; ++i) {
+            CHECK(recovered.read("g" + std::to_string(i)) == std::to_string(i));
+        }
+        server.stop();
+    }
 }